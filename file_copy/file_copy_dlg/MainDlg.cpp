@@ -113,16 +113,6 @@ void CMainDlg::update_stats() {
 		case file_copy_thread::file_copy_status::idle:
 			//m_progress_bar.SetMarquee(false, 0);
 			break;
-		case file_copy_thread::file_copy_status::preparing:
-			m_progress_bar_current_read.SetMarquee(true, 30);
-			m_progress_bar_current_read.SetWindowText(_T("Preparing..."));
-			m_progress_bar_current_write.SetMarquee(true, 30);
-			m_progress_bar_current_write.SetWindowText(_T("Preparing..."));
-			m_progress_bar_total_read.SetMarquee(true, 30);
-			m_progress_bar_total_read.SetWindowText(_T("Preparing..."));
-			m_progress_bar_total_write.SetMarquee(true, 30);
-			m_progress_bar_total_write.SetWindowText(_T("Preparing..."));
-			break;
 		case file_copy_thread::file_copy_status::copying: {
 			file_copy::file_ptr file_read = m_file_copy_thread.current_read_file();
 			if (file_read) {
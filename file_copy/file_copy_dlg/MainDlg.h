@@ -100,8 +100,6 @@ protected:
 		switch (v) {
 		case file_copy_thread::file_copy_status::idle:
 			return _T("idle");
-		case file_copy_thread::file_copy_status::preparing:
-			return _T("counting");
 		case file_copy_thread::file_copy_status::copying:
 			return _T("processing");
 		case file_copy_thread::file_copy_status::completed:
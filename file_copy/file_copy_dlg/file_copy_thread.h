@@ -2,33 +2,19 @@
 
 #include <thread>
 #include <cassert>
-#include <condition_variable>
 #include <atomic>
 #include "thread_tools.h"
-#include "copy_engine.h"
-
-class copy_queue_item {
-public:
-	copy_queue_item(const std::wstring& _source, const std::wstring& _dest) :
-		source{ _source }, dest{ _dest } {
-	}
-	std::wstring source;
-	std::wstring dest;
-};
-
-using copy_queue_item_ptr = std::shared_ptr<copy_queue_item>;
-using copy_queue = thread_tools::concurrent_queue<copy_queue_item_ptr>;
+#include "copy_scheduler.h"
 
 class file_copy_thread : public thread_tools::thread_wrapper {
 public:
-	file_copy_thread() : m_copy{ file_copy::copy_engine::get_instance() } {}
+	file_copy_thread() {}
 	virtual ~file_copy_thread() {
 		die();
 	}
 	enum class file_copy_status {
 		idle,
-		preparing,
-		copying,
+		copying, // listing and copying at once (copy_engine::copy_stream)
 		completed,
 		error,
 		undefined
@@ -36,18 +22,11 @@ public:
 	virtual void operator ()() {
 		TRACE("file_copy_thread started! id: 0x%x\n", std::this_thread::get_id() );
 		notify_started();
-		
-		m_copy.init();
-		try {
-			copy_queue_item_ptr item;
 
-			while (m_queue.try_pop(item)) {
-				status(file_copy_status::preparing);
-				m_copy.copy_prepare(item->source, item->dest);
-			}
+		try {
+			// the copies from distinct devices run at once, num_to_process() grows while they're listed
 			status(file_copy_status::copying);
-			m_copy.copy_start();
-			status(file_copy_status::completed);
+			status(m_copies.run() ? file_copy_status::completed : file_copy_status::error);
 		} catch (...) {
 			assert(0);
 			status(file_copy_status::error);
@@ -56,8 +35,7 @@ public:
 	}
 
 	virtual void add(const std::wstring& source, const std::wstring& dest) {
-		copy_queue_item_ptr item{ new copy_queue_item{source, dest} };
-		m_queue.push(item);
+		m_copies.add_ts(source, dest);
 	}
 
 	file_copy_status status() {
@@ -65,19 +43,19 @@ public:
 	}
 
 	bool async() {
-		return m_copy.async();
+		return m_copies.async_ts();
 	}
 
 	const file_copy::file_ptr current_read_file() {
-		return  m_copy.current_read_ts();
+		return  m_copies.current_read_ts();
 	}
 
 	const file_copy::file_ptr current_write_file() {
-		return  m_copy.current_write_ts();
+		return  m_copies.current_write_ts();
 	}
 
 	uint64_t num_to_process() {
-		return m_copy.num_files_to_process_ts() + m_copy.num_folders_to_process_ts();
+		return m_copies.num_to_process_ts();
 	}
 
 private:
@@ -88,10 +66,5 @@ private:
 private:
 	std::atomic<file_copy_status> m_status{ file_copy_status::idle };
 
-	file_copy::copy_engine& m_copy;
-	copy_queue m_queue{ MAXINT32 };
+	file_copy::copy_scheduler m_copies;
 };
-
-
-
-
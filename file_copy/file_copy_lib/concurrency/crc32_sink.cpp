@@ -0,0 +1,136 @@
+#include "stdafx.h"
+#include "crc32_sink.h"
+#include "crc32.h"
+
+namespace file_copy {
+	using namespace std;
+
+	crc32_sink::crc32_sink(const unsigned int& workers, const unsigned int& queue_size) :
+		m_cq{ make_shared<crc32_job_queue>(queue_size) } {
+		for (unsigned int i = 0; i < (workers ? workers : 1U); ++i)
+			m_workers.push_back(make_shared<worker>(*this));
+	}
+
+	void crc32_sink::run() {
+		if (m_running)
+			return;
+		for (auto& w : m_workers)
+			w->run();
+		m_running = true;
+	}
+
+	void crc32_sink::push(const file_ptr& fp, const io_buffer_ptr& buff, const size_t& count, const uint64_t& offset, const bool& last) {
+		assert(m_running);
+		crc32_job job;
+		job.fp = fp;
+		job.buff = buff;
+		job.count = count;
+		job.offset = offset;
+		job.last = last;
+
+		++m_pending;
+		m_cq->push(job);
+	}
+
+	void crc32_sink::push_crc(const file_ptr& fp, const uint32_t& crc, const uint64_t& count, const uint64_t& offset, const bool& last) {
+		publish(*fp, crc, count, offset, last);
+	}
+
+	void crc32_sink::commit() {
+		TRACE("committing crc32 queue\n");
+		unique_lock<mutex> lk(m_mutex_pending);
+		m_cv_pending.wait(lk, [this] { return !m_pending.load(); });
+	}
+
+	void crc32_sink::die() {
+		if (!m_running)
+			return;
+		commit();
+		for (auto& w : m_workers)
+			w->die();
+		m_running = false;
+	}
+
+	void crc32_sink::process(crc32_job& job) {
+		file& f = *job.fp;
+		uint32_t crc = job.count ? crc32::crc32_hw(job.buff->data(), job.count) : 0U;
+		job.buff.reset(); // back to the pool before waiting for the file lock
+
+		publish(f, crc, job.count, job.offset, job.last);
+
+		if (!--m_pending) {
+			lock_guard<mutex> lk(m_mutex_pending);
+			m_cv_pending.notify_all();
+		}
+	}
+
+	void crc32_sink::publish(file& f, const uint32_t& crc, const uint64_t& count, const uint64_t& offset, const bool& last) {
+		lock_guard<mutex> l(f.m_mutex_crc32);
+		if (last)
+			f.m_crc32_end = offset + count;
+		merge(f, offset, crc, count);
+		if (f.m_crc32_next_offset == f.m_crc32_end) {
+			f.crc32_ts(f.m_crc32_running);
+			f.m_crc32_ready = true;
+			f.m_cv_crc32.notify_all();
+		}
+	}
+
+	// Returns the crc32 combine operator of count bytes. Every chunk but the last of a file is a power of two
+	// (see block_sizer): those share a table built once.
+	static uint32_t combine_op(const uint64_t& count) {
+		static const std::vector<uint32_t> pow2_ops = [] {
+			std::vector<uint32_t> v(64);
+			for (size_t i = 0; i < v.size(); ++i)
+				v[i] = crc32::crc32_combine_gen(1ULL << i);
+			return v;
+		}();
+		if (count && !(count & (count - 1))) {
+			size_t i = 0;
+			while ((static_cast<uint64_t>(1) << i) != count)
+				++i;
+			return pow2_ops[i];
+		}
+		return crc32::crc32_combine_gen(count);
+	}
+
+	void crc32_sink::merge(file& f, const uint64_t& offset, const uint32_t& crc, const uint64_t& count) {
+		if (offset != f.m_crc32_next_offset) { // a previous chunk is still being hashed, keep it for later
+			f.m_crc32_pending[offset] = make_pair(crc, count);
+			return;
+		}
+
+		f.m_crc32_running = crc32::crc32_combine_op(f.m_crc32_running, crc, combine_op(count));
+		f.m_crc32_next_offset += count;
+
+		auto it = f.m_crc32_pending.begin();
+		while (it != f.m_crc32_pending.end() && it->first == f.m_crc32_next_offset) {
+			uint64_t next_count = it->second.second;
+			f.m_crc32_running = crc32::crc32_combine_op(f.m_crc32_running, it->second.first, combine_op(next_count));
+			f.m_crc32_next_offset += next_count;
+			it = f.m_crc32_pending.erase(it);
+		}
+	}
+
+	bool crc32_sink::processNext() {
+		crc32_job job;
+
+		if (!m_cq->timed_wait_and_pop(job, 100))
+			return false;
+
+		process(job);
+		return true;
+	}
+
+	void crc32_sink::worker::operator()() {
+		TRACE("crc32 sink thread started\n");
+		notify_started();
+
+		do {
+			m_owner.processNext();
+		} while (!m_stop_now.load(memory_order_acquire));
+
+		while (m_owner.processNext());
+		TRACE("crc32 sink thread finished\n");
+	}
+} // /file_copy
@@ -0,0 +1,158 @@
+#include "stdafx.h"
+#include <thread>
+#include "dir_walker.h"
+
+namespace file_copy {
+	using namespace std;
+
+	dir_walker::dir_walker(const unsigned int& workers, const bool& incremental) :
+		m_workers{ workers ? workers : 1U }, m_incremental{ incremental } {
+		for (unsigned int i = 0; i < m_workers; ++i)
+			m_deques.push_back(unique_ptr<work_deque>{ new work_deque });
+	}
+
+	dir_walker::node_ptr dir_walker::walk(const file_ptr& source, const file_ptr& dest) {
+		node_ptr root{ new node };
+		root->source = source;
+		root->dest = dest;
+		m_stream = nullptr;
+		run(root.get());
+		return root;
+	}
+
+	void dir_walker::walk(const file_ptr& source, const file_ptr& dest, const stream_fn& fn) {
+		node* root = new node; // deleted by complete(), once handed over
+		root->source = source;
+		root->dest = dest;
+		m_stream = fn;
+		run(root);
+		m_stream = nullptr;
+	}
+
+	void dir_walker::run(node* root) {
+		m_outstanding.store(1U);
+		m_deques[0]->nodes.push_back(root);
+
+		vector<thread> threads;
+		for (unsigned int i = 1; i < m_workers; ++i)
+			threads.emplace_back([this, i] { work(i); });
+		work(0);
+		for (auto& t : threads)
+			t.join();
+	}
+
+	void dir_walker::work(const size_t& index) {
+		for (;;) {
+			node* n = next(index);
+			if (n) {
+				list(*n, index);
+				if (m_outstanding.fetch_sub(1U) == 1U) { // the last directory was listed, wake everybody up to leave
+					lock_guard<mutex> l(m_mutex_idle);
+					m_cv_idle.notify_all();
+				}
+				continue;
+			}
+
+			unique_lock<mutex> l(m_mutex_idle);
+			if (!m_outstanding.load())
+				return;
+			// others are still listing and may queue more directories
+			m_cv_idle.wait_for(l, chrono::milliseconds(1));
+		}
+	}
+
+	dir_walker::node* dir_walker::next(const size_t& index) {
+		{ // own deque, newest first (depth first, the parent's entries are still hot in the cache)
+			work_deque& d = *m_deques[index];
+			lock_guard<mutex> l(d.mutex);
+			if (!d.nodes.empty()) {
+				node* n = d.nodes.back();
+				d.nodes.pop_back();
+				return n;
+			}
+		}
+		for (size_t i = 1; i < m_deques.size(); ++i) { // steal the oldest (biggest subtree) from the others
+			work_deque& d = *m_deques[(index + i) % m_deques.size()];
+			lock_guard<mutex> l(d.mutex);
+			if (!d.nodes.empty()) {
+				node* n = d.nodes.front();
+				d.nodes.pop_front();
+				return n;
+			}
+		}
+		return nullptr;
+	}
+
+	void dir_walker::list(node& n, const size_t& index) {
+		vector<node*> subdirs;
+		map<wstring, win32_attributes_ptr> existing; // incremental mode: the files of the destination directory
+		if (m_incremental) {
+			list_directory(n.dest->path_full(), [&](const std::wstring& name, const win32_attributes_ptr& attributes) {
+				if (!(attributes->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+					existing.emplace(name, attributes);
+			});
+		}
+		n.listed = list_directory(n.source->path_full(), [&](const std::wstring& name, const win32_attributes_ptr& attributes) {
+			auto it = existing.find(name);
+			if (it != existing.end() && same_size_and_time(*attributes, *it->second)) {
+				++m_skipped_files;
+				m_skipped_size += (static_cast<uint64_t>(attributes->nFileSizeHigh) << 32) | attributes->nFileSizeLow;
+				return;
+			}
+			entry e;
+			e.source.reset(new file{ n.source->path(), name, n.source });
+			e.source->win32_attributes(attributes);
+			e.dest.reset(new file{ n.dest->path(), name, n.dest });
+			if (it != existing.end()) // out of date: updated in place
+				e.dest->exist_choice_ts(file::exist_decision::overwrite);
+			if (e.source->is_directory()) {
+				node* dir = new node;
+				dir->source = e.source;
+				dir->dest = e.dest;
+				subdirs.push_back(dir);
+				if (m_stream) {
+					dir->parent = &n;
+					return; // owned by the walk until complete() hands it over
+				}
+				e.dir.reset(dir);
+			}
+			n.entries.push_back(std::move(e));
+		});
+
+		if (m_stream) // the subdirectories must be accounted before any of them can complete
+			n.pending.fetch_add(subdirs.size());
+
+		if (!subdirs.empty()) {
+			m_outstanding.fetch_add(subdirs.size());
+			{
+				work_deque& d = *m_deques[index];
+				lock_guard<mutex> l(d.mutex);
+				// reversed, so the first subdirectory is listed next
+				d.nodes.insert(d.nodes.end(), subdirs.rbegin(), subdirs.rend());
+			}
+			m_cv_idle.notify_all();
+		}
+
+		if (m_stream) { // hand the files over once the others can already list the subdirectories
+			uint64_t size = 0U;
+			for (auto& e : n.entries) {
+				size += e.source->size_ts();
+				m_stream(e.source, e.dest, nullptr);
+			}
+			n.size.fetch_add(size);
+			n.entries.clear();
+			complete(&n);
+		}
+	}
+
+	void dir_walker::complete(node* n) {
+		while (n && n->pending.fetch_sub(1U) == 1U) {
+			m_stream(n->source, n->dest, n);
+			node* parent = n->parent;
+			if (parent)
+				parent->size.fetch_add(n->size.load());
+			delete n;
+			n = parent;
+		}
+	}
+}
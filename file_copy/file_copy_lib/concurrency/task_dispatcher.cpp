@@ -0,0 +1,88 @@
+#include "stdafx.h"
+#include "task_dispatcher.h"
+
+namespace file_copy {
+	using namespace std;
+
+	task_dispatcher::job_ptr task_dispatcher::join_ts(const uint64_t& device) {
+		lock_guard<mutex> l(m_mutex);
+		device_sink& s = m_sinks[device];
+		if (!s.sink) {
+			s.queue = make_shared<task_queue>(m_queue_size);
+			unsigned int workers = m_pool_size ? m_pool_size(device) : 1U;
+			TRACE("task dispatcher: device %llu gets %u writer(s)\n", static_cast<unsigned long long>(device), workers);
+			s.sink = make_shared<task_sink>(s.queue, workers);
+		}
+		++s.jobs;
+		return make_shared<job>(*this, device, s.queue, s.sink);
+	}
+
+	size_t task_dispatcher::size_ts() {
+		lock_guard<mutex> l(m_mutex);
+		size_t ret = 0;
+		for (auto& x : m_sinks)
+			ret += x.second.queue->size();
+		return ret;
+	}
+
+	void task_dispatcher::run_ts(const uint64_t& device) {
+		lock_guard<mutex> l(m_mutex);
+		device_sink& s = m_sinks[device];
+		if (!s.running) {
+			s.sink->run();
+			s.running = true;
+		}
+	}
+
+	void task_dispatcher::leave_ts(const uint64_t& device) {
+		task_sink_ptr sink;
+		{
+			lock_guard<mutex> l(m_mutex);
+			auto it = m_sinks.find(device);
+			assert(it != m_sinks.end() && it->second.jobs);
+			if (--it->second.jobs)
+				return;
+			sink = it->second.sink;
+			m_sinks.erase(it); // the next copy to this device gets new writers
+		}
+		sink->die(); // nothing left to write: only stops the workers
+	}
+
+	void task_dispatcher::job::push(const task_ptr& task) {
+		{
+			lock_guard<mutex> l(m_mutex);
+			++m_pending;
+		}
+		m_queue->push(make_shared<counted_task>(task, shared_from_this()));
+	}
+
+	void task_dispatcher::job::finish() {
+		if (m_finished)
+			return;
+		{
+			unique_lock<mutex> l(m_mutex);
+			m_cv.wait(l, [this] { return !m_pending; });
+		}
+		m_finished = true;
+		m_owner.leave_ts(m_device);
+	}
+
+	void task_dispatcher::job::task_done() {
+		lock_guard<mutex> l(m_mutex);
+		if (!--m_pending)
+			m_cv.notify_all();
+	}
+
+	bool task_dispatcher::job::counted_task::operator()() {
+		bool ret = false;
+		try {
+			ret = (*m_task)();
+		} catch (...) {
+			m_owner->task_done();
+			throw;
+		}
+		m_task.reset(); // releases its buffers before the copy can see it done
+		m_owner->task_done();
+		return ret;
+	}
+}
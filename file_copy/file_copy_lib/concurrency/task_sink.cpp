@@ -1,4 +1,4 @@
-#include "StdAfx.h"
+#include "stdafx.h"
 #include "task_sink.h"
 #include "tools.h"
 #include "task.h"
@@ -8,6 +8,20 @@ namespace file_copy {
 	using namespace std;
 	using namespace thread_tools;
 
+	task_sink::task_sink(task_queue_ptr cq, const unsigned int& workers) :
+		m_cq(cq) {
+		for (unsigned int i = 0; i < (workers ? workers : 1U); ++i)
+			m_workers.push_back(make_shared<worker>(*this));
+	}
+
+	void task_sink::run() {
+		if (m_running)
+			return;
+		for (auto& w : m_workers)
+			w->run();
+		m_running = true;
+	}
+
 	bool task_sink::processNext() {
 		std::string msg;
 
@@ -29,15 +43,15 @@ namespace file_copy {
 		return processed;
 	}
 
-	void task_sink::operator()() {
+	void task_sink::worker::operator()() {
 		TRACE("task sink thread started\n");
 		notify_started();
 
 		do {
-			processNext();
+			m_owner.processNext();
 		} while (!m_stop_now.load(memory_order_acquire));
 
-		commit();
+		while (m_owner.processNext());
 		TRACE("task sink thread finished\n");
 	}
 
@@ -47,4 +61,12 @@ namespace file_copy {
 			processNext();
 		}
 	}
-} // /file_copy
\ No newline at end of file
+
+	void task_sink::die() {
+		if (!m_running)
+			return;
+		for (auto& w : m_workers)
+			w->die();
+		m_running = false;
+	}
+} // /file_copy
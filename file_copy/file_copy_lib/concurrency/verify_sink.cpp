@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "verify_sink.h"
+#include "buffer_pool.h"
+#include "crc32.h"
+
+namespace file_copy {
+	using namespace std;
+
+	const size_t VERIFY_ALIGNMENT = 4096;
+
+	verify_sink::verify_sink(const unsigned int& workers, const unsigned int& queue_size) :
+		m_cq{ make_shared<verify_job_queue>(queue_size) } {
+		for (unsigned int i = 0; i < (workers ? workers : 1U); ++i)
+			m_workers.push_back(make_shared<worker>(*this));
+	}
+
+	void verify_sink::run() {
+		if (m_running)
+			return;
+		for (auto& w : m_workers)
+			w->run();
+		m_running = true;
+	}
+
+	void verify_sink::push(const file_ptr& source, const file_ptr& dest) {
+		assert(m_running);
+		verify_job job;
+		job.source = source;
+		job.dest = dest;
+
+		++m_pending;
+		m_cq->push(job);
+	}
+
+	void verify_sink::commit() {
+		TRACE("committing verify queue\n");
+		unique_lock<mutex> lk(m_mutex_pending);
+		m_cv_pending.wait(lk, [this] { return !m_pending.load(); });
+	}
+
+	void verify_sink::die() {
+		if (!m_running)
+			return;
+		commit();
+		for (auto& w : m_workers)
+			w->die();
+		m_running = false;
+	}
+
+	void verify_sink::process(const verify_job& job, char* buffer) {
+		file& source = *job.source;
+		file& dest = *job.dest;
+
+		auto source_status = source.status_ts();
+		if (source_status != file::file_status::failed_open && source_status != file::file_status::failed) {
+			source.wait_crc32_ts(); // the source is still being hashed
+
+			uint32_t crc = 0U;
+			io_backend_ptr io = make_io_backend();
+			errno_t res = io->open_read_uncached(dest.path_full());
+			while (!res && !io->is_eof()) {
+				size_t count = READ_SIZE;
+				res = io->read(buffer, count);
+				if (!count)
+					break;
+				crc = crc32::crc32_hw(buffer, count, crc);
+			}
+			io->close(false);
+
+			if (!res && crc == source.crc32_ts()) {
+				dest.status_ts(file::file_status::verified);
+			} else {
+				++m_mismatches;
+				dest.status_ts(file::file_status::verify_failed);
+				TRACE(_T("Verification failed : file path : %s : crc32 %08x expected %08x : error %d\n"), dest.path_full().c_str(), crc, source.crc32_ts(), res);
+			}
+		}
+
+		if (!--m_pending) {
+			lock_guard<mutex> lk(m_mutex_pending);
+			m_cv_pending.notify_all();
+		}
+	}
+
+	bool verify_sink::processNext(char* buffer) {
+		verify_job job;
+
+		if (!m_cq->timed_wait_and_pop(job, 100))
+			return false;
+
+		process(job, buffer);
+		return true;
+	}
+
+	verify_sink::worker::worker(verify_sink& owner) :
+		m_owner(owner), m_buffer{ aligned_alloc_buffer(READ_SIZE, VERIFY_ALIGNMENT) } {
+		if (!m_buffer)
+			throw std::bad_alloc();
+	}
+
+	verify_sink::worker::~worker() {
+		die(); // the thread must be gone before its buffer
+		aligned_free_buffer(m_buffer);
+	}
+
+	void verify_sink::worker::operator()() {
+		TRACE("verify sink thread started\n");
+		notify_started();
+
+		do {
+			m_owner.processNext(m_buffer);
+		} while (!m_stop_now.load(memory_order_acquire));
+
+		while (m_owner.processNext(m_buffer));
+		TRACE("verify sink thread finished\n");
+	}
+} // /file_copy
@@ -0,0 +1,347 @@
+// //////////////////////////////////////////////////////////
+// CRC32 kernels based on carry-less multiplication and the runtime dispatch between them
+
+#include "stdafx.h"
+#include "crc32.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CRC32_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// the AVX-512 VPCLMULQDQ intrinsics need Visual Studio 2019 or gcc / clang
+#if defined(CRC32_X86) && (defined(__GNUC__) || defined(__clang__) || (defined(_MSC_VER) && _MSC_VER >= 1920))
+#define CRC32_VPCLMUL 1
+#endif
+
+// gcc / clang only emit the instructions in functions flagged for them, Visual Studio always does
+#if defined(__GNUC__) || defined(__clang__)
+#define CRC32_TARGET(x) __attribute__((target(x)))
+#else
+#define CRC32_TARGET(x)
+#endif
+
+namespace crc32 {
+#ifdef CRC32_X86
+	namespace {
+		// folding constants of the bit-reflected polynomial: x^(n) mod P, reflected and shifted left by one
+		alignas(16) const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 }; // fold by 512 bits (x^544, x^480)
+		alignas(16) const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e }; // fold by 128 bits (x^160, x^96)
+		alignas(16) const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 }; // fold 64 into 32 bits (x^64)
+		alignas(16) const uint64_t poly[] = { 0x01db710641, 0x01f7011641 }; // P' and Barrett's u'
+		alignas(16) const uint64_t k2048[] = { 0x011542778a, 0x01322d1430 }; // fold by 2048 bits (x^2080, x^2016)
+
+		// Folds the 4 x 128 bits accumulators into one, then the remaining 16 bytes blocks, and reduces it to 32 bits.
+		// Parameters:
+		//    x1..x4: [in] accumulators of the last 64 bytes folded
+		//    const uint8_t* buf: [in] remaining data
+		//    size_t len: [in] remaining length (multiple of 16)
+		// Returns: uint32_t: CRC (not inverted)
+		CRC32_TARGET("pclmul,sse4.1")
+		inline uint32_t fold_and_reduce(__m128i x1, __m128i x2, __m128i x3, __m128i x4, const uint8_t* buf, size_t len) {
+			__m128i x0, x5;
+
+			// fold into 128 bits
+			x0 = _mm_load_si128((const __m128i*)k3k4);
+
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(x1, x2);
+			x1 = _mm_xor_si128(x1, x5);
+
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(x1, x3);
+			x1 = _mm_xor_si128(x1, x5);
+
+			x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+			x1 = _mm_xor_si128(x1, x4);
+			x1 = _mm_xor_si128(x1, x5);
+
+			// single fold blocks of 16, if any
+			while (len >= 16) {
+				x2 = _mm_loadu_si128((const __m128i*)buf);
+
+				x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+				x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+				x1 = _mm_xor_si128(x1, x2);
+				x1 = _mm_xor_si128(x1, x5);
+
+				buf += 16;
+				len -= 16;
+			}
+
+			// fold 128 bits to 64 bits
+			x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+			x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+			x1 = _mm_srli_si128(x1, 8);
+			x1 = _mm_xor_si128(x1, x2);
+
+			x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+
+			x2 = _mm_srli_si128(x1, 4);
+			x1 = _mm_and_si128(x1, x3);
+			x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+			x1 = _mm_xor_si128(x1, x2);
+
+			// Barrett reduction to 32 bits
+			x0 = _mm_load_si128((const __m128i*)poly);
+
+			x2 = _mm_and_si128(x1, x3);
+			x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+			x2 = _mm_and_si128(x2, x3);
+			x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+			x1 = _mm_xor_si128(x1, x2);
+
+			return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+		}
+
+		// Parameters:
+		//    const uint8_t* buf: [in] data
+		//    size_t len: [in] length, at least 64 and multiple of 16
+		//    uint32_t crc: [in] running CRC (not inverted)
+		// Returns: uint32_t: CRC (not inverted)
+		CRC32_TARGET("pclmul,sse4.1")
+		uint32_t pclmul_fold(const uint8_t* buf, size_t len, uint32_t crc) {
+			__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+			x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+			x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+			x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+			x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+
+			x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+
+			x0 = _mm_load_si128((const __m128i*)k1k2);
+
+			buf += 64;
+			len -= 64;
+
+			// parallel fold blocks of 64, if any
+			while (len >= 64) {
+				x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+				x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+				x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+				x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+				x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+				x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+				x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+				x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+				y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+				y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+				y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+				y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+
+				x1 = _mm_xor_si128(x1, x5);
+				x2 = _mm_xor_si128(x2, x6);
+				x3 = _mm_xor_si128(x3, x7);
+				x4 = _mm_xor_si128(x4, x8);
+
+				x1 = _mm_xor_si128(x1, y5);
+				x2 = _mm_xor_si128(x2, y6);
+				x3 = _mm_xor_si128(x3, y7);
+				x4 = _mm_xor_si128(x4, y8);
+
+				buf += 64;
+				len -= 64;
+			}
+
+			return fold_and_reduce(x1, x2, x3, x4, buf, len);
+		}
+
+#ifdef CRC32_VPCLMUL
+		// folds the four 128 bits lanes of x by the distance of k
+		CRC32_TARGET("avx512f,vpclmulqdq")
+		inline __m512i fold_512(const __m512i& x, const __m512i& k, const __m512i& data) {
+			__m512i lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+			__m512i hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+			return _mm512_ternarylogic_epi64(lo, hi, data, 0x96); // lo ^ hi ^ data
+		}
+
+		// The masked broadcast / extract forms below merge into an explicit zero instead of
+		// the undefined register the plain intrinsics use, which keeps gcc's -Wuninitialized quiet.
+
+		// loads the 128 bits constant at k into the four lanes
+		CRC32_TARGET("avx512f")
+		inline __m512i broadcast_128(const uint64_t* k) {
+			return _mm512_mask_broadcast_i32x4(_mm512_setzero_si512(), 0xFFFF, _mm_load_si128((const __m128i*)k));
+		}
+
+		// lane n (0 to 3) of x
+		template <int n>
+		CRC32_TARGET("avx512f")
+		inline __m128i lane_128(const __m512i& x) {
+			return _mm512_mask_extracti32x4_epi32(_mm_setzero_si128(), 0xFF, x, n);
+		}
+
+		// Same as pclmul_fold, with 4 x 512 bits accumulators.
+		// Parameters:
+		//    const uint8_t* buf: [in] data
+		//    size_t len: [in] length, at least 256 and multiple of 16
+		//    uint32_t crc: [in] running CRC (not inverted)
+		// Returns: uint32_t: CRC (not inverted)
+		CRC32_TARGET("avx512f,vpclmulqdq,pclmul,sse4.1")
+		uint32_t vpclmul_fold(const uint8_t* buf, size_t len, uint32_t crc) {
+			__m512i x0 = _mm512_loadu_si512((const void*)(buf + 0x00));
+			__m512i x1 = _mm512_loadu_si512((const void*)(buf + 0x40));
+			__m512i x2 = _mm512_loadu_si512((const void*)(buf + 0x80));
+			__m512i x3 = _mm512_loadu_si512((const void*)(buf + 0xc0));
+
+			x0 = _mm512_xor_si512(x0, _mm512_inserti32x4(_mm512_setzero_si512(), _mm_cvtsi32_si128(static_cast<int>(crc)), 0));
+
+			buf += 256;
+			len -= 256;
+
+			// parallel fold blocks of 256
+			__m512i k = broadcast_128(k2048);
+			while (len >= 256) {
+				x0 = fold_512(x0, k, _mm512_loadu_si512((const void*)(buf + 0x00)));
+				x1 = fold_512(x1, k, _mm512_loadu_si512((const void*)(buf + 0x40)));
+				x2 = fold_512(x2, k, _mm512_loadu_si512((const void*)(buf + 0x80)));
+				x3 = fold_512(x3, k, _mm512_loadu_si512((const void*)(buf + 0xc0)));
+
+				buf += 256;
+				len -= 256;
+			}
+
+			// fold the 4 accumulators into one, then the remaining blocks of 64
+			k = broadcast_128(k1k2);
+			x1 = fold_512(x0, k, x1);
+			x2 = fold_512(x1, k, x2);
+			x0 = fold_512(x2, k, x3);
+			while (len >= 64) {
+				x0 = fold_512(x0, k, _mm512_loadu_si512((const void*)buf));
+				buf += 64;
+				len -= 64;
+			}
+
+			return fold_and_reduce(
+				lane_128<0>(x0),
+				lane_128<1>(x0),
+				lane_128<2>(x0),
+				lane_128<3>(x0),
+				buf, len);
+		}
+#endif
+
+		// cpuid leaf / subleaf into regs (eax, ebx, ecx, edx)
+		inline void cpuid(const int& leaf, const int& subleaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+			__cpuidex(reinterpret_cast<int*>(regs), leaf, subleaf);
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		// Returns the register state enabled by the operating system (XCR0)
+		inline uint64_t xgetbv0() {
+#if defined(_MSC_VER)
+			return _xgetbv(0);
+#else
+			unsigned int eax, edx;
+			__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+		}
+
+		crc32_kernel detect_kernel() {
+			unsigned int regs[4];
+			cpuid(0, 0, regs);
+			unsigned int max_leaf = regs[0];
+			if (max_leaf < 1)
+				return crc32_kernel::slicing_by_16;
+
+			cpuid(1, 0, regs);
+			bool pclmul = (regs[2] & (1U << 1)) != 0;
+			bool sse41 = (regs[2] & (1U << 19)) != 0;
+			bool osxsave = (regs[2] & (1U << 27)) != 0;
+			if (!pclmul || !sse41)
+				return crc32_kernel::slicing_by_16;
+
+#ifdef CRC32_VPCLMUL
+			if (osxsave && max_leaf >= 7) {
+				// the OS must save the xmm, ymm and zmm (opmask, upper 256 bits, upper 16 registers) state
+				const uint64_t zmm_state = (1U << 1) | (1U << 2) | (1U << 5) | (1U << 6) | (1U << 7);
+				cpuid(7, 0, regs);
+				bool avx512f = (regs[1] & (1U << 16)) != 0;
+				bool vpclmul = (regs[2] & (1U << 10)) != 0;
+				if (avx512f && vpclmul && (xgetbv0() & zmm_state) == zmm_state)
+					return crc32_kernel::vpclmul;
+			}
+#endif
+			return crc32_kernel::pclmul;
+		}
+	}
+
+	uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32) {
+		if (length < 64)
+			return crc32_16bytes(data, length, previousCrc32);
+
+		const uint8_t* buf = static_cast<const uint8_t*>(data);
+		size_t chunk = length & ~static_cast<size_t>(15);
+		uint32_t crc = ~pclmul_fold(buf, chunk, ~previousCrc32);
+		return crc32_1byte(buf + chunk, length - chunk, crc);
+	}
+
+	uint32_t crc32_vpclmul(const void* data, size_t length, uint32_t previousCrc32) {
+#ifdef CRC32_VPCLMUL
+		if (length < 256)
+			return crc32_pclmul(data, length, previousCrc32);
+
+		const uint8_t* buf = static_cast<const uint8_t*>(data);
+		size_t chunk = length & ~static_cast<size_t>(15);
+		uint32_t crc = ~vpclmul_fold(buf, chunk, ~previousCrc32);
+		return crc32_1byte(buf + chunk, length - chunk, crc);
+#else
+		return crc32_pclmul(data, length, previousCrc32);
+#endif
+	}
+
+	crc32_kernel crc32_hw_kernel() {
+		static const crc32_kernel kernel = detect_kernel();
+		return kernel;
+	}
+#else // not x86
+	uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32) {
+		return crc32_16bytes_prefetch(data, length, previousCrc32);
+	}
+
+	uint32_t crc32_vpclmul(const void* data, size_t length, uint32_t previousCrc32) {
+		return crc32_16bytes_prefetch(data, length, previousCrc32);
+	}
+
+	crc32_kernel crc32_hw_kernel() {
+		return crc32_kernel::slicing_by_16;
+	}
+#endif
+
+	const char* crc32_kernel_name(const crc32_kernel& kernel) {
+		switch (kernel) {
+		case crc32_kernel::pclmul:
+			return "pclmul";
+		case crc32_kernel::vpclmul:
+			return "vpclmul";
+		default:
+			return "slicing_by_16";
+		}
+	}
+
+	uint32_t crc32_hw(const void* data, size_t length, uint32_t previousCrc32) {
+		switch (crc32_hw_kernel()) {
+		case crc32_kernel::vpclmul:
+			return crc32_vpclmul(data, length, previousCrc32);
+		case crc32_kernel::pclmul:
+			return crc32_pclmul(data, length, previousCrc32);
+		default:
+			return crc32_16bytes_prefetch(data, length, previousCrc32);
+		}
+	}
+}
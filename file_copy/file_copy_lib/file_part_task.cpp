@@ -7,87 +7,202 @@ using namespace file_copy;
 
 bool file_part_task::operator()() {
 	bool ret = true;
+	if (m_small_file) // small file: a single chunk, the CRC of the whole source
+		m_source->crc32_whole_ts(m_write_buff_count ? crc32::crc32_hw(m_write_buff->data() + m_buff_offset, m_write_buff_count) : 0U);
 	try {
-		if (!m_fp->get_FILE()) {
-			if (m_fp->check_exists() != INVALID_FILE_ATTRIBUTES) { // file already exists!
-				TRACE(_T("File already exists : file path : %s\n"), m_fp->path_full());
-				// decide what to do
-				auto choice = m_fp->on_existing();
+		if (open_once()) {
+			if (m_kernel_copy ? !kernel_copy_commit() : m_range ? !range_commit() : !write_buff_commit()) {
+				m_fp->status_ts(file::file_status::failed);
+				ret = false;
+			}
+		}
+	} catch (std::exception& e) {
+		TRACE("exception when processing write! %s\n", e.what());
+		m_fp->status_ts(file::file_status::failed);
+		ret = false;
+	}
+	m_write_buff.reset(); // back to the pool as soon as possible
+
+	if (m_fp->chunk_done_ts()) { // every chunk of the file is done, commit it
+		if (m_range) // every range was read
+			m_source->close(m_source->status_ts() == file::file_status::failed_open);
+		if (m_fp->is_open()) {
+			bool failed = m_fp->status_ts() == file::file_status::failed;
+			try {
+				if (!failed)
+					m_fp->commit_file_basic_info();
+			} catch (std::exception& e) {
+				TRACE("exception when committing write! %s\n", e.what());
+				failed = true;
+				ret = false;
+			}
+			try {
+				m_fp->close(failed);
+				if (!failed && m_source)
+					m_engine.verify_ts(m_source, m_fp); // read it back while the copy goes on
+			} catch (std::exception& e) {
+				TRACE("exception when closing write! %s\n", e.what());
+				ret = false;
+			}
+		}
+		m_fp->finished_ts(); // always, the parent folder is waiting for it
+	}
+	return ret;
+}
+
+bool file_part_task::open_once() {
+	// the first chunk of the file to reach a worker opens it, the others just check the outcome
+	std::lock_guard<std::mutex> l(m_fp->m_mutex_write);
+	switch (m_fp->status_ts()) {
+	case file::file_status::idle:
+		break;
+	case file::file_status::open_write:
+		return true;
+	default: // skipped or failed
+		return false;
+	}
 
-				switch (choice) {
-				case file::exist_decision::skip:
-					m_fp->status_ts(file::file_status::skipped);
-					TRACE(_T("Skipping file : file path : %s\n"), m_fp->path_full().c_str());
-					return true;
-				case file::exist_decision::overwrite:
-					TRACE(_T("Overwriting file : file path : %s\n"), m_fp->path_full().c_str());
-					break;
-				case file::exist_decision::rename: {// TODO rename the file
-					TRACE(_T("Renaming file : file path : %s\n"), m_fp->path_full().c_str());
+	try {
+		if (m_fp->check_exists() != INVALID_FILE_ATTRIBUTES) { // file already exists!
+			TRACE(_T("File already exists : file path : %s\n"), m_fp->path_full().c_str());
+			// decide what to do
+			auto choice = m_fp->on_existing();
+
+			switch (choice) {
+			case file::exist_decision::skip:
+				m_fp->status_ts(file::file_status::skipped);
+				TRACE(_T("Skipping file : file path : %s\n"), m_fp->path_full().c_str());
+				return false;
+			case file::exist_decision::overwrite:
+				TRACE(_T("Overwriting file : file path : %s\n"), m_fp->path_full().c_str());
+				break;
+			case file::exist_decision::rename: {// TODO rename the file
+				TRACE(_T("Renaming file : file path : %s\n"), m_fp->path_full().c_str());
 #ifdef _DEBUG
-					std::wstring original_file_name = m_fp->path_full().c_str();
+				std::wstring original_file_name = m_fp->path_full().c_str();
 #endif
-					m_fp->rename_to_non_existing();
+				m_fp->rename_to_non_existing();
 #ifdef _DEBUG
-					TRACE(_T("Renamed file : %s to file : %s\n"), original_file_name, m_fp->file_name());
+				TRACE(_T("Renamed file : %s to file : %s\n"), original_file_name.c_str(), m_fp->file_name().c_str());
 #endif
-				} break;
-				case file::exist_decision::ask: {
-					std::wostringstream os;
-					os << "Writing failed! : \"exist_decision::ask\" shouldn't be set : file path: " << m_fp->path_full();
-					TRACE(_T("%s\n"), os.str().c_str());
-					throw std::runtime_error(wstring_to_string(os.str()));
-				} break;
-				default: {
-					std::wostringstream os;
-					os << "Writing failed! : unknown decision : file path: " << m_fp->path_full();
-					TRACE(_T("%s\n"), os.str().c_str());
-					throw std::runtime_error(wstring_to_string(os.str()));
-				}
-				}
+			} break;
+			case file::exist_decision::ask: {
+				std::wostringstream os;
+				os << "Writing failed! : \"exist_decision::ask\" shouldn't be set : file path: " << m_fp->path_full();
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
+			} break;
+			default: {
+				std::wostringstream os;
+				os << "Writing failed! : unknown decision : file path: " << m_fp->path_full();
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
 			}
-			
-			{ // update copy engine's monitoring variable
-				static file* prev_file = nullptr;
-				if (prev_file != m_fp.get()) {
-					prev_file = m_fp.get();
-					copy_engine::get_instance().current_write_ts(m_fp);
-				}
 			}
+		}
+		
+		m_engine.current_write_ts(m_fp); // update copy engine's monitoring variable
 
-			auto res = m_fp->open_write_preallocate();
-			if (res) {
-				if (!create_dir(m_fp->folder()))
-					ret = false;
-				else {
-					res = m_fp->open_write_preallocate();
-				}
+		bool ret = true;
+		// a kernel copy doesn't need the blocks reserved (a reflink would just drop them), nor does a small file written at once.
+		// A sparse file keeps its holes: no blocks reserved for them.
+		auto open = [this] { return m_kernel_copy || m_small_file ? m_fp->open_write() : m_fp->sparse() ? m_fp->open_write_sparse() : m_fp->open_write_preallocate(); };
+		auto res = open();
+		if (res) {
+			if (!create_dir(m_fp->folder()))
+				ret = false;
+			else {
+				res = open();
 			}
-			if (!ret) {
-				if (res) {
-					std::wostringstream os;
-					os << "Writing failed! : Couldn't open and preallocate file : file path: " << m_fp->path_full()
-						<< " : " << std::showbase << std::setfill(_T('0')) << std::setw(4) << std::hex << res;
-					TRACE(_T("%s\n"), os.str().c_str());
-					throw std::runtime_error(wstring_to_string(os.str()));
-				} else {
-					std::wostringstream os;
-					os << "Writing failed! : Couldn't open file : file path: " << m_fp->path_full();
-					TRACE(_T("%s\n"), os.str().c_str());
-					throw std::runtime_error(wstring_to_string(os.str()));
-				}
+		}
+		if (!ret || res) {
+			if (res) {
+				std::wostringstream os;
+				os << "Writing failed! : Couldn't open and preallocate file : file path: " << m_fp->path_full()
+					<< " : " << std::showbase << std::setfill(_T('0')) << std::setw(4) << std::hex << res;
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
+			} else {
+				std::wostringstream os;
+				os << "Writing failed! : Couldn't open file : file path: " << m_fp->path_full();
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
 			}
 		}
-		if (!write_buff_commit()) {
-			m_fp->status_ts(file::file_status::failed);
+	} catch (std::exception& e) {
+		TRACE("exception when opening for write! %s\n", e.what());
+		if (m_fp->status_ts() == file::file_status::idle)
+			m_fp->status_ts(file::file_status::failed); // the remaining chunks of the file are dropped
+		return false;
+	}
+	return true;
+}
+
+bool file_part_task::kernel_copy_commit() {
+	errno_t res = m_fp->copy_from(*m_source);
+	if (res == ENOTSUP) {
+		m_engine.kernel_copy_unsupported_ts(); // the next files go through the buffers
+		return copy_through_buffer();
+	}
+	if (res)
+		TRACE(_T("Copying in kernel failed : file path : %s : error %d\n"), m_fp->path_full().c_str(), res);
+	return !res;
+}
+
+bool file_part_task::copy_through_buffer() {
+	io_backend_ptr io = make_io_backend();
+	io->unbuffered(m_source->unbuffered());
+	io->streaming(m_source->stream_window(), m_source->drop_behind());
+	if (io->open_read(m_source->path_full()))
+		return false;
+
+	char* buffer = aligned_alloc_buffer(READ_SIZE, UNBUFFERED_ALIGNMENT);
+	if (!buffer) {
+		io->close(false);
+		return false;
+	}
+	uint64_t offset = 0U;
+	bool ret = true;
+	while (ret && !io->is_eof()) {
+		size_t count = READ_SIZE;
+		if (io->read(buffer, count)) {
+			ret = false;
+		} else if (count) {
+			ret = m_fp->write_at(buffer, count, offset);
+			offset += count;
+		} else {
+			break;
+		}
+	}
+	aligned_free_buffer(buffer);
+	io->close(false);
+	return ret;
+}
+
+bool file_part_task::range_commit() {
+	const uint64_t end = m_offset + m_write_buff_count;
+	const size_t align = m_source->unbuffered() ? UNBUFFERED_ALIGNMENT : 1U;
+	uint32_t crc = 0U;
+	bool ret = true;
+	for (uint64_t offset = m_offset; ret && offset < end;) {
+		size_t want = static_cast<size_t>(std::min<uint64_t>(m_write_buff->size(), end - offset));
+		size_t count = (want + align - 1) & ~(align - 1); // unbuffered: whole blocks, the tail of the file too
+		if (!m_source->read_at(m_write_buff->data(), count, offset) || count < want) { // failed, or the file shrank
+			TRACE(_T("Reading range failed : file path : %s : offset %llu\n"), m_source->path_full().c_str(), static_cast<unsigned long long>(offset));
+			m_source->status_ts(file::file_status::failed_open);
+			ret = false;
+			break;
 		}
-		if (is_last_write()) {
-			m_fp->commit_file_basic_info();
-			m_fp->close();
+		if (m_fp->skip_zeros() && is_zero_block(m_write_buff->data(), want)) { // left as a hole, hashed without reading it again
+			crc = crc32::crc32_combine(crc, crc32::crc32_zeros(want), want);
+		} else {
+			crc = crc32::crc32_hw(m_write_buff->data(), want, crc);
+			ret = m_fp->write_at(m_write_buff->data(), want, offset);
 		}
-	} catch (std::exception& e) {
-		TRACE("exception when processing write! %s\n", e.what());
-		ret = false;
+		offset += want;
 	}
+	if (ret && m_write_buff_count) // (empty: the range closing a file ending with a hole, hashed already)
+		m_engine.crc32_range_ts(m_source, crc, m_write_buff_count, m_offset, m_last_write);
+	m_write_buff.reset(); // back to the pool as soon as possible
 	return ret;
 }
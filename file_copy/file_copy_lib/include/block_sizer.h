@@ -0,0 +1,156 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include "tools.h"
+#include "device_topology.h"
+
+namespace file_copy {
+	// Chunks of large files are sized to take about this long on the device
+	constexpr double CHUNK_TARGET_SECONDS = 0.01;
+	// Chunks of large files never go below this (and only reads of this size are measured)
+	constexpr size_t LARGE_CHUNK_MIN = 256 * 1024;
+	// Chunk of a large file on a device not measured yet
+	constexpr size_t LARGE_CHUNK_DEFAULT = 1024 * 1024;
+	// A read / write phase of a spinning disk moves the data of this many accesses (seeks): the two seeks switching
+	// between the source and the destination then cost about 6% of the phase
+	constexpr double PHASE_ACCESSES = 32.;
+	// Read / write phases never go below this
+	constexpr uint64_t PHASE_MIN = 16ULL * 1024 * 1024;
+	// Read / write phase of a spinning disk not measured yet
+	constexpr uint64_t PHASE_DEFAULT = 64ULL * 1024 * 1024;
+
+	// Picks the size of the chunks a file is read in (one pool buffer each), from the file size known since the
+	// listing, the class of the source device and the throughput measured on it:
+	//    - a file up to max_size is read in one call, into the smallest buffer holding it;
+	//    - a larger file goes in chunks of max_size on spinning disks (fewer, longer requests between seeks),
+	//      elsewhere in what the device reads in about CHUNK_TARGET_SECONDS (LARGE_CHUNK_DEFAULT until it's measured).
+	// Sizes are powers of two times min_size, so they match the buffer_pool size classes.
+	// It also sizes the read / write phases of a copy within one spinning disk (see phase_size_ts), from the
+	// access time measured on the first read of each file.
+	class block_sizer {
+	public:
+		// Constructor
+		// Parameters:
+		//    const size_t& min_size: [in] smallest chunk (power of two)
+		//    const size_t& max_size: [in] largest chunk (min_size * 2^n)
+		block_sizer(const size_t& min_size, const size_t& max_size) : m_min_size{ min_size }, m_max_size{ max_size < min_size ? min_size : max_size } {}
+
+		// Thread safe: Returns the chunk size of a file
+		// Parameters:
+		//    const uint64_t& file_size: [in] size of the file (as listed)
+		//    const uint64_t& device: [in] device id of the file (0 = unknown)
+		size_t chunk_size_ts(const uint64_t& file_size, const uint64_t& device) {
+			if (file_size <= m_max_size)
+				return round_up(static_cast<size_t>(file_size));
+
+			std::lock_guard<std::mutex> l(m_mutex);
+			device_state& d = state(device);
+			if (d.rotational)
+				return m_max_size;
+			if (!d.throughput)
+				return round_up(LARGE_CHUNK_DEFAULT);
+			double target = d.throughput * CHUNK_TARGET_SECONDS;
+			return round_up(target < LARGE_CHUNK_MIN ? LARGE_CHUNK_MIN : target > m_max_size ? m_max_size : static_cast<size_t>(target));
+		}
+
+		// Thread safe: Accounts a read, to measure the throughput of its device
+		// Parameters:
+		//    const uint64_t& device: [in] device id (0 = unknown)
+		//    const size_t& bytes: [in] bytes read (ignored under LARGE_CHUNK_MIN)
+		//    const double& seconds: [in] time the device took
+		void record_ts(const uint64_t& device, const size_t& bytes, const double& seconds) {
+			if (bytes < LARGE_CHUNK_MIN || seconds <= 0.)
+				return;
+			std::lock_guard<std::mutex> l(m_mutex);
+			device_state& d = state(device);
+			double sample = bytes / seconds;
+			d.throughput = d.throughput ? d.throughput * 0.875 + sample * 0.125 : sample; // moving average
+		}
+
+		// Thread safe: Accounts the first read of a file, to measure the access time (seek and rotation) of its device
+		// Parameters:
+		//    const uint64_t& device: [in] device id (0 = unknown)
+		//    const size_t& bytes: [in] bytes read
+		//    const double& seconds: [in] time the device took
+		void record_access_ts(const uint64_t& device, const size_t& bytes, const double& seconds) {
+			if (seconds <= 0.)
+				return;
+			std::lock_guard<std::mutex> l(m_mutex);
+			device_state& d = state(device);
+			double sample = d.throughput ? seconds - bytes / d.throughput : seconds; // without the transfer
+			if (sample < 0.)
+				sample = 0.;
+			d.access_time = d.access_seen ? d.access_time * 0.875 + sample * 0.125 : sample; // moving average
+			d.access_seen = true;
+		}
+
+		// Thread safe: Returns the bytes to read before writing them in a copy within one device (sync mode): on a
+		// spinning disk what it transfers in PHASE_ACCESSES access times (PHASE_DEFAULT until measured), elsewhere
+		// max_size (no seek to save).
+		// Parameters:
+		//    const uint64_t& device: [in] device id of the source (0 = unknown)
+		//    const uint64_t& max_size: [in] largest phase (the memory budget)
+		uint64_t phase_size_ts(const uint64_t& device, const uint64_t& max_size) {
+			std::lock_guard<std::mutex> l(m_mutex);
+			device_state& d = state(device);
+			if (!d.rotational)
+				return max_size;
+			double target = d.throughput && d.access_seen ? d.throughput * d.access_time * PHASE_ACCESSES : static_cast<double>(PHASE_DEFAULT);
+			uint64_t ret = target < PHASE_MIN ? PHASE_MIN : target > max_size ? max_size : static_cast<uint64_t>(target);
+			return ret > max_size ? max_size : ret;
+		}
+
+		// Thread safe: Returns true if the device is (or has, under RAID / LVM) a spinning disk (see device_topology, false if unknown)
+		// Parameters:
+		//    const uint64_t& device: [in] device id (0 = unknown)
+		bool rotational_ts(const uint64_t& device) {
+			std::lock_guard<std::mutex> l(m_mutex);
+			return state(device).rotational;
+		}
+
+		inline size_t min_size() const {
+			return m_min_size;
+		}
+
+		inline size_t max_size() const {
+			return m_max_size;
+		}
+
+	private:
+		struct device_state {
+			bool rotational{ false };
+			double throughput{ 0. }; // bytes / second, 0 = not measured
+			double access_time{ 0. }; // seconds before the first byte of a file comes (see record_access_ts)
+			bool access_seen{ false }; // access_time measured
+		};
+
+		// m_mutex must be held. Probes the device the first time
+		device_state& state(const uint64_t& device) {
+			auto it = m_devices.find(device);
+			if (it != m_devices.end())
+				return it->second;
+			device_state& d = m_devices[device];
+#ifdef __linux__
+			if (device)
+				d.rotational = get_device_topology(device).rotational(); // any disk below (RAID, LVM...) spinning
+#endif
+			return d;
+		}
+
+		// Returns the smallest size class (min_size * 2^n, up to max_size) holding size bytes
+		inline size_t round_up(const size_t& size) const {
+			size_t ret = m_min_size;
+			while (ret < size && ret < m_max_size)
+				ret <<= 1;
+			return ret;
+		}
+
+		size_t m_min_size;
+		size_t m_max_size;
+		std::map<uint64_t, device_state> m_devices;
+		std::mutex m_mutex;
+	};
+
+	using block_sizer_ptr = std::shared_ptr<block_sizer>;
+}
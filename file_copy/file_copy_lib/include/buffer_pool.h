@@ -0,0 +1,366 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#include "tools.h"
+
+namespace file_copy {
+	class buffer_pool;
+
+	// Allocates size bytes aligned to alignment (a power of two)
+	// Returns: char*: nullptr in case of failure
+	inline char* aligned_alloc_buffer(const size_t& size, const size_t& alignment) {
+#ifdef _WIN32
+		return static_cast<char*>(_aligned_malloc(size, alignment));
+#else
+		void* p = nullptr;
+		return posix_memalign(&p, alignment, size) ? nullptr : static_cast<char*>(p);
+#endif
+	}
+
+	// Frees memory allocated by aligned_alloc_buffer
+	inline void aligned_free_buffer(char* p) {
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+	// One I/O buffer owned by a buffer_pool. Reference counted through io_buffer_ptr, it goes back to
+	// the pool when the last reference is dropped.
+	class io_buffer {
+		friend class buffer_pool;
+		friend class io_buffer_ptr;
+	public:
+		io_buffer(const io_buffer&) = delete;
+		io_buffer& operator=(const io_buffer&) = delete;
+
+		inline char* data() const {
+			return m_data;
+		}
+
+		// Returns the capacity of the buffer in bytes
+		inline size_t size() const {
+			return m_size;
+		}
+
+		// Returns the position of the buffer in its pool (0 .. capacity - 1), stable for the life of the pool
+		inline size_t index() const {
+			return m_index;
+		}
+
+	private:
+		io_buffer(buffer_pool* pool, char* data, const size_t& size, const size_t& index) : m_pool{ pool }, m_data{ data }, m_size{ size }, m_index{ index } {}
+
+		~io_buffer() {
+			aligned_free_buffer(m_data);
+		}
+
+		inline void add_ref() {
+			m_refs.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		inline void release();
+
+		buffer_pool* m_pool;
+		char* m_data;
+		size_t m_size;
+		size_t m_index;
+		std::atomic<unsigned int> m_refs{ 0U };
+	};
+
+	// Intrusive reference to an io_buffer (copying it doesn't allocate anything)
+	class io_buffer_ptr {
+	public:
+		io_buffer_ptr() {}
+
+		io_buffer_ptr(std::nullptr_t) {}
+
+		io_buffer_ptr(const io_buffer_ptr& v) : m_p{ v.m_p } {
+			if (m_p)
+				m_p->add_ref();
+		}
+
+		io_buffer_ptr(io_buffer_ptr&& v) : m_p{ v.m_p } {
+			v.m_p = nullptr;
+		}
+
+		~io_buffer_ptr() {
+			reset();
+		}
+
+		io_buffer_ptr& operator=(const io_buffer_ptr& v) {
+			if (v.m_p)
+				v.m_p->add_ref();
+			reset();
+			m_p = v.m_p;
+			return *this;
+		}
+
+		io_buffer_ptr& operator=(io_buffer_ptr&& v) {
+			if (&v != this) {
+				reset();
+				m_p = v.m_p;
+				v.m_p = nullptr;
+			}
+			return *this;
+		}
+
+		inline void reset() {
+			if (m_p) {
+				m_p->release();
+				m_p = nullptr;
+			}
+		}
+
+		inline io_buffer* operator->() const {
+			return m_p;
+		}
+
+		inline io_buffer* get() const {
+			return m_p;
+		}
+
+		inline explicit operator bool() const {
+			return m_p != nullptr;
+		}
+
+	private:
+		friend class buffer_pool;
+		explicit io_buffer_ptr(io_buffer* p) : m_p{ p } {
+			m_p->add_ref();
+		}
+
+		io_buffer* m_p{ nullptr };
+	};
+
+	// Aligned I/O buffers sharing a memory budget, in size classes: buffer_size, 2 * buffer_size, 4 * buffer_size, ...
+	// up to max_buffer_size. Buffers are allocated on first use and recycled afterwards; when a class has no free
+	// buffer and the budget is reached, free buffers of the other classes are released to make room. The memory
+	// held by the chunks in flight never exceeds the budget: acquire() is the point where the reader blocks once
+	// it's reached.
+	class buffer_pool {
+		friend class io_buffer;
+	public:
+		// Constructor
+		// Parameters:
+		//    const size_t& buffer_size: [in] size of the smallest buffers
+		//    const size_t& capacity: [in] memory budget, in buffers of buffer_size
+		//    const size_t& alignment: [in] alignment of each buffer (power of two)
+		//    const size_t& max_buffer_size: [in] size of the largest buffers (rounded to buffer_size * 2^n, within the budget), 0 = buffer_size
+		buffer_pool(const size_t& buffer_size, const size_t& capacity, const size_t& alignment = 4096, const size_t& max_buffer_size = 0) :
+			m_buffer_size{ buffer_size }, m_capacity{ capacity ? capacity : 1U }, m_alignment{ alignment } {
+			m_budget = static_cast<uint64_t>(m_capacity) * m_buffer_size;
+			size_t classes = 1;
+			while ((m_buffer_size << (classes - 1)) < max_buffer_size && (static_cast<uint64_t>(m_buffer_size) << classes) <= m_budget)
+				++classes;
+			m_max_buffer_size = m_buffer_size << (classes - 1);
+			m_free.resize(classes);
+			m_buffers.reserve(classes == 1 ? m_capacity : 0U);
+			m_free[0].reserve(classes == 1 ? m_capacity : 0U);
+		}
+
+		~buffer_pool() {
+			std::lock_guard<std::mutex> lk(m_mutex);
+			assert(!m_in_use_bytes.load()); // every buffer must be back
+			for (auto b : m_buffers)
+				delete b;
+		}
+
+		buffer_pool(const buffer_pool&) = delete;
+		buffer_pool& operator=(const buffer_pool&) = delete;
+
+		// Gets a free buffer of at least size bytes, waiting for buffers to be released if the budget is in use
+		// Parameters:
+		//    const size_t& size: [in] bytes needed (0 = buffer_size, clamped to max_buffer_size)
+		// Throws std::bad_alloc if the memory can't be allocated
+		io_buffer_ptr acquire(const size_t& size = 0) {
+			size_t c = class_of(size);
+			std::unique_lock<std::mutex> lk(m_mutex);
+			m_cv.wait(lk, [this, c] { return can_pop(c); });
+			return pop_free(c);
+		}
+
+		// Gets a free buffer of at least size bytes if one is available
+		// Parameters:
+		//    const size_t& size: [in] bytes needed (0 = buffer_size, clamped to max_buffer_size)
+		// Returns: io_buffer_ptr: empty if the budget is in use
+		io_buffer_ptr try_acquire(const size_t& size = 0) {
+			size_t c = class_of(size);
+			std::lock_guard<std::mutex> lk(m_mutex);
+			if (!can_pop(c))
+				return io_buffer_ptr{};
+			return pop_free(c);
+		}
+
+		// Allocates the whole budget in buffers of buffer_size now (eg. to register them with the kernel), instead of on first use
+		// Throws std::bad_alloc if the memory can't be allocated
+		void preallocate() {
+			std::lock_guard<std::mutex> lk(m_mutex);
+			while (m_allocated_bytes + m_buffer_size <= m_budget)
+				m_free[0].push_back(allocate(0));
+		}
+
+		// Returns the memory of the buffer at index, nullptr if there's none (not allocated yet, or released)
+		inline char* buffer_data(const size_t& index) const {
+			std::lock_guard<std::mutex> lk(m_mutex);
+			return index < m_buffers.size() && m_buffers[index] ? m_buffers[index]->data() : nullptr;
+		}
+
+		// Number of buffers of at least size bytes that can be acquired without waiting
+		// Parameters:
+		//    const size_t& size: [in] bytes needed (0 = buffer_size, clamped to max_buffer_size)
+		inline size_t available(const size_t& size = 0) const {
+			size_t c = class_of(size);
+			std::lock_guard<std::mutex> lk(m_mutex);
+			size_t class_size = m_buffer_size << c;
+			uint64_t room = m_budget - m_in_use_bytes.load(std::memory_order_relaxed) - m_free[c].size() * class_size;
+			return m_free[c].size() + static_cast<size_t>(room / class_size);
+		}
+
+		// Thread safe: bytes held by the buffers currently acquired (data in flight)
+		inline uint64_t in_use_bytes_ts() const {
+			return m_in_use_bytes.load(std::memory_order_relaxed);
+		}
+
+		// Thread safe: highest in_use_bytes_ts() since the pool was created (or reset_peak_ts())
+		inline uint64_t peak_in_use_bytes_ts() const {
+			return m_peak_in_use_bytes.load(std::memory_order_relaxed);
+		}
+
+		// Thread safe: restarts the peak measurement from the current usage
+		inline void reset_peak_ts() {
+			m_peak_in_use_bytes.store(m_in_use_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+
+		// Returns the maximum number of bytes the pool can hold (capacity * buffer_size)
+		inline uint64_t budget_bytes() const {
+			return m_budget;
+		}
+
+		// Returns the size of the smallest buffers
+		inline size_t buffer_size() const {
+			return m_buffer_size;
+		}
+
+		// Returns the size of the largest buffers
+		inline size_t max_buffer_size() const {
+			return m_max_buffer_size;
+		}
+
+		// Returns the budget in buffers of buffer_size
+		inline size_t capacity() const {
+			return m_capacity;
+		}
+
+		inline size_t alignment() const {
+			return m_alignment;
+		}
+
+	private:
+		// Returns the size class holding size bytes
+		inline size_t class_of(const size_t& size) const {
+			size_t c = 0;
+			while ((m_buffer_size << c) < size && c + 1 < m_free.size())
+				++c;
+			return c;
+		}
+
+		// m_mutex must be held
+		inline bool can_pop(const size_t& c) const {
+			return !m_free[c].empty() || m_in_use_bytes.load(std::memory_order_relaxed) + (m_buffer_size << c) <= m_budget;
+		}
+
+		// m_mutex must be held
+		io_buffer* allocate(const size_t& c) {
+			size_t size = m_buffer_size << c;
+			char* data = aligned_alloc_buffer(size, m_alignment);
+			if (!data)
+				throw std::bad_alloc();
+			size_t index = m_buffers.size();
+			if (!m_free_slots.empty()) {
+				index = m_free_slots.back();
+				m_free_slots.pop_back();
+			} else {
+				m_buffers.push_back(nullptr);
+			}
+			io_buffer* b = new io_buffer{ this, data, size, index };
+			m_buffers[index] = b;
+			m_allocated_bytes += size;
+			return b;
+		}
+
+		// m_mutex must be held
+		// Releases free buffers of the other classes (the largest first) until size more bytes fit in the budget
+		void make_room(const size_t& size) {
+			for (size_t c = m_free.size(); c-- > 0 && m_allocated_bytes + size > m_budget;) {
+				while (!m_free[c].empty() && m_allocated_bytes + size > m_budget) {
+					io_buffer* b = m_free[c].back();
+					m_free[c].pop_back();
+					m_allocated_bytes -= b->size();
+					m_buffers[b->index()] = nullptr;
+					m_free_slots.push_back(b->index());
+					delete b;
+				}
+			}
+		}
+
+		// m_mutex must be held, can_pop(c)
+		io_buffer_ptr pop_free(const size_t& c) {
+			if (m_free[c].empty()) {
+				make_room(m_buffer_size << c);
+				m_free[c].push_back(allocate(c));
+			}
+			io_buffer* b = m_free[c].back();
+			m_free[c].pop_back();
+			uint64_t in_use = m_in_use_bytes.load(std::memory_order_relaxed) + b->size();
+			m_in_use_bytes.store(in_use, std::memory_order_relaxed);
+			if (in_use > m_peak_in_use_bytes.load(std::memory_order_relaxed))
+				m_peak_in_use_bytes.store(in_use, std::memory_order_relaxed);
+			return io_buffer_ptr{ b };
+		}
+
+		void release(io_buffer* b) {
+			{
+				std::lock_guard<std::mutex> lk(m_mutex);
+				m_free[class_of(b->size())].push_back(b);
+				m_in_use_bytes.store(m_in_use_bytes.load(std::memory_order_relaxed) - b->size(), std::memory_order_relaxed);
+			}
+			if (m_free.size() == 1)
+				m_cv.notify_one();
+			else
+				m_cv.notify_all(); // the waiters may want distinct sizes
+		}
+
+		size_t m_buffer_size;
+		size_t m_max_buffer_size;
+		size_t m_capacity;
+		size_t m_alignment;
+		uint64_t m_budget;
+
+		std::vector<io_buffer*> m_buffers; // by io_buffer::index(), nullptr = released slot
+		std::vector<size_t> m_free_slots; // released slots of m_buffers
+		std::vector<std::vector<io_buffer*>> m_free; // free buffers by size class
+		uint64_t m_allocated_bytes{ 0U };
+		std::atomic<uint64_t> m_in_use_bytes{ 0U }; // written under m_mutex, read without it
+		std::atomic<uint64_t> m_peak_in_use_bytes{ 0U };
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cv;
+	};
+
+	inline void io_buffer::release() {
+		if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			m_pool->release(this);
+	}
+
+	using buffer_pool_ptr = std::shared_ptr<buffer_pool>;
+}
@@ -1,106 +1,195 @@
 #pragma once
 
-#include <queue>
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <thread>
 #include <condition_variable>
 #include <mutex>
-#include "file_part_task.h"
 #include <atomic>
 
 
 namespace thread_tools {
+	const size_t CACHE_LINE_SIZE = 64;
+
+	// Bounded multi-producer / multi-consumer queue.
+	// Lock free ring of cells with a sequence number each (Dmitry Vyukov's bounded MPMC queue):
+	// producers and consumers only compete on one atomic increment, and each side has its own cache line.
+	// A thread only blocks (condition variable) when the queue is full (push) or empty (pop); the other side
+	// takes the mutex to wake it up only when it knows somebody is waiting.
+	// The whole ring is allocated upfront: max is the capacity, not a hint.
 	template<typename DATA>
 	class concurrent_queue
 	{
 	private:
-		std::queue<DATA> the_queue;
-		mutable std::mutex the_mutex;
-		std::condition_variable the_condition_variable_pop;
-		std::condition_variable the_condition_variable_push;
-	public:
-		concurrent_queue(unsigned int max) : m_push(0), m_pop(0) {
-			m_max.store(max);
+		struct alignas(CACHE_LINE_SIZE) cell {
+			std::atomic<size_t> sequence;
+			DATA data;
+		};
+
+		struct alignas(CACHE_LINE_SIZE) padded_position {
+			std::atomic<size_t> value{ 0U };
+		};
+
+		struct alignas(CACHE_LINE_SIZE) waiters {
+			std::atomic<unsigned int> count{ 0U };
+			std::mutex mutex;
+			std::condition_variable cv;
+		};
+
+		// number of times a blocked operation re-tries before sleeping on the condition variable
+		static const unsigned int SPIN_COUNT = 64;
+
+		std::vector<cell> m_buffer;
+		const size_t m_capacity;
+		padded_position m_enqueue_pos;
+		padded_position m_dequeue_pos;
+		waiters m_waiters_pop; // consumers waiting for data
+		waiters m_waiters_push; // producers waiting for room
+
+		// Claims a cell and stores the data
+		// Returns bool: true = pushed, false = the queue is full
+		bool try_push(DATA const& data) {
+			size_t pos = m_enqueue_pos.value.load(std::memory_order_relaxed);
+			for (;;) {
+				cell& c = m_buffer[pos % m_capacity];
+				size_t seq = c.sequence.load(std::memory_order_acquire);
+				intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+				if (!diff) {
+					if (m_enqueue_pos.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						c.data = data;
+						c.sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				} else if (diff < 0) {
+					return false; // full
+				} else {
+					pos = m_enqueue_pos.value.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// Claims the oldest cell and moves the data out (the cell doesn't keep a copy)
+		// Returns bool: true = popped, false = the queue is empty
+		bool try_pop_lock_free(DATA& popped_value) {
+			size_t pos = m_dequeue_pos.value.load(std::memory_order_relaxed);
+			for (;;) {
+				cell& c = m_buffer[pos % m_capacity];
+				size_t seq = c.sequence.load(std::memory_order_acquire);
+				intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+				if (!diff) {
+					if (m_dequeue_pos.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						popped_value = std::move(c.data);
+						c.data = DATA{};
+						c.sequence.store(pos + m_capacity, std::memory_order_release);
+						return true;
+					}
+				} else if (diff < 0) {
+					return false; // empty
+				} else {
+					pos = m_dequeue_pos.value.load(std::memory_order_relaxed);
+				}
+			}
 		}
-		void push(DATA const& data) {
-			{
-				std::unique_lock<std::mutex> lock(the_mutex);
-				the_condition_variable_push.wait(lock, [this] {return !(the_queue.size() > (m_max + 1)); });
 
-				the_queue.push(data);
-				++m_push;
+		// Wakes up the threads blocked on w (if any)
+		static void wake(waiters& w) {
+			std::atomic_thread_fence(std::memory_order_seq_cst); // the cell update must be visible before checking for waiters
+			if (w.count.load(std::memory_order_relaxed)) {
+				std::lock_guard<std::mutex> lock(w.mutex);
+				w.cv.notify_all();
 			}
-			the_condition_variable_pop.notify_all();
+		}
+
+		// Retries op, spinning shortly and then blocking on w until op succeeds or the deadline expires
+		template<typename OP>
+		bool blocking(waiters& w, OP op, const std::chrono::steady_clock::time_point* deadline) {
+			for (unsigned int i = 0; i < SPIN_COUNT; ++i) {
+				if (op())
+					return true;
+				std::this_thread::yield();
+			}
+
+			std::unique_lock<std::mutex> lock(w.mutex);
+			w.count.fetch_add(1, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with the fence in wake()
+			bool ret;
+			for (;;) {
+				if ((ret = op()))
+					break;
+				if (!deadline) {
+					w.cv.wait(lock);
+				} else if (w.cv.wait_until(lock, *deadline) == std::cv_status::timeout) {
+					ret = op();
+					break;
+				}
+			}
+			w.count.fetch_sub(1, std::memory_order_relaxed);
+			return ret;
+		}
+
+	public:
+		concurrent_queue(unsigned int max) :
+			m_buffer(max ? max : 1U), m_capacity(max ? max : 1U) {
+			for (size_t i = 0; i < m_capacity; ++i)
+				m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		concurrent_queue(const concurrent_queue&) = delete;
+		concurrent_queue& operator=(const concurrent_queue&) = delete;
+
+		// Blocks while the queue is full
+		void push(DATA const& data) {
+			if (!try_push(data))
+				blocking(m_waiters_push, [&] { return try_push(data); }, nullptr);
+			wake(m_waiters_pop);
 		}
 
 		bool empty() const
 		{
-			std::lock_guard<std::mutex> lock(the_mutex);
-			return the_queue.empty();
+			return !size();
 		}
 
 		bool try_pop(DATA& popped_value) {
-			{
-				std::lock_guard<std::mutex> lock(the_mutex);
-				if (the_queue.empty()) {
-					return false;
-				}
-
-				popped_value = the_queue.front();
-				the_queue.pop();
-				++m_pop;
-			}
-			the_condition_variable_push.notify_all();
+			if (!try_pop_lock_free(popped_value))
+				return false;
+			wake(m_waiters_push);
 			return true;
 		}
 
 		void wait_and_pop(DATA& popped_value) {
-			{
-				std::unique_lock<std::mutex> lock(the_mutex);
-				the_condition_variable_pop.wait(lock, [this] {return !the_queue.empty(); });
-
-				popped_value = the_queue.front();
-				the_queue.pop();
-				++m_pop;
-			}
-			the_condition_variable_push.notify_all();
+			if (!try_pop_lock_free(popped_value))
+				blocking(m_waiters_pop, [&] { return try_pop_lock_free(popped_value); }, nullptr);
+			wake(m_waiters_push);
 		}
 
 		bool timed_wait_and_pop(DATA& popped_value, int wait_time) {
-			{
-				std::unique_lock<std::mutex> lock(the_mutex);
-				if (!the_condition_variable_pop.wait_for(lock, std::chrono::milliseconds(wait_time), [this] {return !the_queue.empty(); })) {
+			if (!try_pop_lock_free(popped_value)) {
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_time);
+				if (!blocking(m_waiters_pop, [&] { return try_pop_lock_free(popped_value); }, &deadline))
 					return false;
-				}
-
-				popped_value = the_queue.front();
-				the_queue.pop();
-				++m_pop;
 			}
-			the_condition_variable_push.notify_all();
+			wake(m_waiters_push);
 			return true;
 		}
 
+		// Lock free, exact when there are no concurrent operations, otherwise a snapshot
 		size_t size() const {
-			std::unique_lock<std::mutex> lock(the_mutex);
-			return the_queue.size();
+			size_t pop = m_dequeue_pos.value.load(std::memory_order_acquire);
+			size_t push = m_enqueue_pos.value.load(std::memory_order_acquire);
+			return push > pop ? push - pop : 0U;
 		}
 
 		unsigned int max_size() const {
-			return m_max;
+			return static_cast<unsigned int>(m_capacity);
 		}
 
 		int push_count() const {
-			std::unique_lock<std::mutex> lock(the_mutex);
-			return m_push;
+			return static_cast<int>(m_enqueue_pos.value.load(std::memory_order_relaxed));
 		}
 
 		int pop_count() const {
-			std::unique_lock<std::mutex> lock(the_mutex);
-			return m_pop;
+			return static_cast<int>(m_dequeue_pos.value.load(std::memory_order_relaxed));
 		}
-
-	private:
-		std::atomic<unsigned int> m_max;
-		int m_push;
-		int m_pop;
 	};
 } // /file_copy
@@ -5,16 +5,27 @@
 #include <cassert>
 #include <sstream>
 #include <utility>
-#include <future>
+#include <thread>
+#include <chrono>
 
 #include "file.h"
 #include "file_part_task.h"
 #include "folder_task.h"
 #include "concurrent_queue.h"
 #include "task_sink.h"
+#include "task_dispatcher.h"
+#include "crc32_sink.h"
+#include "verify_sink.h"
+#include "dir_walker.h"
+#include "uring_reader.h"
+#include "block_sizer.h"
+#include "task_batch.h"
 
 
 namespace file_copy {
+	// Alignment of the small files in the buffer of a batch (see copy_engine::copy_small_file)
+	constexpr size_t SMALL_FILE_ALIGNMENT = 64;
+
 	class files_to_process {
 		friend class copy_engine;
 	public:
@@ -27,6 +38,7 @@ namespace file_copy {
 			finished,
 			source_file_error,
 			dest_file_error,
+			verify_failed, // the destination doesn't match the source when read back
 		};
 
 		~files_to_process() {}
@@ -44,7 +56,10 @@ namespace file_copy {
 			case file::file_status::failed:
 				return files_to_process_status::dest_file_error;
 			case file::file_status::closed_write:
+			case file::file_status::verified:
 				return files_to_process_status::finished;
+			case file::file_status::verify_failed:
+				return files_to_process_status::verify_failed;
 			}
 
 			switch (source_status) {
@@ -75,65 +90,81 @@ namespace file_copy {
 		file_ptr m_dest;
 	};
 
-	class async_crc32 {
-	public:
-		async_crc32(const char* data, size_t count, uint32_t crc32 = 0) : m_count{ count }, m_crc32{ crc32 } {
-			m_data = new char[count];
-			memcpy_s(m_data, count, data, count);
-		}
-		~async_crc32() {
-			if (m_data)
-				delete[] m_data;
-		}
-
-		async_crc32(const async_crc32& v) {
-			m_count = v.m_count;
-			m_crc32 = v.m_crc32;
-			m_data = new char[m_count];
-			memcpy_s(m_data, m_count, v.m_data, m_count);
-		}
-
-		async_crc32& operator=(const async_crc32& v) {
-			if (&v != this) {
-				if (m_data)
-					delete[] m_data;
-				m_count = v.m_count;
-				m_crc32 = v.m_crc32;
-				m_data = new char[m_count];
-				memcpy_s(m_data, m_count, v.m_data, m_count);
-			}
-			return *this;
-		}
+	// Tuning of the copy engine (see copy_engine::init)
+	struct copy_settings {
+		uint64_t memory_budget{ 256ULL * 1024 * 1024 }; // bytes of file data in flight (read but not yet written and hashed), the reader blocks beyond it
+		size_t min_chunk_size{ 4096 }; // smallest read (power of two, at least UNBUFFERED_ALIGNMENT): a file is read in one call up to max_chunk_size
+		size_t max_chunk_size{ 4 * 1024 * 1024 }; // largest read (at most memory_budget / 4), large files go in chunks sized by block_sizer
+		size_t small_file_size{ 64 * 1024 }; // files up to this size are read into a shared buffer and written by one task per batch (0 = off)
+		size_t small_batch_size{ 1024 * 1024 }; // buffer of a batch of small files (at most max_chunk_size)
+		unsigned int small_batch_files{ 256 }; // files (and folders) in a batch of small files at most
+		uint64_t parallel_file_size{ 1024ULL * 1024 * 1024 }; // async: files from this size are split in ranges copied by the writers at the same time, unless the source disk spins (0 = off)
+		size_t parallel_range_size{ 64 * 1024 * 1024 }; // size of those ranges (rounded up to whole chunks), each one read and written by a single writer
+		bool skip_zero_blocks{ false }; // chunks of zeros aren't written: the destinations are created as holes and those chunks stay holes (sparse)
+		uint64_t sync_phase_size{ 0U }; // sync mode: bytes read before writing them, one long phase of each (0 = tuned from the access time and throughput measured on the source disk, see block_sizer::phase_size_ts), memory_budget at most
+		unsigned int task_queue_size{ 16384 }; // maximum number of tasks waiting to be written (only bounds the bookkeeping, not the data)
+		unsigned int crc32_workers{ 2 }; // number of threads hashing the files being read
+		unsigned int sink_workers{ 4 }; // async mode: threads writing the destination, on a solid state device (or class unknown), see device_topology
+		unsigned int hdd_sink_workers{ 1 }; // threads writing a spinning destination disk (more would seek between the files)
+		unsigned int nvme_sink_workers{ 16 }; // threads writing an NVMe destination (deep hardware queues)
+		bool verify{ false }; // read back every destination file (bypassing the cache) and compare its CRC with the source
+		unsigned int verify_workers{ 2 }; // number of threads reading back the destination files
+		unsigned int enum_workers{ 4 }; // number of threads listing the source tree (copy_prepare, copy_stream)
+		bool incremental{ false }; // leave out the files whose destination exists with the same size and last write time, found while listing (the destination folders are listed too) before any of them is read; the destinations out of date are overwritten
+		bool layout_order{ false }; // copy_prepare: copy the files in their order on the source disk (first extent, see get_physical_position) rather than the listing order, the folders after them
+		unsigned int stream_queue_size{ 4096 }; // entries listed and not yet copied (copy_stream), the listing blocks beyond it
+		bool kernel_copy{ true }; // same file system (Linux): reflink or copy_file_range instead of the buffers, files are only hashed to be verified
+		unsigned int uring_queue_depth{ 32 }; // Linux: reads in flight per source device (solid state, or class unknown) through io_uring (0 = one read at a time with io_backend)
+		unsigned int hdd_uring_queue_depth{ 2 }; // Linux: reads in flight per spinning source disk
+		unsigned int nvme_uring_queue_depth{ 64 }; // Linux: reads in flight per NVMe source
+		std::map<std::wstring, unsigned int> uring_device_queue_depth; // any path on a device -> reads in flight for that device (overrides uring_queue_depth)
+		bool unbuffered{ false }; // read and write around the operating system cache (O_DIRECT), so a large copy doesn't evict everything else
+		uint64_t readahead_window{ 8ULL * 1024 * 1024 }; // cached I/O: bytes the kernel is asked to read ahead of the reader (0 = no page cache hints)
+		bool drop_behind{ true }; // cached I/O (Linux): drop the source pages once read and write back / drop the destination pages every readahead_window
+	};
 
-		async_crc32(async_crc32&& v) {// = delete;
-			m_data = v.m_data;
-			v.m_data = nullptr;
-			m_count = v.m_count;
-			v.m_count = 0;
-			m_crc32 = v.m_crc32;
-			v.m_crc32 = 0;
-		}
+	// Snapshot of the copy engine queues (see copy_engine::stats_ts)
+	struct copy_stats {
+		uint64_t memory_budget{ 0U }; // configured bytes in flight
+		uint64_t in_flight_bytes{ 0U }; // bytes of file data read and not yet released by the writers / hashers
+		uint64_t peak_in_flight_bytes{ 0U }; // highest in_flight_bytes of the current copy
+		uint64_t queued_tasks{ 0U }; // tasks waiting for a writer
+		uint64_t sync_phases{ 0U }; // sync mode: read / write phases of the current copy
+		uint64_t phase_size{ 0U }; // sync mode: bytes read before writing them, lately
+	};
 
-		async_crc32& operator=(async_crc32&& v) {// = delete;
-			if (&v != this) {
-				m_data = v.m_data;
-				v.m_data = nullptr;
-				m_count = v.m_count;
-				v.m_count = 0;
-				m_crc32 = v.m_crc32;
-				v.m_crc32 = 0;
-			}
-			return *this;
+	// Returns the number of writers of a destination device, from its class (see device_topology)
+	// Parameters:
+	//    const copy_settings& v: [in] hdd_sink_workers, sink_workers, nvme_sink_workers
+	//    const uint64_t& device: [in] device id (see device_id)
+	inline unsigned int sink_workers(const copy_settings& v, const uint64_t& device) {
+#ifdef __linux__
+		switch (get_device_topology(device).type()) {
+		case device_class::rotational:
+			return v.hdd_sink_workers;
+		case device_class::nvme:
+			return v.nvme_sink_workers;
+		default:
+			break;
 		}
-
-		uint32_t operator()() {
-			return crc32::crc32_16bytes_prefetch(m_data, m_count, m_crc32);
-		}
-	private:
-		char* m_data{ nullptr };
-		size_t m_count{ 0 };
-		uint32_t m_crc32{ 0 };
-	};
+#endif
+		return v.sink_workers;
+	}
+
+	// Returns the device holding f, to tell the devices of the copies apart: the id of its file system (st_dev), on
+	// Windows the number of its physical disk + 1 (a volume on a single disk). 0 if unknown.
+	inline uint64_t device_id(const file_ptr& f) {
+		uint64_t ret = 0U;
+#ifdef _WIN32
+		VOLUME_DISK_EXTENTS extents;
+		if (!get_disk_extents(f->root_full(), extents) && extents.NumberOfDiskExtents == 1)
+			ret = static_cast<uint64_t>(extents.Extents[0].DiskNumber) + 1U;
+#else
+		if (get_device_id(f->path_full(), ret))
+			ret = 0U;
+#endif
+		return ret;
+	}
 
 	//using files_to_process = std::pair<file_ptr, file_ptr>; // usage files_to_process{file_ptr source, file_ptr dest}
 	using file_to_process_vector = std::vector<files_to_process>;
@@ -147,6 +178,9 @@ namespace file_copy {
 			async
 		};
 
+		// A separate engine per copy running at the same time (see copy_scheduler), get_instance() otherwise
+		copy_engine() {}
+
 		~copy_engine() {
 			//async(false); // kill the async thread if existing
 		}
@@ -169,7 +203,12 @@ namespace file_copy {
 			}*/
 
 			async(async_decision(_source, _dest));
+			m_kernel_copy.store(kernel_copy_decision(_source, _dest));
+			m_source_device = device_id(_source);
+			m_dest_device = device_id(_dest);
 			build_files_to_process(_source, _dest, _source->folder() == _dest->path());
+			if (m_layout_order)
+				order_by_layout();
 			uint64_t remove;
 				
 			DWORD err= get_disk_free_space(_dest->root_full(), remove);
@@ -181,47 +220,147 @@ namespace file_copy {
 		//       Forces to sync or async. 
 		//       Default is automatic, leaving the decision to the application
 		void copy_start(const async_mode& force_mode = async_mode::automatic) {
-			
-			switch (force_mode) {
-			case async_mode::automatic: // do nothing as the decision was made in copy_prepare
-				break;
-			case async_mode::async:
-				async(true);
-				break;
-			case async_mode::sync:
-				async(false);
-				break;
-			default: // not possible to reach
-				assert(0);
-			}
-
-			if (!m_task_sink)
-				m_task_sink = std::make_shared<task_sink>(m_task_queue);
-
-			if (async() && !m_sink_thread) {
-				m_sink_thread = m_task_sink->run();
-			}
+			start_sinks(force_mode);
 
 			for (auto x : m_files_to_process) {
 				copy_file(x.m_source, x.m_dest);
 			}
 
-			if (!m_async.load()) {
-				commit();
-			}
+			stop_sinks();
+		}
+
+		// Copies source into dest_folder while source is still being listed (no copy_prepare(...) / copy_start(...)).
+		// The listing threads pass the entries through a bounded channel and the calling thread copies them as they
+		// come, so the copy starts with the first file found. The totals (num_files_to_process_ts, ...) and
+		// get_files_to_process_ts() are the entries discovered so far and grow during the copy.
+		// Parameters: 
+		//    const std::wstring& source: [in] file or folder to be copied
+		//    const std::wstring& dest_folder: [in] folder where source will be copied into
+		//    const async_mode& force_mode = async_mode::automatic: 
+		//       Forces to sync or async. 
+		//       Default is automatic, leaving the decision to the application
+		// Throws std::exception in case of serious issues.
+		void copy_stream(const std::wstring& source, const std::wstring& dest_folder, const async_mode& force_mode = async_mode::automatic) {
+			file_ptr _source{ new file{ source } };
+			file_ptr _dest{ new file{ dest_folder, std::wstring{} } };
 
-			if (m_sink_thread) {
-				if (m_task_sink)
-					m_task_sink->die();
-				m_sink_thread = nullptr;
+			async(async_decision(_source, _dest));
+			m_kernel_copy.store(kernel_copy_decision(_source, _dest));
+			m_source_device = device_id(_source);
+			m_dest_device = device_id(_dest);
+			prepare_root(_source, _dest, _source->folder() == _dest->path());
+
+			// nullptr source = the listing is over
+			using stream_channel = thread_tools::concurrent_queue<std::pair<file_ptr, file_ptr>>;
+			stream_channel channel{ m_stream_queue_size };
+
+			std::thread producer{ [&] {
+				try {
+					if (_source->is_directory()) {
+						dir_walker walker{ m_enum_workers, m_incremental };
+						walker.walk(_source, _dest, [&](const file_ptr& s, const file_ptr& d, const dir_walker::node* dir) {
+							stream_discovered(s, dir);
+							channel.push(std::make_pair(s, d));
+						});
+						m_num_files_skipped += walker.skipped_files();
+						m_files_skipped_size += walker.skipped_size();
+					} else if (!skip_unchanged(_source, _dest)) {
+						stream_discovered(_source, nullptr);
+						channel.push(std::make_pair(_source, _dest));
+					}
+				} catch (const std::exception& e) {
+					TRACE("exception when listing! %s\n", e.what());
+				}
+				channel.push(std::make_pair(file_ptr{}, file_ptr{}));
+			} };
+
+			start_sinks(force_mode);
+			try {
+				std::pair<file_ptr, file_ptr> x;
+				for (;;) {
+					channel.wait_and_pop(x);
+					if (!x.first)
+						break;
+					add_file_to_process(x.first, x.second);
+					copy_file(x.first, x.second);
+				}
+			} catch (...) {
+				// let the listing finish (it may be blocked on the full channel) before leaving
+				std::pair<file_ptr, file_ptr> x;
+				do {
+					channel.wait_and_pop(x);
+				} while (x.first);
+				producer.join();
+				stop_sinks();
+				throw;
 			}
-			if (m_task_sink)
-				m_task_sink = nullptr;
+			producer.join();
+			stop_sinks();
 		}
 
 		// initialized the copy engine
-		void init(const unsigned int& task_queue_size = 3000) {
-			m_task_queue = std::make_shared<task_queue>(task_queue_size);
+		// Parameters: 
+		//    const copy_settings& v: [in] queue sizes, number of buffers and threads
+		//    const task_dispatcher_ptr& dispatcher: [in] writers shared with the engines of other copies running at the
+		//       same time (see copy_scheduler), nullptr = the engine's own, sized from v
+		void init(const copy_settings& v = copy_settings{}, const task_dispatcher_ptr& dispatcher = nullptr) {
+			m_dispatcher = dispatcher ? dispatcher : std::make_shared<task_dispatcher>(v.task_queue_size, [v](const uint64_t& device) { return sink_workers(v, device); });
+			m_sync_phase_size = v.sync_phase_size;
+			m_layout_order = v.layout_order;
+			m_incremental = v.incremental;
+			size_t min_chunk = UNBUFFERED_ALIGNMENT;
+			while (min_chunk < v.min_chunk_size)
+				min_chunk <<= 1;
+			size_t max_chunk = static_cast<size_t>(std::min<uint64_t>(v.max_chunk_size, v.memory_budget / 4)); // a few chunks in flight at least
+			size_t buffer_count = static_cast<size_t>(v.memory_budget / min_chunk);
+			if (!buffer_count)
+				buffer_count = 1;
+			if (!m_buffer_pool || m_buffer_pool->capacity() != buffer_count || m_buffer_pool->buffer_size() != min_chunk || m_buffer_pool->max_buffer_size() != std::max(min_chunk, max_chunk))
+				m_buffer_pool = std::make_shared<buffer_pool>(min_chunk, buffer_count, UNBUFFERED_ALIGNMENT, max_chunk);
+			if (!m_block_sizer || m_block_sizer->min_size() != m_buffer_pool->buffer_size() || m_block_sizer->max_size() != m_buffer_pool->max_buffer_size())
+				m_block_sizer = std::make_shared<block_sizer>(m_buffer_pool->buffer_size(), m_buffer_pool->max_buffer_size()); // keeps the throughput measured otherwise
+			m_crc32_workers = v.crc32_workers;
+			m_crc32_queue_size = v.task_queue_size;
+			m_verify = v.verify;
+			m_verify_workers = v.verify_workers;
+			m_enum_workers = v.enum_workers;
+			m_stream_queue_size = v.stream_queue_size;
+			m_kernel_copy_enabled = v.kernel_copy;
+			m_uring_queue_depth = v.uring_queue_depth;
+			m_hdd_uring_queue_depth = v.hdd_uring_queue_depth;
+			m_nvme_uring_queue_depth = v.nvme_uring_queue_depth;
+			m_unbuffered = v.unbuffered;
+			m_readahead_window = v.readahead_window;
+			m_small_file_size = v.small_file_size;
+			m_small_batch_size = v.small_batch_size;
+			m_small_batch_files = v.small_batch_files;
+			m_parallel_file_size = v.parallel_file_size;
+			m_parallel_range_size = v.parallel_range_size;
+			m_skip_zero_blocks = v.skip_zero_blocks;
+			m_drop_behind = v.drop_behind;
+			m_uring_device_queue_depth.clear();
+#ifdef __linux__
+			for (auto& x : v.uring_device_queue_depth) {
+				uint64_t device;
+				if (!get_device_id(x.first, device))
+					m_uring_device_queue_depth[device] = x.second;
+			}
+#endif
+		}
+
+		// Thread Safe: Returns the memory and queue occupancy (call init() first)
+		copy_stats stats_ts() const {
+			copy_stats ret;
+			if (m_buffer_pool) {
+				ret.memory_budget = m_buffer_pool->budget_bytes();
+				ret.in_flight_bytes = m_buffer_pool->in_use_bytes_ts();
+				ret.peak_in_flight_bytes = m_buffer_pool->peak_in_use_bytes_ts();
+			}
+			if (m_dispatcher)
+				ret.queued_tasks = m_dispatcher->size_ts();
+			ret.sync_phases = m_sync_phases.load();
+			ret.phase_size = m_phase_size.load();
+			return ret;
 		}
 
 		// Is the current mode assynchronous?
@@ -241,13 +380,25 @@ namespace file_copy {
 			return m_num_files_to_process.load();
 		}
 
+		// Thread Safe: Returns the number of files left out because their destination is up to date (copy_settings::incremental)
+		uint64_t num_files_skipped_ts() {
+			return m_num_files_skipped.load();
+		}
+
+		// Thread Safe: Returns the total size of the files left out because their destination is up to date (copy_settings::incremental)
+		uint64_t files_skipped_size_bytes_ts() {
+			return m_files_skipped_size.load();
+		}
+
 		// Thread Safe: Returns the total number of folders to be processed (after a call to build_files_to_process)
 		uint64_t num_folders_to_process_ts() {
 			uint64_t ret = m_num_folders_to_process.load();
 			return ret ? ret - 1 : 0U;
 		}
 
-		const file_to_process_vector& get_files_to_process() const {
+		// Thread Safe: Returns a copy of the files / folders to be processed (copy_stream: the ones discovered so far)
+		file_to_process_vector get_files_to_process_ts() const {
+			std::lock_guard<std::mutex> l(m_mutex_files_to_process);
 			return m_files_to_process;
 		}
 
@@ -276,11 +427,120 @@ namespace file_copy {
 		}
 
 	protected:
-		copy_engine() {}
+#ifdef __linux__
+		// Returns the reads in flight of a source device: copy_settings::uring_device_queue_depth, otherwise from its class
+		unsigned int uring_queue_depth(const uint64_t& device) const {
+			auto it = m_uring_device_queue_depth.find(device);
+			if (it != m_uring_device_queue_depth.end())
+				return it->second;
+			switch (get_device_topology(device).type()) {
+			case device_class::rotational:
+				return m_hdd_uring_queue_depth;
+			case device_class::nvme:
+				return m_nvme_uring_queue_depth;
+			default:
+				return m_uring_queue_depth;
+			}
+		}
+#endif
+
+		// Returns true if the files can be copied inside the kernel (same file system, see io_backend::copy_from).
+		// Never unbuffered: copy_from would refuse every file.
+		bool kernel_copy_decision(const file_ptr& source, const file_ptr& dest) const {
+			bool ret = false;
+#ifdef __linux__
+			uint64_t source_device;
+			uint64_t dest_device;
+			if (m_kernel_copy_enabled && !m_unbuffered && !get_device_id(source->path_full(), source_device) && !get_device_id(dest->path_full(), dest_device))
+				ret = source_device == dest_device;
+#endif
+			return ret;
+		}
+
+		// Applies force_mode and starts the writers, hashers and readers back (verify)
+		void start_sinks(const async_mode& force_mode) {
+			switch (force_mode) {
+			case async_mode::automatic: // do nothing as the decision was made in copy_prepare
+				break;
+			case async_mode::async:
+				async(true);
+				break;
+			case async_mode::sync:
+				async(false);
+				break;
+			default: // not possible to reach
+				assert(0);
+			}
+
+			m_buffer_pool->reset_peak_ts();
+			m_sync_phases.store(0U);
+			next_phase();
+			m_job = m_dispatcher->join_ts(m_dest_device); // the writers of the destination device
+
+			if (!m_crc32_sink) {
+				m_crc32_sink = std::make_shared<crc32_sink>(m_crc32_workers, m_crc32_queue_size);
+				m_crc32_sink->run();
+			}
+
+			if (async()) {
+				m_job->run();
+			}
+
+			if (m_verify && !m_verify_sink) {
+				m_verify_sink = std::make_shared<verify_sink>(m_verify_workers, m_crc32_queue_size);
+				m_verify_sink->run();
+			}
+
+#ifdef __linux__
+			if (m_uring_queue_depth && !m_uring_reader) {
+				unsigned int max_depth = m_uring_queue_depth;
+				for (auto& x : m_uring_device_queue_depth)
+					max_depth = std::max(max_depth, x.second);
+				max_depth = std::max(max_depth, std::max(m_hdd_uring_queue_depth, m_nvme_uring_queue_depth));
+				auto reader = std::make_shared<uring_reader>(m_buffer_pool, max_depth, [this](const uint64_t& device) { return uring_queue_depth(device); }, m_block_sizer,
+					[this](const file_ptr& source, const file_ptr& dest, const io_buffer_ptr& buff, const size_t& count, const uint64_t& offset, const bool& last, const bool& success) {
+						queue_chunk(source, dest, buff, count, offset, last, success);
+					},
+					[this] {
+						if (!m_async.load())
+							commit(); // all the buffers are held by queued tasks, write them first
+					});
+				if (reader->is_valid())
+					m_uring_reader = reader;
+			}
+#endif
+		}
+
+		// Writes what's left (sync) and stops the sinks, once every file was queued
+		void stop_sinks() {
+			flush_small_batch();
+#ifdef __linux__
+			if (m_uring_reader) {
+				m_uring_reader->drain(); // the last reads still have to be queued
+				m_uring_reader = nullptr;
+			}
+#endif
+			if (!m_async.load()) {
+				commit();
+			}
+
+			stop_and_wait_sink_thread();
+
+			if (m_verify_sink) {
+				m_verify_sink->die(); // every file has been queued by now, it needs the crc32 sink still running
+				m_verify_sink = nullptr;
+			}
+
+			if (m_crc32_sink) {
+				m_crc32_sink->die(); // publishes the remaining crc32 values
+				m_crc32_sink = nullptr;
+			}
+		}
 
 		// Returns true if the files should be copied asynchronously (eg. distinct physical drives)
 		bool async_decision(const file_ptr& source, const file_ptr& dest) const {
 			bool ret = true;
+#ifdef _WIN32
 
 			VOLUME_DISK_EXTENTS source_extents;
 			VOLUME_DISK_EXTENTS dest_extents;
@@ -318,6 +578,55 @@ namespace file_copy {
 				source_extents.Extents[0].DiskNumber,
 				dest->path_full().c_str(),
 				dest_extents.Extents[0].DiskNumber);
+#else
+			uint64_t source_device;
+			uint64_t dest_device;
+
+			DWORD res;
+			res = get_device_id(source->path_full(), source_device);
+			if (!res)
+				res = get_device_id(dest->path_full(), dest_device);
+			if (res) {
+				std::wostringstream os;
+				os << "Async decision failed : path: " << source->path_full().c_str() << " or " << dest->path_full().c_str() << " "
+					<< std::showbase << std::setfill(_T('0')) << std::setw(4) << std::hex << res;
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
+			}
+
+#ifdef __linux__
+			const device_topology& source_topology = get_device_topology(source_device);
+			const device_topology& dest_topology = get_device_topology(dest_device);
+			if (source_topology.disks.empty() || dest_topology.disks.empty()) {
+				ret = source_device != dest_device; // no block device (tmpfs, nfs...): same file system identification
+			} else {
+				ret = !source_topology.shares_spindle(dest_topology); // same spinning disk (partitions, LVM, RAID members): the reads and writes would seek
+			}
+
+			TRACE(_T("async decision is that the file(s) will be copied %s from \"%s\" device[%llu] (%s, %u disk(s)) to \"%s\" device[%llu] (%s, %u disk(s))\n"),
+				ret ? _T("asynchronously") : _T("synchronously"),
+				source->path_full().c_str(),
+				static_cast<unsigned long long>(source_device),
+				device_class_name(source_topology.type()),
+				static_cast<unsigned int>(source_topology.disks.size()),
+				dest->path_full().c_str(),
+				static_cast<unsigned long long>(dest_device),
+				device_class_name(dest_topology.type()),
+				static_cast<unsigned int>(dest_topology.disks.size()));
+#else
+			// same file system identification
+			if (source_device == dest_device) {
+				ret = false;
+			}
+
+			TRACE(_T("async decision is that the file(s) will be copied %s from \"%s\" device[%llu] to \"%s\" device[%llu]\n"),
+				ret ? _T("asynchronously") : _T("synchronously"),
+				source->path_full().c_str(),
+				static_cast<unsigned long long>(source_device),
+				dest->path_full().c_str(),
+				static_cast<unsigned long long>(dest_device));
+#endif
+#endif
 
 			return ret;
 		}
@@ -345,69 +654,165 @@ namespace file_copy {
 			/*if(!dest->file_name().size() && source->file_name().size())
 				dest->file_name(source->file_name());
 			m_files_to_process.push_back(files_to_process{ source, dest });*/
+			prepare_root(source, dest, rename_existing);
+
+			if (source->is_directory()) {
+				// list the whole tree in parallel, then flatten it in the serial walk order
+				dir_walker walker{ m_enum_workers, m_incremental };
+				dir_walker::node_ptr root = walker.walk(source, dest);
+				m_num_files_skipped += walker.skipped_files();
+				m_files_skipped_size += walker.skipped_size();
+				return add_files_to_process(*root);
+			}
+
+			if (skip_unchanged(source, dest))
+				return res;
+
+			uint64_t size = source->size_ts();
+			assert(size != _UI64_MAX);
+			m_files_to_process_total_size += size;
+			res.size = size;
+
+			++m_num_files_to_process;
+			++res.files;
+
+			add_file_to_process(source, dest);
+			
+			return res;
+		}
+
+		// Reorders m_files_to_process by the position of the files on the source disk, so a spinning disk reads them
+		// in one sweep instead of seeking back and forth between the folders. The files go first, by their first
+		// extent (then the ones placed by inode only, see get_physical_position, and the ones it failed on in the
+		// listing order). The folders follow in the listing order, their children always before them: the files
+		// create the folders they need, the folder tasks then commit the attributes.
+		void order_by_layout() {
+			struct entry {
+				unsigned int rank; // 0 = physical position, 1 = inode / file index, 2 = unknown
+				uint64_t position;
+				size_t index; // listing order
+			};
+			std::vector<entry> files;
+			file_to_process_vector folders;
+			file_to_process_vector ordered;
+			ordered.reserve(m_files_to_process.size());
+			uint64_t physical_count = 0U;
+			for (size_t i = 0; i < m_files_to_process.size(); ++i) {
+				const files_to_process& x = m_files_to_process[i];
+				if (x.source()->is_directory()) {
+					folders.push_back(x);
+					continue;
+				}
+				entry e{ 2U, 0U, i };
+				bool physical = false;
+				if (!get_physical_position(x.source()->path_full(), e.position, physical))
+					e.rank = physical ? 0U : 1U;
+				if (physical)
+					++physical_count;
+				files.push_back(e);
+			}
+			std::stable_sort(files.begin(), files.end(), [](const entry& a, const entry& b) {
+				return a.rank != b.rank ? a.rank < b.rank : a.position < b.position;
+			});
+			for (auto& e : files)
+				ordered.push_back(m_files_to_process[e.index]);
+			ordered.insert(ordered.end(), folders.begin(), folders.end());
+			{
+				std::lock_guard<std::mutex> l(m_mutex_files_to_process);
+				m_files_to_process.swap(ordered);
+			}
+			TRACE(_T("layout order: %llu files, %llu by physical position\n"), static_cast<unsigned long long>(files.size()), static_cast<unsigned long long>(physical_count));
+		}
+
+		// Incremental mode: Returns true if the destination of a single file (the root of the copy) is up to date, see
+		// same_size_and_time, and counts it as skipped (a destination out of date is overwritten). The files of a
+		// folder are checked by dir_walker.
+		bool skip_unchanged(const file_ptr& source, const file_ptr& dest) {
+			WIN32_FILE_ATTRIBUTE_DATA attributes{};
+			if (!m_incremental || source->is_directory() || get_file_attributes_ex(dest->path_full(), attributes))
+				return false;
+			if (!same_size_and_time(*source->win32_attributes(), attributes)) {
+				dest->exist_choice_ts(file::exist_decision::overwrite);
+				return false;
+			}
+			++m_num_files_skipped;
+			m_files_skipped_size += source->size_ts();
+			return true;
+		}
+
+		// Names the destination after the source, renaming it if it would overwrite the source itself
+		void prepare_root(const file_ptr& source, const file_ptr& dest, bool rename_existing) {
 			if (!dest->file_name().size() && source->file_name().size())
 				dest->file_name(source->file_name());
 
 			if (rename_existing) {
 				dest->rename_to_non_existing();
 			}
+		}
 
-			if (source->is_directory()) {
-				++m_num_folders_to_process;
-				++res.folders;
-				WIN32_FIND_DATA find_file_data;
-				HANDLE h_find;
-				// root doesn't have a file name
-				h_find = FindFirstFileW((source->path_full() + _T("\\*")).c_str(), &find_file_data);
-				if (h_find == INVALID_HANDLE_VALUE) {
-					TRACE(_T("Folder Access Denied: %s"), source->path_full().c_str());
-					source->status_ts(file::file_status::failed_open);
-				}
-				while (h_find != INVALID_HANDLE_VALUE) {
-					if (!(find_file_data.cFileName[0] == _T('.') && find_file_data.cFileName[1] == _T('\0'))
-						&& !(find_file_data.cFileName[0] == _T('.') && find_file_data.cFileName[1] == _T('.') && find_file_data.cFileName[2] == _T('\0'))) {
-						///*&& /*AVOID SYSTEM FOLDERS*/!((find_file_data.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM) && (find_file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))) /*!(f->is_root() && (wcscmp(find_file_data.cFileName, _T("$RECYCLE.BIN"))==0))) /*(wcscmp(find_file_data.cFileName, _T(".")) != 0) && (wcscmp(find_file_data.cFileName, _T("..")) != 0)*/ {
-						win32_attributes_ptr attributes{ new WIN32_FILE_ATTRIBUTE_DATA };
-						attributes->dwFileAttributes = find_file_data.dwFileAttributes;
-						attributes->ftCreationTime = find_file_data.ftCreationTime;
-						attributes->ftLastAccessTime = find_file_data.ftLastAccessTime;
-						attributes->ftLastWriteTime = find_file_data.ftLastWriteTime;
-						attributes->nFileSizeHigh = find_file_data.nFileSizeHigh;
-						attributes->nFileSizeLow = find_file_data.nFileSizeLow;
-
-						file_ptr file_to_add_source{ new file{ source->path(), find_file_data.cFileName, source } };
-						file_to_add_source->win32_attributes(attributes);
-						file_ptr file_to_add_dest{ new file{ dest->path(), find_file_data.cFileName, dest } };
-
-						build_files_to_process_res res_aux = build_files_to_process(file_to_add_source, file_to_add_dest);
-						res.size += res_aux.size;
-						res.files += res_aux.files;
-						res.folders += res_aux.folders;
-					}
-
-					if (!FindNextFileW(h_find, &find_file_data)) {
-						FindClose(h_find);
-						h_find = INVALID_HANDLE_VALUE;
-					}
-				} 
-				source->size_ts(res.size); // sets the directory size
-				TRACE(_T("Folder: \"%s\"\nFiles: %d\nSubfolders: %d Size: %d\n"), source->path_full().c_str(), res.files, res.folders-1 /*subtract one to exclude the current folder*/, res.size);
-			} else {
+		// Thread Safe: Adds an entry handed over by the streaming listing to the totals
+		// Parameters:
+		//    const file_ptr& source: [in] file or folder
+		//    const dir_walker::node* dir: [in] the folder's node (listed, size), nullptr for a file
+		void stream_discovered(const file_ptr& source, const dir_walker::node* dir) {
+			if (!dir) {
 				uint64_t size = source->size_ts();
 				assert(size != _UI64_MAX);
 				m_files_to_process_total_size += size;
-				res.size = size;
-
 				++m_num_files_to_process;
-				++res.files;
+				return;
 			}
-			
-			// last thing to do is to push the file because the directory properties must be set for last
-			m_files_to_process.push_back(files_to_process{ source, dest });
-			
+
+			++m_num_folders_to_process;
+			if (!dir->listed) {
+				TRACE(_T("Folder Access Denied: %s"), source->path_full().c_str());
+				source->status_ts(file::file_status::failed_open);
+			}
+			source->size_ts(dir->size.load()); // sets the directory size
+		}
+
+		// Appends a listed directory to m_files_to_process: its entries (recursively) first and the directory itself
+		// last, because the directory properties must be set for last
+		build_files_to_process_res add_files_to_process(dir_walker::node& n) {
+			build_files_to_process_res res;
+			++m_num_folders_to_process;
+			++res.folders;
+			for (auto& e : n.entries) {
+				if (e.dir) {
+					build_files_to_process_res res_aux = add_files_to_process(*e.dir);
+					res.size += res_aux.size;
+					res.files += res_aux.files;
+					res.folders += res_aux.folders;
+				} else {
+					uint64_t size = e.source->size_ts();
+					assert(size != _UI64_MAX);
+					m_files_to_process_total_size += size;
+					res.size += size;
+
+					++m_num_files_to_process;
+					++res.files;
+					add_file_to_process(e.source, e.dest);
+				}
+			}
+			n.entries.clear(); // the subtrees aren't needed anymore
+
+			if (!n.listed) {
+				TRACE(_T("Folder Access Denied: %s"), n.source->path_full().c_str());
+				n.source->status_ts(file::file_status::failed_open);
+			}
+			n.source->size_ts(res.size); // sets the directory size
+			TRACE(_T("Folder: \"%s\"\nFiles: %d\nSubfolders: %d Size: %d\n"), n.source->path_full().c_str(), res.files, res.folders - 1 /*subtract one to exclude the current folder*/, res.size);
+
+			add_file_to_process(n.source, n.dest);
 			return res;
 		}
 
+		// Appends an entry to m_files_to_process (read by get_files_to_process_ts on other threads meanwhile)
+		void add_file_to_process(const file_ptr& source, const file_ptr& dest) {
+			std::lock_guard<std::mutex> l(m_mutex_files_to_process);
+			m_files_to_process.push_back(files_to_process{ source, dest });
+		}
+
 		// Copies the file from source into destination
 		// Parameters: 
 		//    void* buffer: [out] memory buffer where it will read into
@@ -416,28 +821,68 @@ namespace file_copy {
 		// Returns int64_t: File size
 		// Throws std::exception in case of serious issues.
 		void copy_file(file_ptr source, file_ptr dest) {
-			errno_t res;
-			size_t count = READ_SIZE;
+			errno_t res = 0;
+			size_t count = 0;
+			size_t chunk = 0;
 
-			uint32_t crc32 = 0;
+			dest->win32_attributes(source->win32_attributes());
+			source->unbuffered(m_unbuffered);
+			dest->unbuffered(m_unbuffered);
+			source->streaming(m_readahead_window, m_drop_behind);
+			dest->streaming(m_readahead_window, m_drop_behind);
+			dest->skip_zeros(m_skip_zero_blocks);
+			dest->sparse(m_skip_zero_blocks); // the chunks skipped are holes
+			if (dest->parent())
+				dest->parent()->child_queued_ts(); // the parent folder is committed after this one
 
 			if (!source->is_directory()) {
-				{ // update copy engine's monitoring variable
-					static file* prev_file = nullptr;
-					if (prev_file != source.get()) {
-						prev_file = source.get();
-						current_read_ts(source);
-					}
+				if (m_prev_read != source.get()) { // update copy engine's monitoring variable
+					m_prev_read = source.get();
+					current_read_ts(source);
+				}
+				if (m_small_file_size && !m_kernel_copy.load() && static_cast<uint64_t>(source->size_ts()) <= m_small_file_size && copy_small_file(source, dest))
+					return;
+				if (!m_kernel_copy.load() && (source->is_sparse() || (m_parallel_file_size && m_async.load() && static_cast<uint64_t>(source->size_ts()) >= m_parallel_file_size))
+					&& copy_ranges(source, dest))
+					return;
+#ifdef __linux__
+				if (m_uring_reader && !m_kernel_copy.load()) {
+					m_uring_reader->read_file(source, dest); // the chunks are queued by queue_chunk as they're read
+					return;
 				}
+#endif
 				res = source->open_read();
+				chunk = m_block_sizer->chunk_size_ts(static_cast<uint64_t>(source->size_ts()), source->device());
+			}
+#ifdef __linux__
+			else if (m_uring_reader) {
+				flush_small_batch(); // before the folder task
+				// the files of the folder may still be read: its task goes after their chunks
+				m_uring_reader->after_reads([this, dest] { queue_task(folder_task_ptr{ new folder_task{ dest } }); });
+				return;
+			}
+#endif
+			else if (m_small_batch) {
+				// every file of the folder is queued or in the batch already: the folder goes at the end of the batch
+				m_small_batch->add(folder_task_ptr{ new folder_task{ dest } });
+				return;
 			}
 			
 			bool success = false;
-			dest->win32_attributes(source->win32_attributes());
-			bool first_run = true;
-			std::future<uint32_t> fut_crc;
+			uint64_t offset = 0U;
 
-			//fut_crc = std::async(test_async,1);
+			if (!source->is_directory() && !res && m_kernel_copy.load()) {
+				kernel_copy_file(source, dest, chunk);
+				return;
+			}
+
+			if (!source->is_directory() && res) { // nothing to write: the destination isn't created
+				TRACE(_T("Opening for read failed : file path : %s : error %d\n"), source->path_full().c_str(), res);
+				source->status_ts(file::file_status::failed_open);
+				dest->status_ts(file::file_status::failed);
+				dest->finished_ts(); // the parent folder is done with it
+				return;
+			}
 
 			do {
 				task_ptr task;
@@ -446,34 +891,46 @@ namespace file_copy {
 					task = folder;
 					success = true;
 				} else {
-					file_part_task_ptr dest_part{ new file_part_task{ dest } };
-					success = source->read(m_buff, count);
-					if (!first_run) {
-						crc32 = fut_crc.get();
-					} else {
-						first_run = false;
+					file_part_task_ptr dest_part{ new file_part_task{ *this, dest, source } };
+					if (!m_async.load() && !m_buffer_pool->available(chunk))
+						commit(); // all the buffers are held by queued tasks, write them first
+
+					// read straight into a pooled buffer, shared afterwards by the write task and the crc32 stage
+					io_buffer_ptr buff = m_buffer_pool->acquire(chunk);
+					count = buff->size();
+					if (count < LARGE_CHUNK_MIN && offset) {
+						success = source->read(buff->data(), count);
+					} else { // measures the device for the next chunk sizes (and its access time on the first read)
+						auto start = std::chrono::steady_clock::now();
+						success = source->read(buff->data(), count);
+						double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+						if (offset)
+							m_block_sizer->record_ts(source->device(), count, seconds);
+						else
+							m_block_sizer->record_access_ts(source->device(), count, seconds);
 					}
-
-					if (success) {
-						async_crc32 async_task(m_buff, count, crc32);
-						fut_crc = std::async(/*std::launch::async,*/ async_task);
-					} else {
+					m_phase_read += count;
+					if (!success) {
 						source->status_ts(file::file_status::failed_open);
+						dest->fail_write_ts(); // the chunks not written yet are dropped, the last one closes it as failed
+						count = 0;
 					}
+					bool last = !success || source->is_eof(); // the file is closed when the read fails
 
 					/*if (success) {
 						crc32 = crc32::crc32_16bytes_prefetch(m_buff, count, crc32);
 					} else {
 						source->failed(true);
 					}*/
-					dest_part->write_buff_store(m_buff, count, source->is_eof());
+					dest->chunk_queued_ts(last);
+					dest_part->write_buff_store(buff, count, offset, last);
+					if (success) {
+						m_crc32_sink->push(source, buff, count, offset, last);
+					}
+					offset += count;
 					task = dest_part;
 				}
-				if (!m_async.load()) {
-					if (m_task_queue->size() == m_task_queue->max_size())
-						commit();
-				}
-				m_task_queue->push(task);
+				queue_task(task);
 
 			} while (success && (source->is_directory() ? false : !source->is_eof()));
 
@@ -481,13 +938,201 @@ namespace file_copy {
 				commit();
 			}*/
 
-			if (success && (source->is_directory() ? false : source->is_eof())) {
-				crc32 = fut_crc.get();
-				source->crc32_ts(crc32);
-			}
 			source->close(); // dest will be closed automatically during the last write.
 		};
 
+		// Reads a small file in one call into the buffer of the current batch of small files, and adds its write
+		// (hashing it too) to the batch. The batch is queued as a single task once full (see flush_small_batch).
+		// Parameters: 
+		//    const file_ptr& source: [in] file to be copied (size_ts() <= copy_settings::small_file_size)
+		//    const file_ptr& dest: [in] destination
+		// Returns bool: false = the file isn't small anymore (or doesn't fit a batch), the caller copies it the regular way
+		bool copy_small_file(const file_ptr& source, const file_ptr& dest) {
+			// room for one byte more than listed: the read reaches the end of the file, or finds it grew
+			const size_t align = m_unbuffered ? UNBUFFERED_ALIGNMENT : SMALL_FILE_ALIGNMENT;
+			const size_t capacity = (static_cast<size_t>(source->size_ts()) + align) & ~(align - 1);
+			if (capacity > m_buffer_pool->max_buffer_size())
+				return false;
+			if (m_small_batch && (m_small_used + capacity > m_small_buff->size() || m_small_batch->size() >= m_small_batch_files))
+				flush_small_batch();
+			if (!m_small_batch) {
+				m_small_buff = acquire_buffer(std::max(m_small_batch_size, capacity));
+				m_small_used = 0;
+				m_small_batch = std::make_shared<task_batch>();
+			}
+
+			size_t count = capacity;
+			bool success = !source->open_read();
+			if (success) {
+				auto start = std::chrono::steady_clock::now();
+				success = source->read(m_small_buff->data() + m_small_used, count);
+				m_block_sizer->record_access_ts(source->device(), count, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			}
+			if (success && !source->is_eof()) { // it grew since it was listed
+				source->close();
+				return false;
+			}
+			if (!success) {
+				source->status_ts(file::file_status::failed_open);
+				source->close();
+				// nothing to write: the destination isn't created, the parent folder is done with it
+				dest->status_ts(file::file_status::failed);
+				dest->finished_ts();
+				return true;
+			}
+			source->close();
+
+			file_part_task_ptr dest_part{ new file_part_task{ *this, dest, source } };
+			dest->chunk_queued_ts(true);
+			dest_part->write_buff_store(m_small_buff, count, 0U, true, m_small_used);
+			dest_part->small_file_store();
+			m_small_batch->add(dest_part);
+			m_small_used += capacity;
+			return true;
+		}
+
+		// Splits a large or sparse file into ranges of copy_settings::parallel_range_size, and queues one task copying
+		// each (see file_part_task::range_store): the writers read and write distinct ranges of the file at the same time.
+		// Every range holds one buffer from the pool until it's copied. Only the data ranges of a sparse file are
+		// copied: the holes stay holes in the destination, their CRC is computed without reading them.
+		// Parameters: 
+		//    const file_ptr& source: [in] file to be copied (size_ts() >= copy_settings::parallel_file_size, or sparse)
+		//    const file_ptr& dest: [in] destination
+		// Returns bool: false = not split (a large file on a spinning disk, or it can't be opened), the caller copies it the regular way
+		bool copy_ranges(const file_ptr& source, const file_ptr& dest) {
+			const bool sparse = source->is_sparse();
+#ifdef __linux__
+			uint64_t device;
+			if (!sparse && !get_device_id(source->path_full(), device) && m_block_sizer->rotational_ts(device))
+				return false; // the heads would seek between the ranges
+#endif
+			if (source->open_read())
+				return false;
+
+			flush_small_batch(); // its buffer isn't held while waiting for the ranges' ones
+			const uint64_t size = static_cast<uint64_t>(source->size_ts()); // as preallocated
+			const size_t chunk = m_block_sizer->chunk_size_ts(size, source->device());
+			size_t range = (m_parallel_range_size + chunk - 1) / chunk * chunk;
+			if (!range)
+				range = chunk;
+			if (sparse)
+				dest->sparse(true);
+
+			bool last = false;
+			for (uint64_t offset = 0U; offset < size;) {
+				uint64_t begin = offset;
+				uint64_t end = size;
+				if (sparse && source->next_data(offset, begin, end))
+					begin = offset, end = size; // no hole information: all data
+				begin = std::min(begin, size);
+				end = std::min(std::max(end, begin), size);
+				if (begin > offset) // a hole
+					crc32_range_ts(source, crc32::crc32_zeros(begin - offset), begin - offset, offset, begin == size);
+				for (offset = begin; offset < end; offset += range) {
+					last = end == size && end - offset <= range;
+					file_part_task_ptr dest_part{ new file_part_task{ *this, dest, source } };
+					dest_part->range_store(acquire_buffer(chunk), static_cast<size_t>(std::min<uint64_t>(range, end - offset)), offset, last);
+					dest->chunk_queued_ts(last);
+					queue_task(dest_part);
+				}
+				offset = end;
+			}
+			if (!last) { // no data at the end: an empty range creates (or closes) the destination
+				file_part_task_ptr dest_part{ new file_part_task{ *this, dest, source } };
+				dest_part->range_store(nullptr, 0U, size, true);
+				dest->chunk_queued_ts(true);
+				queue_task(dest_part);
+			}
+			return true; // the last range to be copied closes the source
+		}
+
+		// Gets a buffer from the pool for the reads done on this thread. When none is free, the chunks read ahead by
+		// the uring_reader are queued first (they hold buffers until then), and in sync mode the queued tasks are written.
+		// Parameters: 
+		//    const size_t& size: [in] bytes needed (see buffer_pool::acquire)
+		io_buffer_ptr acquire_buffer(const size_t& size) {
+			io_buffer_ptr buff = m_buffer_pool->try_acquire(size);
+			if (buff)
+				return buff;
+#ifdef __linux__
+			if (m_uring_reader)
+				m_uring_reader->drain();
+#endif
+			if (!m_async.load() && !m_buffer_pool->available(size))
+				commit(); // all the buffers are held by queued tasks, write them first
+			return m_buffer_pool->acquire(size);
+		}
+
+		// Queues the current batch of small files, if any
+		void flush_small_batch() {
+			if (!m_small_batch)
+				return;
+			task_batch_ptr batch = m_small_batch;
+			m_small_batch = nullptr;
+			m_small_buff.reset(); // the tasks hold it
+			queue_task(batch);
+		}
+
+		// Queues the write (and the hash) of one chunk read by the uring_reader
+		// Parameters: 
+		//    const file_ptr& source, const file_ptr& dest: [in] file being copied
+		//    const io_buffer_ptr& buff: [in] data read
+		//    const size_t& count: [in] number of bytes in buff
+		//    const uint64_t& offset: [in] position of the chunk in the file
+		//    const bool& last: [in] last chunk of the file (already accounted in dest)
+		//    const bool& success: [in] false = the read failed
+		void queue_chunk(const file_ptr& source, const file_ptr& dest, const io_buffer_ptr& buff, const size_t& count, const uint64_t& offset, const bool& last, const bool& success) {
+			file_part_task_ptr dest_part{ new file_part_task{ *this, dest, source } };
+			if (!success)
+				source->status_ts(file::file_status::failed_open);
+			dest_part->write_buff_store(buff, count, offset, last);
+			if (success)
+				m_crc32_sink->push(source, buff, count, offset, last);
+			m_phase_read += count;
+			queue_task(dest_part);
+		}
+
+		// Queues a task for the writers (sync mode: writes the queued ones first once the read phase is over, see
+		// next_phase, or if the queue is full)
+		void queue_task(const task_ptr& task) {
+			if (!m_async.load()) {
+				if (m_phase_read >= m_phase_size.load() || m_job->full())
+					commit();
+			}
+			m_job->push(task);
+		}
+
+		// Queues one task copying the whole file inside the kernel. No data goes through the buffers, unless the file
+		// is verified: the source is read and hashed then (the writer doesn't see the data anymore).
+		// Parameters: 
+		//    file_ptr source: [in] file open for reading
+		//    file_ptr dest: [in] destination
+		//    const size_t& chunk: [in] size of the reads hashing the source (see block_sizer)
+		void kernel_copy_file(file_ptr source, file_ptr dest, const size_t& chunk) {
+			file_part_task_ptr dest_part{ new file_part_task{ *this, dest, source } };
+			dest_part->kernel_copy_store();
+			dest->chunk_queued_ts(true);
+			queue_task(dest_part);
+
+			if (m_verify) {
+				uint64_t offset = 0U;
+				bool last = false;
+				while (!last) {
+					io_buffer_ptr buff = m_buffer_pool->acquire(chunk); // released by the crc32 stage
+					size_t count = buff->size();
+					bool success = source->read(buff->data(), count);
+					if (!success) {
+						source->status_ts(file::file_status::failed_open);
+						count = 0; // ends the hash, the destination won't be verified
+					}
+					last = !success || source->is_eof();
+					m_crc32_sink->push(source, buff, count, offset, last);
+					offset += count;
+				}
+			}
+			source->close();
+		}
+
 		void current_read_ts(file_ptr v) {
 			std::lock_guard<std::mutex> l(m_mutex_current_read);
 			m_mutex_current_read_is_dirty.store(true);
@@ -501,34 +1146,109 @@ namespace file_copy {
 		}
 
 		void commit() {
-			m_task_sink->commit();
+			m_job->commit();
+			next_phase();
+		}
+
+		// Sync mode: starts a read phase, sized again from what the source disk measured so far (a disk reading and
+		// writing at once seeks between the two: long phases of each keep it mostly streaming)
+		void next_phase() {
+			if (m_phase_read)
+				++m_sync_phases;
+			m_phase_read = 0U;
+			m_phase_size.store(m_sync_phase_size ? std::min(m_sync_phase_size, m_buffer_pool->budget_bytes()) : m_block_sizer->phase_size_ts(m_source_device, m_buffer_pool->budget_bytes()));
+		}
+
+		// Thread Safe: the file system refused a kernel copy, the next files go through the buffers
+		void kernel_copy_unsupported_ts() {
+			m_kernel_copy.store(false);
+		}
+
+		// Thread Safe: merges the CRC of a range copied by a writer (see file_part_task::range_commit)
+		void crc32_range_ts(const file_ptr& source, const uint32_t& crc, const uint64_t& count, const uint64_t& offset, const bool& last) {
+			m_crc32_sink->push_crc(source, crc, count, offset, last);
 		}
 
+		// Queues a written file to be read back, if verification is enabled
+		void verify_ts(const file_ptr& source, const file_ptr& dest) {
+			if (m_verify_sink)
+				m_verify_sink->push(source, dest);
+		}
+
+		// Waits for the writes of this copy and leaves the writers of the destination device
 		void stop_and_wait_sink_thread() {
-			if (m_sink_thread) {
-				if (m_task_sink)
-					m_task_sink->die();
-				m_sink_thread = nullptr;
+			if (m_job) {
+				m_job->finish();
+				m_job = nullptr;
 			}
 		}
 
 	protected:
 		
-		task_queue_ptr m_task_queue;
-		task_sink_ptr m_task_sink;
-		std::shared_ptr<std::thread> m_sink_thread;
+		task_dispatcher_ptr m_dispatcher; // writers of the destination devices (created by init, or shared with other engines)
+		task_dispatcher::job_ptr m_job; // the current copy on the writers of m_dest_device
+		uint64_t m_dest_device{ 0U }; // device id of the destination of the current copy (0 = unknown), picks its writers
+		uint64_t m_source_device{ 0U }; // device id of the source of the current copy (0 = unknown)
+		uint64_t m_sync_phase_size{ 0U }; // copy_settings::sync_phase_size
+		bool m_layout_order{ false }; // copy_settings::layout_order
+		bool m_incremental{ false }; // copy_settings::incremental
+		uint64_t m_phase_read{ 0U }; // sync mode: bytes read in the current phase
+		std::atomic<uint64_t> m_phase_size{ 0U }; // sync mode: bytes of the current read phase
+		std::atomic<uint64_t> m_sync_phases{ 0U }; // sync mode: phases of the current copy (see stats_ts)
+
+		verify_sink_ptr m_verify_sink;
+		bool m_verify{ false };
+		unsigned int m_verify_workers{ 2 };
+
+		unsigned int m_enum_workers{ 4 };
+		unsigned int m_stream_queue_size{ 4096 };
+
+		bool m_unbuffered{ false }; // copy_settings::unbuffered
+		uint64_t m_readahead_window{ 8ULL * 1024 * 1024 }; // copy_settings::readahead_window
+		bool m_drop_behind{ true }; // copy_settings::drop_behind
+
+		bool m_kernel_copy_enabled{ true }; // copy_settings::kernel_copy
+		std::atomic<bool> m_kernel_copy{ false }; // decided in copy_prepare / copy_stream, dropped when the file system refuses it
+
+		unsigned int m_uring_queue_depth{ 32 };
+		unsigned int m_hdd_uring_queue_depth{ 2 };
+		unsigned int m_nvme_uring_queue_depth{ 64 };
+		std::map<uint64_t, unsigned int> m_uring_device_queue_depth; // device id -> queue depth
+#ifdef __linux__
+		uring_reader_ptr m_uring_reader; // reads the files while copying (null: io_uring not used / not available)
+#endif
+
+		crc32_sink_ptr m_crc32_sink;
+		unsigned int m_crc32_workers{ 2 };
+		unsigned int m_crc32_queue_size{ 16384 };
 
 		std::atomic<uint64_t> m_files_to_process_total_size{ 0 };
 		std::atomic<uint64_t> m_num_files_to_process{ 0 };
 		std::atomic<uint64_t> m_num_folders_to_process{ 0 };
+		std::atomic<uint64_t> m_num_files_skipped{ 0 }; // copy_settings::incremental
+		std::atomic<uint64_t> m_files_skipped_size{ 0 };
+
+		buffer_pool_ptr m_buffer_pool;
+		block_sizer_ptr m_block_sizer; // chunk size of each file (created by init)
+
+		size_t m_small_file_size{ 64 * 1024 }; // copy_settings::small_file_size
+		size_t m_small_batch_size{ 1024 * 1024 }; // copy_settings::small_batch_size
+		unsigned int m_small_batch_files{ 256 }; // copy_settings::small_batch_files
+		task_batch_ptr m_small_batch; // batch of small files being filled (null: none)
+		io_buffer_ptr m_small_buff; // buffer of m_small_batch
+		size_t m_small_used{ 0 }; // bytes of m_small_buff used by m_small_batch
 
-		char m_buff[READ_SIZE];
+		uint64_t m_parallel_file_size{ 1024ULL * 1024 * 1024 }; // copy_settings::parallel_file_size
+		size_t m_parallel_range_size{ 64 * 1024 * 1024 }; // copy_settings::parallel_range_size
+		bool m_skip_zero_blocks{ false }; // copy_settings::skip_zero_blocks
 
-		file_to_process_vector m_files_to_process;
+		file_to_process_vector m_files_to_process; // only changed by the copying thread, under m_mutex_files_to_process
+		mutable std::mutex m_mutex_files_to_process;
 
 		std::atomic<bool> m_async{ false };
 
 		std::mutex m_mutex_current_read;
+		file* m_prev_read{ nullptr }; // copying thread: last file passed to current_read_ts
 		file_ptr m_current_read;
 		file_ptr m_current_read_local;
 		std::atomic<bool> m_mutex_current_read_is_dirty{ false };
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "copy_engine.h"
+
+namespace file_copy {
+	// Runs copies (source -> destination folder), including the ones added while it runs, each with its own
+	// copy_engine on its own thread (copy_engine::copy_stream). The copies reading from distinct devices run at the
+	// same time; the ones reading the same device wait for each other, in the order added (their reads would seek
+	// between each other). The writers are shared: one queue and worker pool per destination device, sized to its
+	// class (task_dispatcher), so copies from two devices into a third keep the three busy.
+	// Each copy has its own buffers (copy_settings::memory_budget) and hashers.
+	class copy_scheduler {
+	public:
+		// Constructor
+		// Parameters:
+		//    const copy_settings& settings: [in] settings of every copy
+		//    const copy_engine::async_mode& mode: [in] passed to copy_engine::copy_stream
+		copy_scheduler(const copy_settings& settings = copy_settings{}, const copy_engine::async_mode& mode = copy_engine::async_mode::automatic) :
+			m_settings{ settings }, m_mode{ mode },
+			m_dispatcher{ std::make_shared<task_dispatcher>(settings.task_queue_size, [settings](const uint64_t& device) { return sink_workers(settings, device); }) } {}
+
+		~copy_scheduler() {
+			std::unique_lock<std::mutex> l(m_mutex);
+			for (auto& j : m_running) { // run() left by an exception: the copies still end on their own
+				l.unlock();
+				if (j->thread.joinable())
+					j->thread.join();
+				l.lock();
+			}
+		}
+
+		// Thread safe: Adds a copy (never blocks): it starts once run() gets to it
+		// Parameters:
+		//    const std::wstring& source: [in] file or folder to be copied
+		//    const std::wstring& dest_folder: [in] folder where source will be copied into
+		void add_ts(const std::wstring& source, const std::wstring& dest_folder) {
+			copy_ptr c{ new copy{} };
+			c->source = source;
+			c->dest = dest_folder;
+			{
+				std::lock_guard<std::mutex> l(m_mutex);
+				m_added.push_back(c);
+			}
+			m_cv.notify_all();
+		}
+
+		// Runs the copies added (and the ones added meanwhile) until none is left
+		// Returns bool: true = every copy ran, false = at least one failed as a whole (see copy_engine::copy_stream)
+		bool run() {
+			bool ret = true;
+			std::list<copy_ptr> waiting; // source device busy
+			std::set<uint64_t> reading; // source devices of the copies running
+			std::unique_lock<std::mutex> l(m_mutex);
+			for (;;) {
+				while (!m_added.empty()) {
+					copy_ptr c = m_added.front();
+					m_added.pop_front();
+					l.unlock();
+					c->device = device_id(file_ptr{ new file{ c->source } });
+					l.lock();
+					waiting.push_back(c);
+				}
+
+				for (auto it = m_running.begin(); it != m_running.end();) {
+					if (!(*it)->done) {
+						++it;
+						continue;
+					}
+					copy_ptr c = *it;
+					it = m_running.erase(it);
+					m_finished.push_back(c);
+					reading.erase(c->device);
+					ret = !c->failed && ret;
+					l.unlock();
+					c->thread.join(); // it's leaving
+					l.lock();
+				}
+
+				for (auto it = waiting.begin(); it != waiting.end();) {
+					if (reading.count((*it)->device)) {
+						++it;
+						continue;
+					}
+					copy_ptr c = *it;
+					it = waiting.erase(it);
+					reading.insert(c->device);
+					start(c);
+				}
+
+				if (m_running.empty() && waiting.empty() && m_added.empty())
+					break;
+				m_cv.wait(l, [this] { return !m_added.empty() || std::any_of(m_running.begin(), m_running.end(), [](const copy_ptr& c) { return c->done; }); });
+			}
+			return ret;
+		}
+
+		// Thread safe: Is any copy running asynchronously?
+		bool async_ts() {
+			std::lock_guard<std::mutex> l(m_mutex);
+			for (auto& c : m_running)
+				if (c->engine->async())
+					return true;
+			return false;
+		}
+
+		// Thread safe: Returns the file being read by the copy started last (nullptr: none running)
+		file_ptr current_read_ts() {
+			std::lock_guard<std::mutex> l(m_mutex);
+			return m_running.empty() ? nullptr : m_running.back()->engine->current_read_ts();
+		}
+
+		// Thread safe: Returns the file being written by the copy started last (nullptr: none running)
+		file_ptr current_write_ts() {
+			std::lock_guard<std::mutex> l(m_mutex);
+			return m_running.empty() ? nullptr : m_running.back()->engine->current_write_ts();
+		}
+
+		// Thread safe: Returns the files and folders discovered so far by the copies, running and finished
+		uint64_t num_to_process_ts() {
+			std::lock_guard<std::mutex> l(m_mutex);
+			uint64_t ret = 0U;
+			for (auto& list : { &m_running, &m_finished })
+				for (auto& c : *list)
+					ret += c->engine->num_files_to_process_ts() + c->engine->num_folders_to_process_ts();
+			return ret;
+		}
+
+		// Thread safe: Returns the most copies that ran at the same time
+		unsigned int max_running_ts() {
+			std::lock_guard<std::mutex> l(m_mutex);
+			return m_max_running;
+		}
+
+		// Calls f(source, dest_folder, engine) for every finished copy, in the order they finished
+		template<typename F>
+		void for_each_finished(F f) {
+			std::lock_guard<std::mutex> l(m_mutex);
+			for (auto& c : m_finished)
+				f(c->source, c->dest, *c->engine);
+		}
+
+	private:
+		struct copy {
+			std::wstring source;
+			std::wstring dest;
+			uint64_t device{ 0U }; // device read (see device_id)
+			std::unique_ptr<copy_engine> engine;
+			std::thread thread;
+			bool done{ false }; // under m_mutex
+			bool failed{ false };
+		};
+		using copy_ptr = std::shared_ptr<copy>;
+
+		// Starts a copy on its own thread (m_mutex held)
+		void start(const copy_ptr& c) {
+			c->engine.reset(new copy_engine{});
+			c->engine->init(m_settings, m_dispatcher);
+			m_running.push_back(c);
+			m_max_running = std::max(m_max_running, static_cast<unsigned int>(m_running.size()));
+			c->thread = std::thread{ [this, c] {
+				bool failed = false;
+				try {
+					c->engine->copy_stream(c->source, c->dest, m_mode);
+				} catch (const std::exception& e) {
+					TRACE("exception when copying! %s\n", e.what());
+					failed = true;
+				}
+				{
+					std::lock_guard<std::mutex> l(m_mutex);
+					c->failed = failed;
+					c->done = true;
+				}
+				m_cv.notify_all();
+			} };
+		}
+
+		copy_settings m_settings;
+		copy_engine::async_mode m_mode;
+		task_dispatcher_ptr m_dispatcher; // the writers, shared by the copies
+
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		std::deque<copy_ptr> m_added; // unbounded: add_ts never blocks the caller
+		std::list<copy_ptr> m_running;
+		std::list<copy_ptr> m_finished;
+		unsigned int m_max_running{ 0 };
+	};
+}
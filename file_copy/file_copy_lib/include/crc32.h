@@ -1,5 +1,12 @@
 #pragma once
 
+// the system headers included inside the namespace below must be seen at global scope first
+#include <stdlib.h>
+#include <stdint.h>
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+#include <sys/param.h>
+#endif
+
 namespace crc32 {
 	// //////////////////////////////////////////////////////////
 	// Crc32.cpp
@@ -425,4 +432,112 @@ namespace crc32 {
 	{
 		return crc32_16bytes(data, length, previousCrc32);
 	}
+
+
+	// //////////////////////////////////////////////////////////
+	// Combining CRCs of consecutive blocks (same approach as zlib's crc32_combine):
+	// crc(A+B) = crc(A) * x^(8 * length(B)) mod P  xor  crc(B)
+	// so blocks can be hashed independently (in any order, on any thread) and merged in offset order.
+
+	/// multiply a by b modulo the polynomial (both bit-reflected, x^0 is the highest bit)
+	inline uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+	{
+		uint32_t m = 1U << 31;
+		uint32_t p = 0;
+		for (;;)
+		{
+			if (a & m)
+			{
+				p ^= b;
+				if ((a & (m - 1)) == 0)
+					break;
+			}
+			m >>= 1;
+			b = b & 1 ? (b >> 1) ^ Polynomial : b >> 1;
+		}
+		return p;
+	}
+
+	/// x^(2^k) mod P for k = 0..31
+	struct crc32_x2n_table
+	{
+		uint32_t x2n[32];
+
+		crc32_x2n_table()
+		{
+			uint32_t p = 1U << 30; // x^1
+			x2n[0] = p;
+			for (int n = 1; n < 32; n++)
+				x2n[n] = p = crc32_multmodp(p, p);
+		}
+	};
+
+	/// x^(n * 2^k) mod P
+	inline uint32_t crc32_x2nmodp(uint64_t n, unsigned int k)
+	{
+		static const crc32_x2n_table table;
+		uint32_t p = 1U << 31; // x^0 == 1
+		while (n)
+		{
+			if (n & 1)
+				p = crc32_multmodp(table.x2n[k & 31], p);
+			n >>= 1;
+			k++;
+		}
+		return p;
+	}
+
+	/// operator to append lengthB bytes, to be used with crc32_combine_op (worth caching when many blocks have the same length)
+	inline uint32_t crc32_combine_gen(uint64_t lengthB)
+	{
+		return crc32_x2nmodp(lengthB, 3);
+	}
+
+	/// CRC of A+B, from the CRC of A, the CRC of B and the operator of B's length (crc32_combine_gen)
+	inline uint32_t crc32_combine_op(uint32_t crcA, uint32_t crcB, uint32_t op)
+	{
+		return crc32_multmodp(op, crcA) ^ crcB;
+	}
+
+	/// CRC of A+B, from the CRC of A, the CRC of B (hashed with previousCrc32 = 0) and the length of B
+	inline uint32_t crc32_combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB)
+	{
+		return crc32_combine_op(crcA, crcB, crc32_combine_gen(lengthB));
+	}
+
+	/// CRC of length zero bytes without reading them (eg. a hole of a sparse file): the initial ~0 shifted through
+	/// length bytes, then inverted
+	inline uint32_t crc32_zeros(uint64_t length)
+	{
+		return crc32_multmodp(crc32_combine_gen(length), 0xFFFFFFFF) ^ 0xFFFFFFFF;
+	}
+
+
+	// //////////////////////////////////////////////////////////
+	// Carry-less multiplication kernels (crc32_clmul.cpp), same polynomial and results as crc32_bitwise.
+	// They fold the data 64 (pclmul) or 256 (vpclmul) bytes at a time, as described in Intel's
+	// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+	// Only call them directly when the CPU supports them: crc32_hw picks the right one.
+
+	/// compute CRC32 with SSE4.1 + PCLMULQDQ (x86 only)
+	uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32 = 0);
+
+	/// compute CRC32 with AVX-512 + VPCLMULQDQ (x86 only, not available with compilers lacking the intrinsics)
+	uint32_t crc32_vpclmul(const void* data, size_t length, uint32_t previousCrc32 = 0);
+
+	/// kernels crc32_hw can dispatch to
+	enum class crc32_kernel {
+		slicing_by_16, // crc32_16bytes_prefetch
+		pclmul,
+		vpclmul
+	};
+
+	/// Returns the kernel selected for this CPU (detected once, on first use)
+	crc32_kernel crc32_hw_kernel();
+
+	/// Returns the name of a kernel (for traces / benchmarks)
+	const char* crc32_kernel_name(const crc32_kernel& kernel);
+
+	/// compute CRC32 using the fastest kernel supported by the CPU
+	uint32_t crc32_hw(const void* data, size_t length, uint32_t previousCrc32 = 0);
 }
\ No newline at end of file
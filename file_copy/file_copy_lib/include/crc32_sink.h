@@ -0,0 +1,106 @@
+#pragma once
+
+#include <thread>
+#include <cassert>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include "concurrent_queue.h"
+#include "thread_tools.h"
+#include "tools.h"
+#include "file.h"
+#include "buffer_pool.h"
+
+namespace file_copy {
+	// One chunk to be hashed. buff is shared with the write task, nothing is copied.
+	struct crc32_job {
+		file_ptr fp;
+		io_buffer_ptr buff;
+		size_t count{ 0 };
+		uint64_t offset{ 0U };
+		bool last{ false };
+	};
+
+	using crc32_job_queue = thread_tools::concurrent_queue<crc32_job>;
+	using crc32_job_queue_ptr = std::shared_ptr<crc32_job_queue>;
+
+	// Long lived hashing stage with a fixed number of workers sharing one queue.
+	// Every chunk is hashed on its own by whichever worker pops it, so a single large file is hashed on all
+	// the workers. The chunk CRCs are merged in offset order (crc32_combine) into the file, and the result is
+	// published to file::crc32_ts once every chunk up to the last one is merged.
+	class crc32_sink {
+	public:
+		// Constructor
+		// Parameters:
+		//    const unsigned int& workers: [in] number of hashing threads
+		//    const unsigned int& queue_size: [in] maximum number of pending chunks
+		crc32_sink(const unsigned int& workers, const unsigned int& queue_size);
+
+		~crc32_sink() {
+			die();
+		}
+
+		// Starts the worker threads
+		void run();
+
+		// Queues a chunk of fp to be hashed (blocks if the worker queue is full)
+		// Parameters:
+		//    const file_ptr& fp: [in] file the chunk belongs to (source)
+		//    const io_buffer_ptr& buff: [in] data, kept alive until hashed
+		//    const size_t& count: [in] number of bytes in buff
+		//    const uint64_t& offset: [in] position of the chunk in the file
+		//    const bool& last: [in] last chunk of the file, the result is published once all the chunks are merged
+		void push(const file_ptr& fp, const io_buffer_ptr& buff, const size_t& count, const uint64_t& offset, const bool& last);
+
+		// Thread safe
+		// Merges the CRC of a range hashed by the caller (eg. a range of a large file copied on a writer thread, or
+		// a hole, see crc32::crc32_zeros), the same way as the chunks hashed here
+		// Parameters:
+		//    const file_ptr& fp: [in] file the range belongs to (source)
+		//    const uint32_t& crc: [in] CRC of the range
+		//    const uint64_t& count: [in] size of the range
+		//    const uint64_t& offset: [in] position of the range in the file
+		//    const bool& last: [in] last range of the file
+		void push_crc(const file_ptr& fp, const uint32_t& crc, const uint64_t& count, const uint64_t& offset, const bool& last);
+
+		// Waits until every chunk pushed so far has been hashed
+		void commit();
+
+		// Waits for the pending chunks and stops the worker threads
+		void die();
+
+	private:
+		class worker : public thread_tools::thread_wrapper {
+		public:
+			worker(crc32_sink& owner) :
+				m_owner(owner) {
+			}
+
+			virtual void operator ()();
+
+		private:
+			crc32_sink& m_owner;
+		};
+
+		bool processNext();
+
+		// Hashes the chunk and merges it into the file's CRC (publishing it when complete)
+		void process(crc32_job& job);
+
+		// Merges the CRC of a chunk into the file, publishing the file CRC once complete
+		void publish(file& f, const uint32_t& crc, const uint64_t& count, const uint64_t& offset, const bool& last);
+
+		// Merges the chunk CRC into the file, in offset order. Must be called with f.m_mutex_crc32 held.
+		void merge(file& f, const uint64_t& offset, const uint32_t& crc, const uint64_t& count);
+
+		crc32_job_queue_ptr m_cq;
+		std::vector<std::shared_ptr<worker>> m_workers;
+		bool m_running{ false };
+
+		std::atomic<uint64_t> m_pending{ 0U };
+		std::mutex m_mutex_pending;
+		std::condition_variable m_cv_pending;
+	};
+
+	using crc32_sink_ptr = std::shared_ptr<crc32_sink>;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#ifdef __linux__
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "tools.h"
+
+namespace file_copy {
+	// Class of the storage behind a file system
+	enum class device_class {
+		unknown, // no block device (tmpfs, nfs, fuse, btrfs' anonymous device ids...)
+		rotational, // spinning disk(s): seeks are expensive
+		solid_state, // SATA / SAS / virtual disks without seeks
+		nvme // NVMe: several deep hardware queues
+	};
+
+	inline const wchar_t* device_class_name(const device_class& v) {
+		switch (v) {
+		case device_class::rotational:
+			return _T("rotational");
+		case device_class::solid_state:
+			return _T("solid_state");
+		case device_class::nvme:
+			return _T("nvme");
+		default:
+			return _T("unknown");
+		}
+	}
+
+	// Physical disk below a file system (see device_topology)
+	struct physical_disk {
+		std::string name; // kernel name (eg. sda, nvme0n1)
+		bool rotational{ false }; // queue/rotational
+		unsigned int queue_depth{ 0 }; // device/queue_depth: commands the disk holds at once (0 = unknown, eg. NVMe)
+		unsigned int nr_requests{ 0 }; // queue/nr_requests: requests the block layer queues for it (0 = unknown)
+	};
+
+	// Physical disks holding the file system of a device id (st_dev), as found in sysfs: /sys/dev/block/<major>:<minor>,
+	// up from a partition to its disk and down the slaves of device mapper (LVM, dm-crypt...) and md (RAID) devices.
+	struct device_topology {
+		uint64_t device{ 0U }; // st_dev
+		std::vector<physical_disk> disks; // empty: no block device (unknown)
+
+		// Returns true if any of the disks spins
+		inline bool rotational() const {
+			for (auto& d : disks)
+				if (d.rotational)
+					return true;
+			return false;
+		}
+
+		inline device_class type() const {
+			if (disks.empty())
+				return device_class::unknown;
+			if (rotational())
+				return device_class::rotational;
+			for (auto& d : disks)
+				if (d.name.compare(0, 4, "nvme"))
+					return device_class::solid_state;
+			return device_class::nvme;
+		}
+
+		// Returns true if both file systems have a spinning disk in common (its heads would seek between them)
+		// Parameters:
+		//    const device_topology& other: [in] topology of the other file system
+		inline bool shares_spindle(const device_topology& other) const {
+			for (auto& d : disks)
+				for (auto& o : other.disks)
+					if (d.rotational && d.name == o.name)
+						return true;
+			return false;
+		}
+
+		// Returns the commands the disks hold at once, all together (0 = unknown)
+		inline unsigned int queue_depth() const {
+			unsigned int ret = 0;
+			for (auto& d : disks)
+				ret += d.queue_depth;
+			return ret;
+		}
+
+		// Returns the requests the block layer queues for the disks, all together (0 = unknown)
+		inline unsigned int nr_requests() const {
+			unsigned int ret = 0;
+			for (auto& d : disks)
+				ret += d.nr_requests;
+			return ret;
+		}
+	};
+
+	namespace sysfs {
+		// Reads an unsigned integer attribute
+		// Returns: bool: true = read
+		inline bool read_uint(const std::string& path, unsigned int& v) {
+			FILE* f = fopen(path.c_str(), "r");
+			if (!f)
+				return false;
+			bool ret = fscanf(f, "%u", &v) == 1;
+			fclose(f);
+			return ret;
+		}
+
+		// Returns the path with the symbolic links resolved (empty if it doesn't exist)
+		inline std::string real_path(const std::string& path) {
+			char* p = realpath(path.c_str(), nullptr);
+			if (!p)
+				return std::string{};
+			std::string ret{ p };
+			free(p);
+			return ret;
+		}
+
+		// Adds the physical disks below a block device
+		// Parameters:
+		//    const std::string& dir: [in] real path of the block device (in <sysfs>/devices)
+		//    std::vector<physical_disk>& disks: [in,out] disks found so far (each one once)
+		//    const unsigned int& depth: [in] levels of slaves walked down (bounds a cycle)
+		inline void collect_disks(const std::string& dir, std::vector<physical_disk>& disks, const unsigned int& depth = 0) {
+			if (dir.empty() || depth > 16)
+				return;
+
+			std::string disk = dir;
+			if (!access((dir + "/partition").c_str(), F_OK))
+				disk = real_path(dir + "/.."); // the disk (or md array) holding the partition
+
+			bool slaves = false; // device mapper, md: the disks are below
+			DIR* d = opendir((disk + "/slaves").c_str());
+			if (d) {
+				while (dirent* e = readdir(d)) {
+					if (e->d_name[0] == '.')
+						continue;
+					slaves = true;
+					collect_disks(real_path(disk + "/slaves/" + e->d_name), disks, depth + 1);
+				}
+				closedir(d);
+			}
+			if (slaves)
+				return;
+
+			std::string name = disk.substr(disk.find_last_of('/') + 1);
+			for (auto& x : disks)
+				if (x.name == name)
+					return;
+
+			physical_disk p;
+			p.name = name;
+			unsigned int v = 0;
+			p.rotational = read_uint(disk + "/queue/rotational", v) && v;
+			read_uint(disk + "/device/queue_depth", p.queue_depth);
+			read_uint(disk + "/queue/nr_requests", p.nr_requests);
+			disks.push_back(p);
+		}
+	}
+
+	// Probes the topology of a device id in sysfs (not cached, see get_device_topology)
+	// Parameters:
+	//    const uint64_t& device: [in] st_dev (see get_device_id)
+	//    const std::string& sysfs_root: [in] where sysfs is mounted
+	inline device_topology probe_device_topology(const uint64_t& device, const std::string& sysfs_root = "/sys") {
+		device_topology ret;
+		ret.device = device;
+		std::string dev = sysfs_root + "/dev/block/" + std::to_string(major(static_cast<dev_t>(device))) + ":" + std::to_string(minor(static_cast<dev_t>(device)));
+		sysfs::collect_disks(sysfs::real_path(dev), ret.disks);
+		return ret;
+	}
+
+	// Thread safe: Returns the topology of a device id, probed the first time only: the copies run later by the
+	// process reuse it.
+	// Parameters:
+	//    const uint64_t& device: [in] st_dev (see get_device_id)
+	inline const device_topology& get_device_topology(const uint64_t& device) {
+		static std::map<uint64_t, device_topology> cache;
+		static std::mutex m;
+		std::lock_guard<std::mutex> l(m);
+		auto it = cache.find(device);
+		if (it == cache.end())
+			it = cache.emplace(device, probe_device_topology(device)).first;
+		return it->second; // never erased
+	}
+}
+#endif
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <map>
+#include "tools.h"
+#include "file.h"
+
+namespace file_copy {
+	// Lists a directory tree with several threads.
+	// Every worker owns a deque of directories to list: it pushes the subdirectories it finds and pops the
+	// most recent one (depth first), while idle workers steal the oldest directory from the others.
+	// The result is a tree of nodes keeping the listing order, so the caller can flatten it exactly like a
+	// serial recursive walk would (children before their directory).
+	// In streaming mode the tree isn't kept: every entry is handed to a callback as soon as it's known, files when
+	// their directory is listed and directories once their whole subtree was handed over.
+	// In incremental mode the destination of every directory is listed too, and the files it already holds with the
+	// same size and last write time are left out of the result (see skipped_files): they're never read. The ones
+	// that changed are overwritten.
+	class dir_walker {
+	public:
+		struct node;
+		using node_ptr = std::unique_ptr<node>;
+
+		// One directory entry: a file, or a subdirectory (dir is set)
+		struct entry {
+			file_ptr source;
+			file_ptr dest;
+			node_ptr dir;
+		};
+
+		// One listed directory
+		struct node {
+			file_ptr source;
+			file_ptr dest;
+			std::vector<entry> entries; // in listing order
+			bool listed{ true }; // false = the directory couldn't be listed (access denied)
+
+			// streaming mode only
+			node* parent{ nullptr };
+			std::atomic<uint64_t> pending{ 1U }; // its own listing plus the subdirectories not yet handed over
+			std::atomic<uint64_t> size{ 0U }; // bytes of the files in the subtree
+		};
+
+		// Streaming mode callback, called from the listing threads
+		// Parameters:
+		//    const file_ptr& source: [in] listed entry
+		//    const file_ptr& dest: [in] matching destination entry
+		//    const node* dir: [in] nullptr for a file, the directory node (listed, size) for a directory
+		using stream_fn = std::function<void(const file_ptr& source, const file_ptr& dest, const node* dir)>;
+
+		// Constructor
+		// Parameters:
+		//    const unsigned int& workers: [in] number of listing threads (the calling thread is one of them)
+		//    const bool& incremental: [in] leave out the files whose destination is up to date (see same_size_and_time)
+		dir_walker(const unsigned int& workers, const bool& incremental = false);
+
+		// Lists source (a directory) recursively, creating the matching dest entries.
+		// Parameters:
+		//    const file_ptr& source: [in] directory to be listed
+		//    const file_ptr& dest: [in] directory where source will be copied
+		// Returns: node_ptr: the root of the tree
+		node_ptr walk(const file_ptr& source, const file_ptr& dest);
+
+		// Streaming mode: lists source (a directory) recursively, handing every entry to fn while listing.
+		// A directory is always handed over after all of its entries.
+		// Parameters:
+		//    const file_ptr& source: [in] directory to be listed
+		//    const file_ptr& dest: [in] directory where source will be copied
+		//    const stream_fn& fn: [in] called with every entry (it may block, eg. on a full channel)
+		void walk(const file_ptr& source, const file_ptr& dest, const stream_fn& fn);
+
+		// Thread safe: Returns the number of files left out so far (incremental mode)
+		uint64_t skipped_files() const {
+			return m_skipped_files.load();
+		}
+
+		// Thread safe: Returns the bytes of the files left out so far (incremental mode)
+		uint64_t skipped_size() const {
+			return m_skipped_size.load();
+		}
+
+	private:
+		struct work_deque {
+			std::mutex mutex;
+			std::deque<node*> nodes;
+		};
+
+		// Worker loop: lists directories until the whole tree is done
+		void work(const size_t& index);
+
+		// Pops from the worker's own deque, or steals from another one
+		// Returns: node*: nullptr if every deque is empty
+		node* next(const size_t& index);
+
+		// Lists one directory, queuing its subdirectories in the worker's deque
+		void list(node& n, const size_t& index);
+
+		// Streaming mode: one listing or subdirectory of n is done, hands n (and its finished parents) over
+		void complete(node* n);
+
+		// Runs the workers until every queued directory is listed
+		void run(node* root);
+
+		unsigned int m_workers;
+		bool m_incremental;
+		std::atomic<uint64_t> m_skipped_files{ 0U };
+		std::atomic<uint64_t> m_skipped_size{ 0U };
+		stream_fn m_stream; // set in streaming mode
+		std::vector<std::unique_ptr<work_deque>> m_deques;
+		std::atomic<uint64_t> m_outstanding{ 0U }; // directories queued or being listed
+
+		std::mutex m_mutex_idle;
+		std::condition_variable m_cv_idle;
+	};
+}
@@ -1,27 +1,28 @@
 #pragma once
 
-#include <Windows.h>
-#include <WinBase.h>
 #include <stdio.h>
 #include <string>
-#include <fileapi.h>
 #include <memory>
 #include <sstream>
 #include <iomanip>
-#include <io.h>
-#include <fcntl.h>
 #include <atomic>
+#include <mutex>
+#include <map>
+#include <condition_variable>
 #include "tools.h"
 #include "crc32.h"
+#include "io_backend.h"
 
 
 namespace file_copy {
-	using FILE_ptr = std::shared_ptr<FILE*>;
 	class file;
 	using file_ptr = std::shared_ptr<file>;
 	class file {
 		friend class file_part_task;
 		friend class copy_engine;
+		friend class crc32_sink;
+		friend class verify_sink;
+		friend class uring_reader;
 
 	public:
 
@@ -33,7 +34,9 @@ namespace file_copy {
 			closed_write,
 			failed_open,
 			skipped,
-			failed
+			failed,
+			verified, // destination read back and matching the source CRC
+			verify_failed // destination read back and NOT matching the source CRC (or unreadable)
 		};
 
 		enum class exist_decision {
@@ -47,7 +50,7 @@ namespace file_copy {
 		// Parameters: 
 		//    const std::string& path: [in] path of the file
 		file(const std::wstring& path, file_ptr parent = nullptr, bool no_write_syscache = true) : m_parent{ parent } {
-			std::size_t pos = path.find_last_of(_T('\\'));
+			std::size_t pos = path.find_last_of(PATH_SEPARATOR);
 			if (pos != std::string::npos) {
 				if(!m_parent)
 					folder(path.substr(0, pos));
@@ -66,7 +69,7 @@ namespace file_copy {
 		file(const std::wstring& folder, const std::wstring& file_name, file_ptr parent = nullptr, bool no_write_syscache = true) : m_file_name(file_name), m_parent{ parent }, m_no_write_syscache{ no_write_syscache } {
 			if (!m_parent)
 				m_folder = folder;
-			std::size_t pos = path().find_last_of(_T('\\'));
+			std::size_t pos = path().find_last_of(PATH_SEPARATOR);
 			if (pos == std::string::npos) {
 				m_is_root.store(true);
 			}
@@ -88,10 +91,14 @@ namespace file_copy {
 			close();
 		}
 
-		// Returns the full file path (including initial "\\\\?\\")
+		// Returns the full file path (including initial "\\\\?\\" on Windows)
 		// Returns: std::stringw
 		inline std::wstring path_full() {
+#ifdef _WIN32
 			return _T("\\\\?\\") + path();
+#else
+			return path();
+#endif
 		}
 
 		// Called when a decision about the file must be made.
@@ -130,18 +137,26 @@ namespace file_copy {
 		// Returns: std::stringw
 		inline std::wstring root() const {
 			assert(path().size());
+#ifdef _WIN32
 			std::wstring aux = path();
 
 			if (aux[1] == _T(':'))
 				return aux.substr(0, 2);
 			else
 				return aux.substr(0, aux.substr(2).find_first_of(_T("\\")));
+#else
+			return std::wstring{ PATH_SEPARATOR };
+#endif
 		}
 
-		// Returns the root of the file path (including initial "\\\\?\\")
+		// Returns the root of the file path (including initial "\\\\?\\" on Windows)
 		// Returns: std::stringw
 		inline std::wstring root_full() const {
+#ifdef _WIN32
 			return _T("\\\\?\\") + root();
+#else
+			return root();
+#endif
 		}
 		
 		/*// Returns the full file path in wide characters (including initial "\\\\?\\")
@@ -253,18 +268,18 @@ namespace file_copy {
 		// Returns bool: errno_t
 		inline errno_t open_read() {
 			m_read = true;
-			const wchar_t fopen_flags[] = _T("rb");
-			if (m_FILE) {
+			if (is_open()) {
 				TRACE(_T("file already open: %s\n"), path_full().c_str());
 				return 0;
 			}
 
-			m_FILE.reset(new FILE*);
+			if (!m_io)
+				m_io = make_io_backend();
+			m_io->unbuffered(m_unbuffered);
+			m_io->streaming(m_stream_window, m_drop_behind);
 			TRACE(_T("Opening file: %s\n"), path_full().c_str());
-			errno_t res = _wfopen_s(m_FILE.get(), path_full().c_str(), fopen_flags);
-			if (res)
-				m_FILE = nullptr;
-			else
+			errno_t res = m_io->open_read(path_full());
+			if (!res)
 				status_ts(file_status::open_read);
 
 			TRACE(_T("Opening file: %s return result: %s\n"), path_full().c_str(), get_errno_desc(res).c_str());
@@ -275,19 +290,19 @@ namespace file_copy {
 		// Opens the file for writing.
 		// Returns bool: errno_t
 		inline errno_t open_write() {
-			const wchar_t fopen_flags[] = _T("wb");
-			if (m_FILE) {
+			if (is_open()) {
 				TRACE(_T("file already open: %s\n"), path_full().c_str());
 				return 0;
 			}
 
-			m_FILE.reset(new FILE*);
+			if (!m_io)
+				m_io = make_io_backend();
+			m_io->unbuffered(m_unbuffered);
+			m_io->streaming(m_stream_window, m_drop_behind);
 			TRACE(_T("Opening file: %s\n"), path_full().c_str());
-			errno_t res = _wfopen_s(m_FILE.get(), path_full().c_str(), fopen_flags);
-			if (res) {
-				m_FILE = nullptr;
+			errno_t res = m_io->open_write(path_full());
+			if (res)
 				status_ts(file_status::failed_open);
-			}
 			else
 				status_ts(file_status::open_write);
 
@@ -300,38 +315,52 @@ namespace file_copy {
 		//
 		// Returns bool: errno_t
 		inline errno_t open_write_preallocate() {
-			if (m_FILE) {
+			assert(!m_is_root.load());
+			if (is_open()) {
 				TRACE(_T("file already open: %s\n"), path_full().c_str());
 				return EACCES;
 			}
 
-			errno_t res = 0;
-
+			if (!m_io)
+				m_io = make_io_backend();
+			m_io->unbuffered(m_unbuffered);
+			m_io->streaming(m_stream_window, m_drop_behind);
 			TRACE(_T("Opening file: %s\n"), path_full().c_str());
 
-			HANDLE h_file = preallocate();
-
-			if (h_file == INVALID_HANDLE_VALUE) {
-				res = EACCES;
+			errno_t res = m_io->open_write_preallocate(path_full(), size_ts());
+			if (res)
 				status_ts(file_status::failed_open);
-			} else {
-				int fd = _open_osfhandle((intptr_t)h_file, _O_RDWR);
-				m_FILE.reset(new FILE*);
-				*m_FILE = _fdopen(fd, "rb+");
-				fseek(*m_FILE, 0, SEEK_SET);
-				if (!*m_FILE) {
-					int _errno;
-					res = _get_errno(&_errno);
-					status_ts(file_status::failed_open);
-				} else {
-					status_ts(file_status::open_write);
-				}
-			}
-	
+			else
+				status_ts(file_status::open_write);
+
 			TRACE(_T("Opening file: %s return result: %s\n"), path_full().c_str(), get_errno_desc(res).c_str());
 
+			return res;
+		}
+
+		// Creates the file with its size as a hole and opens it for writing (see io_backend::open_write_sparse)
+		//
+		// Returns bool: errno_t
+		inline errno_t open_write_sparse() {
+			assert(!m_is_root.load());
+			if (is_open()) {
+				TRACE(_T("file already open: %s\n"), path_full().c_str());
+				return EACCES;
+			}
+
+			if (!m_io)
+				m_io = make_io_backend();
+			m_io->unbuffered(m_unbuffered);
+			m_io->streaming(m_stream_window, m_drop_behind);
+			TRACE(_T("Opening file: %s\n"), path_full().c_str());
+
+			errno_t res = m_io->open_write_sparse(path_full(), size_ts());
 			if (res)
 				status_ts(file_status::failed_open);
+			else
+				status_ts(file_status::open_write);
+
+			TRACE(_T("Opening file: %s return result: %s\n"), path_full().c_str(), get_errno_desc(res).c_str());
 
 			return res;
 		}
@@ -339,13 +368,31 @@ namespace file_copy {
 		// Is the file open?
 		// Returns: true = yes, false = no.
 		inline bool is_open() {
-			return m_FILE ? true : false;
+			return m_io && m_io->is_open();
 		}
 
-		// Returns the raw file pointer.
-		// Returns: FILE*
-		inline FILE_ptr get_FILE() {
-			return m_FILE;
+		// Thread safe
+		// Finds the next range of data of the file open for reading (see io_backend::next_data)
+		// Parameters: 
+		//    const uint64_t& offset: [in] position to look from
+		//    uint64_t& begin: [out] start of the data (the end of the file if there's no data left)
+		//    uint64_t& end: [out] end of the data (_UI64_MAX = unknown, up to the end of the file)
+		//
+		// Returns errno_t
+		// Throws std::exception in case of serious issues.
+		inline errno_t next_data(const uint64_t& offset, uint64_t& begin, uint64_t& end) {
+			if (!is_open()) {
+				std::wostringstream os;
+				os << "Finding data failed : file not open : file name: " << path_full();
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
+			}
+			return m_io->next_data(offset, begin, end);
+		}
+
+		// Returns the device id of the open file (see io_backend::device), 0 if unknown or not open
+		inline uint64_t device() {
+			return is_open() ? m_io->device() : 0U;
 		}
 
 		// Thread Safe
@@ -353,7 +400,7 @@ namespace file_copy {
 		//
 		// Returns std::string: the path of the file.
 		inline std::wstring path() const {
-			return file_name().size() ? folder() + _T("\\") + file_name() : folder();
+			return file_name().size() ? folder() + PATH_SEPARATOR + file_name() : folder();
 			//if (m_file_name.size())
 			//std::wstring _file_name = file_name();
 			//std::wstring _folder = folder();
@@ -377,8 +424,8 @@ namespace file_copy {
 		// Check if the file_part_task reached the EOF
 		// Returns bool: is EOF true, not EOF false
 		inline bool is_eof() {
-			if (m_FILE)
-				return feof(*m_FILE) ? true : false;
+			if (is_open())
+				return m_io->is_eof();
 			else {
 				std::wostringstream os;
 				os << "End Of file failed : file not open : file name: " << path_full();
@@ -390,10 +437,12 @@ namespace file_copy {
 
 		// Closes the file if open
 		inline void close(bool failed = false) {
-			if (m_FILE) {
-				if (!m_read && !m_no_write_syscache) {
-					fflush(*m_FILE);
-					if (_commit(_fileno(*m_FILE))) {
+			if (is_open()) {
+				bool commit = !m_read && !m_no_write_syscache;
+				errno_t res = m_io->close(commit);
+				status_ts(failed ? file_status::failed : m_read ? file_status::closed_read : file_status::closed_write);
+				if (commit) {
+					if (res) {
 						std::wostringstream os;
 						os << "Closing failed : could not close : file name: " << path_full();
 						TRACE(_T("%s\n"), os.str().c_str());
@@ -401,9 +450,6 @@ namespace file_copy {
 					}
 					TRACE(_T("Closing file: %s"), path_full().c_str());
 				}
-				status_ts(failed ? file_status::failed : m_read ? file_status::closed_read : file_status::closed_write);
-				fclose(*m_FILE);
-				m_FILE = nullptr;
 			}
 		}
 
@@ -421,22 +467,10 @@ namespace file_copy {
 			size_t num_read = count;
 
 			TRACE(_T("Reading %d bytes of file: %s\n"), count, path_full().c_str());
-			if (m_FILE && *m_FILE) {
-				num_read = fread_s(buffer, count, sizeof(char), count, *m_FILE);
-				//fflush(*m_fp.get());
-				if (num_read != count) {
-					if (!feof(*m_FILE)) {
-						if (ferror(*m_FILE)) {
-							ret = false;
-							close(true);
-						} else {
-							std::wostringstream os;
-							os << "Reading failed! : Unknown error : file name: " << path_full()
-								<< " read: " << ret;
-							TRACE(_T("%s\n"), os.str().c_str());
-							throw std::runtime_error(wstring_to_string(os.str()));
-						}
-					}
+			if (is_open()) {
+				if (m_io->read(buffer, num_read)) {
+					ret = false;
+					close(true);
 				}
 				TRACE(_T("Read %d bytes of file: %s\n"), num_read, path_full().c_str());
 			} else {
@@ -450,6 +484,30 @@ namespace file_copy {
 			return ret;
 		}
 
+		// Thread safe
+		// Reads the file at a given offset (several threads can read distinct parts of the file at the same time).
+		// Unlike read(), it doesn't close the file on failure nor move the position.
+		// Parameters:
+		//    void* buffer: [out] memory buffer where it will read into
+		//    size_t& count: [in,out] number of bytes to be read, and returns the number of bytes successfully read
+		//    const uint64_t& offset: [in] position in the file
+		//
+		// Returns bool: Success true, Failure false
+		// Throws std::exception in case of serious issues.
+		inline bool read_at(void* buffer, size_t& count, const uint64_t& offset) {
+			assert(buffer != nullptr);
+
+			TRACE(_T("Reading %d bytes at %llu of file: %s\n"), count, static_cast<unsigned long long>(offset), path_full().c_str());
+			if (!is_open()) {
+				std::wostringstream os;
+				os << "Reading failed : file not open : file name: " << path_full()
+					<< " count: " << count;
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
+			}
+			return m_io->read_at(buffer, count, offset) ? false : true;
+		}
+
 		// Writes the file.
 		// Parameters: 
 		//    void* buffer: [out] memory buffer where it will write into
@@ -464,20 +522,10 @@ namespace file_copy {
 			size_t num_written = count;
 
 			TRACE(_T("Writing %d bytes of file: %s\n"), count, path_full().c_str());
-			if (m_FILE && *m_FILE) {
-				num_written = fwrite(buffer, sizeof(char), count, *m_FILE);
-
-				if (num_written != count) {
-					if (!ferror(*m_FILE)) {
-						ret = false;
-						close(true);
-					} else {
-						std::wostringstream os;
-						os << "Writing failed! : Unknown error : file name: " << path_full()
-							<< " written: " << ret;
-						TRACE(_T("%s\n"), os.str().c_str());
-						throw std::runtime_error(wstring_to_string(os.str()));
-					}
+			if (is_open()) {
+				if (m_io->write(buffer, num_written)) {
+					ret = false;
+					close(true);
 				}
 				TRACE(_T("Wrote %d bytes of file: %s\n"), num_written, path_full().c_str());
 			} else {
@@ -488,80 +536,72 @@ namespace file_copy {
 				throw std::runtime_error(wstring_to_string(os.str()));
 			}
 
-			/*if (m_no_write_syscache) {
-				fflush(*m_FILE);
-				if (_commit(_fileno(*m_FILE))) {
-					std::wostringstream os;
-					os << "Writing failed : could not commit : file name: " << path_full();
-					TRACE(_T("%s\n"), os.str().c_str());
-					throw std::runtime_error(wstring_to_string(os.str()));
-				}
-			}*/
 			count = num_written;
 			return ret;
 		}
 
+		// Thread safe
+		// Writes the file at a given offset (several threads can write distinct parts of the file at the same time).
+		// Unlike write(), it doesn't close the file on failure.
+		// Parameters: 
+		//    const void* buffer: [in] memory buffer to be written
+		//    size_t& count: [in,out] number of bytes to be written, and returns the number of bytes successfully written
+		//    const uint64_t& offset: [in] position in the file
+		//
+		// Returns bool: Success true, Failure false
+		// Throws std::exception in case of serious issues.
+		inline bool write_at(const void* buffer, size_t& count, const uint64_t& offset) {
+			assert(buffer != nullptr);
+
+			TRACE(_T("Writing %d bytes at %llu of file: %s\n"), count, static_cast<unsigned long long>(offset), path_full().c_str());
+			if (!is_open()) {
+				std::wostringstream os;
+				os << "Writing failed : file not open : file name: " << path_full()
+					<< " count: " << count;
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
+			}
+			return m_io->write_at(buffer, count, offset) ? false : true;
+		}
+
+		// Copies the whole source file into this one (open for writing) inside the kernel: reflink or kernel side copy.
+		// Parameters: 
+		//    file& source: [in] file to be copied (doesn't need to be open)
+		//
+		// Returns errno_t: 0 = copied, ENOTSUP = not possible between these files (nothing written), otherwise the failure
+		// Throws std::exception in case of serious issues.
+		inline errno_t copy_from(file& source) {
+			TRACE(_T("Copying in kernel file: %s into file: %s\n"), source.path_full().c_str(), path_full().c_str());
+			if (!is_open()) {
+				std::wostringstream os;
+				os << "Copying failed : file not open : file name: " << path_full();
+				TRACE(_T("%s\n"), os.str().c_str());
+				throw std::runtime_error(wstring_to_string(os.str()));
+			}
+			return m_io->copy_from(source.path_full());
+		}
+
+#ifdef _WIN32
 		// Stores the file timestamps based on a WIN32_FILE_ATTRIBUTE_DATA (doesn't ommits yet)
 		// throws std::exception if anything goes wrong
 		inline file_basic_info_ptr file_basic_info() {
 			TRACE(_T("Getting file basic info (times and basic attributes) for: %s\n"), path_full().c_str());
 
-			if (!m_attributes)
-				read_file_attributes();
-
-			file_basic_info_ptr basic_info(new FILE_BASIC_INFO);
-
-			basic_info->CreationTime.HighPart = m_attributes->ftCreationTime.dwHighDateTime;
-			basic_info->CreationTime.LowPart = m_attributes->ftCreationTime.dwLowDateTime;
-			basic_info->ChangeTime.HighPart = m_attributes->ftLastWriteTime.dwHighDateTime;
-			basic_info->ChangeTime.LowPart = m_attributes->ftLastWriteTime.dwLowDateTime;
-			basic_info->LastAccessTime.HighPart = m_attributes->ftLastAccessTime.dwHighDateTime;
-			basic_info->LastAccessTime.LowPart = m_attributes->ftLastAccessTime.dwLowDateTime;
-			basic_info->LastWriteTime.HighPart = m_attributes->ftLastWriteTime.dwHighDateTime;
-			basic_info->LastWriteTime.LowPart = m_attributes->ftLastWriteTime.dwLowDateTime;
-			basic_info->FileAttributes = m_attributes->dwFileAttributes;
-
-			return basic_info;
+			return make_file_basic_info(*win32_attributes());
 		}
+#endif
 
 		// Saves (writes into the file) the file timestamps based on a WIN32_FILE_ATTRIBUTE_DATA
 		// throws std::exception if anything goes wrong
 		inline void commit_file_basic_info() {
 			TRACE(_T("Setting file basic info (times and basic attributes) for: %s\n : is_directory \"%s\""), path_full().c_str(), is_directory() ? _T("true") : _T("false"));
-			HANDLE h_file = INVALID_HANDLE_VALUE;
-			if (m_FILE) { // use the FILE* in case it exists.
-				//throw std::runtime_error("file handle is already open! It must be closed before usage");
-				h_file = (HANDLE)_get_osfhandle(_fileno(*m_FILE));
-			} else {
-
-				h_file = CreateFileW(path_full().c_str(), GENERIC_WRITE,//GENERIC_READ | GENERIC_WRITE | DELETE,
-					FILE_SHARE_WRITE | FILE_SHARE_READ,
-					NULL,
-					OPEN_EXISTING,
-					is_directory() ? FILE_FLAG_BACKUP_SEMANTICS : NULL,
-					NULL);
-			}
-
-			if (h_file != INVALID_HANDLE_VALUE) {
-				if (!SetFileInformationByHandle(h_file, FileBasicInfo, file_basic_info().get(), sizeof(FILE_BASIC_INFO))) {
-					if (!m_FILE)
-						CloseHandle(h_file);
-
-					DWORD last_error = GetLastError();
-
-					std::wostringstream os;
-					os << "Error when setting file attributes : file name: " << path() << " Error Code: "
-						<< std::showbase << std::setfill(_T('0')) << std::setw(4) << std::hex << last_error;
-
-					throw std::runtime_error(wstring_to_string(os.str()));
-				}
-				if (!m_FILE)
-					CloseHandle(h_file);
-			} else {
-				DWORD last_error = GetLastError();
+			if (!m_io)
+				m_io = make_io_backend();
 
+			DWORD last_error = m_io->commit_file_basic_info(path_full(), *win32_attributes(), is_directory());
+			if (last_error) {
 				std::wostringstream os;
-				os << "Error when setting file attributes : file name: " << path() << " INVALID_HANDLE_VALUE :  System Error Code: "
+				os << "Error when setting file attributes : file name: " << path() << " System Error Code: "
 					<< std::showbase << std::setfill(_T('0')) << std::setw(4) << std::hex << last_error;
 
 				throw std::runtime_error(wstring_to_string(os.str()));
@@ -589,8 +629,66 @@ namespace file_copy {
 		// Does the file exist?
 		// Returns: DWORD: exists !=0, doesn't exist == INVALID_FILE_ATTRIBUTES
 		inline DWORD check_exists()	{
-			TRACE(_T("check_exists: %s result: %s\n"), path_full().c_str(), GetFileAttributes(path_full().c_str()) ? _T("true") : _T("false"));
-			return GetFileAttributes(path_full().c_str());
+			DWORD attr = get_file_attributes(path_full());
+			TRACE(_T("check_exists: %s result: %s\n"), path_full().c_str(), attr != INVALID_FILE_ATTRIBUTES ? _T("true") : _T("false"));
+			return attr;
+		}
+
+		// Bypasses the operating system cache when the file is opened (see io_backend::unbuffered)
+		// Parameters: 
+		//    const bool& v: [in] true = unbuffered
+		inline void unbuffered(const bool& v) {
+			m_unbuffered = v;
+		}
+
+		inline bool unbuffered() const {
+			return m_unbuffered;
+		}
+
+		// Page cache hints used when the file is opened (see io_backend::streaming)
+		// Parameters: 
+		//    const uint64_t& window: [in] readahead / drop behind window in bytes (0 = no hints)
+		//    const bool& drop_behind: [in] true = drop the ranges already read / written from the cache
+		inline void streaming(const uint64_t& window, const bool& drop_behind) {
+			m_stream_window = window;
+			m_drop_behind = drop_behind;
+		}
+
+		inline uint64_t stream_window() const {
+			return m_stream_window;
+		}
+
+		inline bool drop_behind() const {
+			return m_drop_behind;
+		}
+
+		// Makes the destination be created sparse (see open_write_sparse): what its writers don't write (the holes of
+		// the source, the chunks of zeros skipped) is left as holes
+		// Parameters: 
+		//    const bool& v: [in] true = sparse
+		inline void sparse(const bool& v) {
+			m_sparse = v;
+		}
+
+		inline bool sparse() const {
+			return m_sparse;
+		}
+
+		// Makes the writers of the destination skip the chunks that are all zeros (see copy_settings::skip_zero_blocks)
+		// Parameters: 
+		//    const bool& v: [in] true = skip them
+		inline void skip_zeros(const bool& v) {
+			m_skip_zeros = v;
+		}
+
+		inline bool skip_zeros() const {
+			return m_skip_zeros;
+		}
+
+		// Is the file sparse? (fewer blocks allocated than its size, as listed)
+		// Returns: bool: true = yes, false = no
+		inline bool is_sparse() {
+			return win32_attributes()->dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE ? true : false;
 		}
 
 		// Is the file a root folder? (like c:)
@@ -614,10 +712,72 @@ namespace file_copy {
 			return m_crc32.load();
 		}
 
+		// Thread safe
+		// Has the crc32_sink hashed every chunk of the file? (false for a file copied inside the kernel and not verified)
+		inline bool crc32_ready_ts() {
+			std::lock_guard<std::mutex> l(m_mutex_crc32);
+			return m_crc32_ready;
+		}
+
+		// Thread safe
+		// Stores the CRC32 of the whole file, hashed in one piece (small files), and flags it as final
+		// Parameters: 
+		//    const uint32_t& v: value to be stored
+		inline void crc32_whole_ts(const uint32_t& v) {
+			std::lock_guard<std::mutex> l(m_mutex_crc32);
+			m_crc32.store(v);
+			m_crc32_ready = true;
+			m_cv_crc32.notify_all();
+		}
+
+		// Waits until the crc32_sink has hashed every chunk of the file (crc32_ts is final)
+		inline void wait_crc32_ts() {
+			std::unique_lock<std::mutex> l(m_mutex_crc32);
+			m_cv_crc32.wait(l, [this] { return m_crc32_ready; });
+		}
+
 		inline file_ptr parent() const {
 			return m_parent;
 		}
 
+		// Thread safe
+		// A chunk of the file was queued to be written. The reader holds one reference on the file until it queues
+		// the last chunk, which takes it over: the count can't drop to 0 while chunks are still to be queued.
+		// Parameters: 
+		//    const bool& last: [in] it's the last chunk of the file
+		inline void chunk_queued_ts(const bool& last) {
+			if (!last)
+				++m_pending_chunks;
+		}
+
+		// Thread safe
+		// A chunk of the file was written (or dropped)
+		// Returns: bool: true = it was the last pending chunk of the file, the file can be committed and closed
+		inline bool chunk_done_ts() {
+			return --m_pending_chunks == 0;
+		}
+
+		// Thread safe
+		// A child (file or folder) of this folder was queued to be copied
+		inline void child_queued_ts() {
+			std::lock_guard<std::mutex> l(m_mutex_children);
+			++m_pending_children;
+		}
+
+		// Thread safe
+		// Flags this file / folder as completely processed (notifies the parent folder)
+		inline void finished_ts() {
+			if (m_parent)
+				m_parent->child_done_ts();
+		}
+
+		// Thread safe
+		// Waits until every child queued in this folder is completely processed
+		inline void wait_children_ts() {
+			std::unique_lock<std::mutex> l(m_mutex_children);
+			m_cv_children.wait(l, [this] { return !m_pending_children; });
+		}
+
 		// Thread safe
 		// Retrieves the file status information
 		// Returns: file_status
@@ -654,38 +814,42 @@ namespace file_copy {
 
 	protected:
 
+		// Thread safe
+		// A child of this folder is completely processed
+		inline void child_done_ts() {
+			std::lock_guard<std::mutex> l(m_mutex_children);
+			if (!--m_pending_children)
+				m_cv_children.notify_all();
+		}
+
 		// Thread safe
 		// Sets the file status information
 		inline void status_ts(const file_status& v) {
 			m_status.store(v);
 		}
 
+		// Thread safe
+		// Flags a destination failed while its chunks are being written (eg. a source read failed): the chunks not
+		// written yet are dropped and the last one closes it as failed, without committing it (see file_part_task)
+		inline void fail_write_ts() {
+			std::lock_guard<std::mutex> l(m_mutex_write); // not while a writer opens it
+			m_status.store(file_status::failed);
+		}
+
 		// Populates file attributes into the object. Necessary before file_attributes
 		// Returns DWORD: Success = 0 Error = Value of GetLastError()
 		inline DWORD read_file_attributes() {
 			TRACE(_T("Loading attributes for: %s\n"), path_full().c_str());
 			m_attributes.reset(new WIN32_FILE_ATTRIBUTE_DATA);
-			bool test = m_is_root.load();
-			if (!GetFileAttributesExW(m_is_root.load() ? (path_full() + L"\\").c_str() : path_full().c_str(), GetFileExInfoStandard, m_attributes.get()))
-				return GetLastError();
-			return 0;
-		}
-
-		inline HANDLE preallocate() {
-			assert(!m_is_root.load());
-			HANDLE h_file = CreateFileW(path_full().c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-			if (h_file != INVALID_HANDLE_VALUE) {
-				LARGE_INTEGER _size;
-				_size.QuadPart = size_ts();
-				::SetFilePointerEx(h_file, _size, 0, FILE_BEGIN);
-				::SetEndOfFile(h_file);
-			}
-			return h_file;
+			DWORD err = get_file_attributes_ex(m_is_root.load() ? path_full() + PATH_SEPARATOR : path_full(), *m_attributes);
+			if (err)
+				m_attributes = nullptr;
+			return err;
 		}
 
 	protected:
 
-		FILE_ptr m_FILE;
+		io_backend_ptr m_io;
 		win32_attributes_ptr m_attributes;
 
 		file_ptr m_parent;
@@ -703,7 +867,27 @@ namespace file_copy {
 
 		bool m_read{ false };
 		bool m_no_write_syscache{ false };
+		bool m_unbuffered{ false };
+		uint64_t m_stream_window{ 0U };
+		bool m_drop_behind{ false };
+		bool m_sparse{ false }; // destination: created as a hole, only the data ranges of the source are written
+		bool m_skip_zeros{ false }; // destination: the chunks of zeros aren't written
 
 		std::atomic<uint32_t> m_crc32{ 0U };
+		// crc32_sink merge state: chunks are hashed in any order and combined in offset order
+		std::mutex m_mutex_crc32;
+		uint32_t m_crc32_running{ 0U }; // CRC of [0, m_crc32_next_offset)
+		uint64_t m_crc32_next_offset{ 0U };
+		uint64_t m_crc32_end{ _UI64_MAX }; // size of the file, known once the last chunk is hashed
+		bool m_crc32_ready{ false }; // every chunk merged, m_crc32 is final
+		std::condition_variable m_cv_crc32;
+		std::map<uint64_t, std::pair<uint32_t, uint64_t>> m_crc32_pending; // offset -> (crc, count) of the chunks (or holes) hashed ahead
+
+		std::mutex m_mutex_write; // serializes the opening / closing of the destination between the sink workers
+		std::atomic<uint64_t> m_pending_chunks{ 1U }; // chunks queued and not done, + 1 until the last one is queued
+
+		std::mutex m_mutex_children;
+		std::condition_variable m_cv_children;
+		uint64_t m_pending_children{ 0U };
 	};
 }
\ No newline at end of file
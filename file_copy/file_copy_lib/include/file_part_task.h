@@ -3,6 +3,8 @@
 #include "tools.h"
 #include "task.h"
 #include "file.h"
+#include "buffer_pool.h"
+#include "zero_block.h"
 
 namespace file_copy {
 	class copy_engine;
@@ -11,9 +13,12 @@ namespace file_copy {
 	public:
 		// Constructor
 		// Parameters: 
+		//    copy_engine& engine: [in] engine copying the file (hashes, verifies and monitors it)
 		//    const file_ptr f: [in] file_ptr
-		file_part_task(const file_ptr& f){
+		//    const file_ptr& source: [in] file being copied into f (used to verify f once written)
+		file_part_task(copy_engine& engine, const file_ptr& f, const file_ptr& source = nullptr) : m_engine{ engine } {
 			m_fp = f;
+			m_source = source;
 		}
 
 		// Destructor
@@ -28,51 +33,144 @@ namespace file_copy {
 		}
 
 		// Stores the buffer to be written. (Doesn't commits the data yet. To be used later by write())
+		// The buffer is shared, not copied: it goes back to its pool once the task (and the other users) drop it.
 		// Parameters: 
-		//    void* buffer: [out] memory buffer where it will write into
-		//    size_t count: [in,out] number of bytes to be read, and returns the number of bytes successfully read
-		//
-		// Returns bool: Success true, Failure false
-		// Throws std::exception in case of serious issues.
-		inline void write_buff_store(void* buffer, const size_t& count, bool last_write) {
-			assert(buffer != nullptr);
-			TRACE("Writing to buffer %d bytes\n");
+		//    const io_buffer_ptr& buffer: [in] buffer holding the data to be written
+		//    const size_t& count: [in] number of bytes to be written
+		//    const uint64_t& offset: [in] position of the chunk in the file
+		//    bool last_write: [in] last chunk of the file
+		//    const size_t& buff_offset: [in] position of the data in buffer (a buffer shared by several small files)
+		inline void write_buff_store(const io_buffer_ptr& buffer, const size_t& count, const uint64_t& offset, bool last_write, const size_t& buff_offset = 0) {
+			assert(buffer);
+			assert(buff_offset + count <= buffer->size());
+			TRACE("Writing to buffer %d bytes\n", count);
 
-			m_write_buff.reset(new char[count]);
-
-			memcpy_s(m_write_buff.get(), count, buffer, count);
+			m_write_buff = buffer;
 			m_write_buff_count = count;
+			m_offset = offset;
 			m_last_write = last_write;
+			m_buff_offset = buff_offset;
+		}
+
+		// Makes this task write a whole small file (a single chunk, stored with write_buff_store) without
+		// preallocating it, hashing the source data here instead of in the crc32_sink. Only for a file read
+		// successfully: a failed one has no task (see copy_engine::copy_small_file).
+		inline void small_file_store() {
+			assert(m_source && m_last_write && !m_offset);
+			m_small_file = true;
 		}
 
 		inline bool is_last_write() {
 			return m_last_write;
 		}
 
-		// Writes the buffer into the disk
+		// Returns the stored buffer
+		inline io_buffer_ptr write_buff() const {
+			return m_write_buff;
+		}
+
+		// Returns the number of bytes stored in the buffer
+		inline std::size_t write_buff_count() const {
+			return m_write_buff_count;
+		}
+
+		// Returns the position of the chunk in the file
+		inline uint64_t offset() const {
+			return m_offset;
+		}
+
+		// Writes the buffer into the disk at the chunk offset (the chunks of a file may be written by distinct threads in any order).
+		// A chunk of zeros isn't written when the file skips them: it's left as a hole.
 		//
 		// Returns bool: Success true, Failure false
 		inline bool write_buff_commit() {
-			if (m_write_buff && m_write_buff_count) {
-				return m_fp->write(m_write_buff.get(), m_write_buff_count);
-			} else {
+			if (!m_write_buff)
 				return false;
+			if (!m_write_buff_count)
+				return true; // empty last chunk, nothing to write
+			// (a small file isn't sized beforehand, it's always written)
+			if (m_fp->skip_zeros() && !m_small_file && is_zero_block(m_write_buff->data() + m_buff_offset, m_write_buff_count)) {
+				m_write_buff.reset();
+				return true;
 			}
+			bool ret = m_fp->write_at(m_write_buff->data() + m_buff_offset, m_write_buff_count, m_offset);
+			m_write_buff.reset(); // back to the pool as soon as possible
+			return ret;
+		}
+
+		// Makes this task copy the whole file inside the kernel (reflink / copy_file_range) instead of writing a buffer.
+		// It's the only (and last) task of the file.
+		inline void kernel_copy_store() {
+			assert(m_source);
+			m_kernel_copy = true;
+			m_offset = 0U;
+			m_last_write = true;
+		}
+
+		inline bool is_kernel_copy() const {
+			return m_kernel_copy;
 		}
 
+		// Makes this task copy a whole range of a large file itself: reads it at its offset into buffer (chunk by
+		// chunk), writes it at the same offset and hashes it. The ranges of a file are copied by distinct writers at
+		// the same time; the last one to finish commits the file and closes the source.
+		// Parameters: 
+		//    const io_buffer_ptr& buffer: [in] buffer reused for every chunk of the range (none if count is 0)
+		//    const size_t& count: [in] size of the range (0: nothing to copy, eg. the file ends with a hole)
+		//    const uint64_t& offset: [in] position of the range in the file
+		//    bool last_range: [in] last range of the file (ends at its size)
+		inline void range_store(const io_buffer_ptr& buffer, const size_t& count, const uint64_t& offset, bool last_range) {
+			assert((buffer || !count) && m_source);
+			m_range = true;
+			m_write_buff = buffer;
+			m_write_buff_count = count;
+			m_offset = offset;
+			m_last_write = last_range;
+		}
+
+		inline bool is_range() const {
+			return m_range;
+		}
+
+		// Copies the range (stored with range_store) from the source, which is open for reading
+		//
+		// Returns bool: Success true, Failure false
+		bool range_commit();
+
+		// Copies the source into the file inside the kernel, falling back to copy_through_buffer() when the file
+		// systems don't allow it
+		//
+		// Returns bool: Success true, Failure false
+		bool kernel_copy_commit();
+
 		// Sets the file attributes (not committing yet)
 		inline void file_attributes(win32_attributes_ptr p) {
 			m_attributes = p;
 		}
 
 	protected:
+		// Opens the destination if this is the first chunk of the file to be processed.
+		// Returns bool: true = the file is open for writing, false = the chunk must be dropped (skipped or failed file)
+		bool open_once();
+
+		// Copies the source into the file with read / write, on this thread (kernel copy not possible)
+		// Returns bool: Success true, Failure false
+		bool copy_through_buffer();
+
 		bool m_last_write{ false };
+		bool m_kernel_copy{ false };
+		bool m_small_file{ false };
+		bool m_range{ false };
 
 		win32_attributes_ptr m_attributes;
 
+		copy_engine& m_engine;
 		file_ptr m_fp;
-		std::shared_ptr<char> m_write_buff;
-		std::size_t m_write_buff_count;
+		file_ptr m_source;
+		io_buffer_ptr m_write_buff;
+		std::size_t m_write_buff_count{ 0 };
+		std::size_t m_buff_offset{ 0 };
+		uint64_t m_offset{ 0U };
 	};
 
 	using file_part_task_ptr = std::shared_ptr<file_part_task>;
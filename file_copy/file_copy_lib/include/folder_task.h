@@ -1,11 +1,7 @@
 #pragma once
 
-#include <Windows.h>
-#include <WinBase.h>
-
 #include <string>
 #include <stdio.h>
-#include <fileapi.h>
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
@@ -31,8 +27,31 @@ namespace file_copy {
 		// doesn't close the file if still open
 		~folder_task() {
 		}
-		// commits the file when the last write has been performed.
+		// creates the folder and commits its attributes once every file / subfolder queued inside it is done.
 		virtual bool operator()() override {
+			m_fp->wait_children_ts(); // the children may still be written by other sink workers
+			bool ret = false;
+			try {
+				ret = commit();
+			} catch (std::exception& e) {
+				TRACE("exception when processing folder! %s\n", e.what());
+			}
+			m_fp->finished_ts(); // always, the parent folder is waiting for it
+			return ret;
+		}
+
+		inline file_ptr get_fp() {
+			return m_fp;
+		}
+
+		inline void file_attributes(win32_attributes_ptr p) {
+			m_attributes = p;
+		}
+
+	protected:
+		// Creates the folder (if needed) and sets its attributes
+		// Returns bool: Success true, Failure false
+		bool commit() {
 			DWORD attr = m_fp->check_exists();
 			if (attr == INVALID_FILE_ATTRIBUTES) { // it doesn't exist, create it!
 				bool ret = create_dir(m_fp->path_full());
@@ -48,15 +67,6 @@ namespace file_copy {
 				return false; // failed for another reason
 		}
 
-		inline file_ptr get_fp() {
-			return m_fp;
-		}
-
-		inline void file_attributes(win32_attributes_ptr p) {
-			m_attributes = p;
-		}
-
-	protected:
 		win32_attributes_ptr m_attributes;
 
 		file_ptr m_fp;
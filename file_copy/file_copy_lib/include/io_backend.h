@@ -0,0 +1,160 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include "tools.h"
+
+namespace file_copy {
+	class io_backend;
+	using io_backend_ptr = std::unique_ptr<io_backend>;
+
+	// Buffers, offsets and sizes of unbuffered transfers must be multiples of this
+	constexpr size_t UNBUFFERED_ALIGNMENT = 4096;
+
+	// Operating system specific I/O behind file.
+	// One instance handles (at most) one open file. Unless stated otherwise the methods return
+	// 0 on success, otherwise the errno_t / system error code of the failure.
+	class io_backend {
+	public:
+		virtual ~io_backend() {}
+
+		// Bypasses the operating system cache for the files opened from now on (O_DIRECT), falling back to
+		// cached I/O when the file system refuses it. Buffers must be aligned to UNBUFFERED_ALIGNMENT; a transfer
+		// that isn't (eg. the tail of a file) goes through the cache and is dropped from it right away.
+		// Parameters:
+		//    const bool& v: [in] true = unbuffered
+		inline void unbuffered(const bool& v) {
+			m_unbuffered = v;
+		}
+
+		inline bool unbuffered() const {
+			return m_unbuffered;
+		}
+
+		// Page cache hints for the cached I/O of the files opened from now on: the reads ask for sequential
+		// readahead, window bytes ahead of the position. With drop_behind the ranges already read are dropped from
+		// the cache, and the written ranges are written back and dropped every window bytes.
+		// Parameters:
+		//    const uint64_t& window: [in] bytes (0 = no hints)
+		//    const bool& drop_behind: [in] true = drop the ranges behind the position
+		inline void streaming(const uint64_t& window, const bool& drop_behind) {
+			m_stream_window = window;
+			m_drop_behind = drop_behind;
+		}
+
+		// Opens the file for reading.
+		// Parameters:
+		//    const std::wstring& path: [in] full path of the file
+		virtual errno_t open_read(const std::wstring& path) = 0;
+
+		// Opens the file for reading, bypassing the operating system cache (the data is read from the device).
+		// Pending writes of the file are flushed first. Buffers passed to read() must be aligned to 4096 bytes
+		// and their size a multiple of 4096.
+		// Parameters:
+		//    const std::wstring& path: [in] full path of the file
+		virtual errno_t open_read_uncached(const std::wstring& path) = 0;
+
+		// Creates (or truncates) the file and opens it for writing.
+		// Parameters:
+		//    const std::wstring& path: [in] full path of the file
+		virtual errno_t open_write(const std::wstring& path) = 0;
+
+		// Creates the file, preallocates it and opens it for writing at offset 0.
+		// Parameters:
+		//    const std::wstring& path: [in] full path of the file
+		//    const uint64_t& size: [in] final size of the file
+		virtual errno_t open_write_preallocate(const std::wstring& path, const uint64_t& size) = 0;
+
+		// Creates the file with its final size as a hole (no blocks reserved) and opens it for writing: only the
+		// ranges written take space, the rest reads as zeros. Without sparse files it's open_write_preallocate.
+		// Parameters:
+		//    const std::wstring& path: [in] full path of the file
+		//    const uint64_t& size: [in] final size of the file
+		virtual errno_t open_write_sparse(const std::wstring& path, const uint64_t& size) {
+			return open_write_preallocate(path, size);
+		}
+
+		// Is the file open?
+		// Returns: true = yes, false = no.
+		virtual bool is_open() const = 0;
+
+		// Returns the device id of the file open for reading (st_dev on POSIX), 0 if unknown
+		virtual uint64_t device() const {
+			return 0U;
+		}
+
+		// Thread safe
+		// Finds the next range of data of the file open for reading, at or after offset. What lies between offset
+		// and begin is a hole (reads as zeros, takes no space). Without hole information it's all data.
+		// Parameters:
+		//    const uint64_t& offset: [in] position to look from
+		//    uint64_t& begin: [out] start of the data (the end of the file if there's no data left)
+		//    uint64_t& end: [out] end of the data (start of the next hole, or the end of the file; _UI64_MAX = unknown)
+		virtual errno_t next_data(const uint64_t& offset, uint64_t& begin, uint64_t& end) {
+			begin = offset;
+			end = _UI64_MAX;
+			return 0;
+		}
+
+		// Did the reads reach the end of the file?
+		// Returns: true = yes, false = no.
+		virtual bool is_eof() const = 0;
+
+		// Reads from the current position.
+		// Parameters:
+		//    void* buffer: [out] memory buffer where it will read into
+		//    size_t& count: [in,out] number of bytes to be read, and returns the number of bytes successfully read
+		virtual errno_t read(void* buffer, size_t& count) = 0;
+
+		// Thread safe
+		// Reads at offset without moving the current position (no readahead hints, is_eof() isn't updated).
+		// Distinct threads can read distinct ranges at the same time. Unbuffered: offset, count and buffer aligned.
+		// Parameters:
+		//    void* buffer: [out] memory buffer where it will read into
+		//    size_t& count: [in,out] number of bytes to be read, and returns the number of bytes successfully read (less at the end of the file)
+		//    const uint64_t& offset: [in] position in the file
+		virtual errno_t read_at(void* buffer, size_t& count, const uint64_t& offset) = 0;
+
+		// Writes at the current position.
+		// Parameters:
+		//    const void* buffer: [in] memory buffer to be written
+		//    size_t& count: [in,out] number of bytes to be written, and returns the number of bytes successfully written
+		virtual errno_t write(const void* buffer, size_t& count) = 0;
+
+		// Thread safe
+		// Writes at offset without moving the current position. Distinct threads can write distinct ranges at the same time.
+		// Parameters:
+		//    const void* buffer: [in] memory buffer to be written
+		//    size_t& count: [in,out] number of bytes to be written, and returns the number of bytes successfully written
+		//    const uint64_t& offset: [in] position in the file
+		virtual errno_t write_at(const void* buffer, size_t& count, const uint64_t& offset) = 0;
+
+		// Copies the whole file at source into this file (open for writing, empty) inside the kernel: shares the
+		// blocks (reflink) when the file system can, otherwise the kernel copies the data, not going through user space.
+		// Parameters:
+		//    const std::wstring& source: [in] full path of the file to be copied
+		// Returns: ENOTSUP when nothing could be copied this way (eg. distinct file systems), the caller copies the data then.
+		virtual errno_t copy_from(const std::wstring& source) = 0;
+
+		// Closes the file if open.
+		// Parameters:
+		//    const bool& commit: [in] flushes the written data to the device before closing
+		virtual errno_t close(const bool& commit) = 0;
+
+		// Sets the file times and attributes. Uses the open file if any, otherwise opens the path.
+		// Parameters:
+		//    const std::wstring& path: [in] full path of the file / directory
+		//    const WIN32_FILE_ATTRIBUTE_DATA& attributes: [in] attributes to be set
+		//    const bool& is_directory: [in] the path is a directory
+		// Returns: DWORD: success = 0, otherwise the system error code
+		virtual DWORD commit_file_basic_info(const std::wstring& path, const WIN32_FILE_ATTRIBUTE_DATA& attributes, const bool& is_directory) = 0;
+
+	protected:
+		bool m_unbuffered{ false };
+		uint64_t m_stream_window{ 0U };
+		bool m_drop_behind{ false };
+	};
+
+	// Creates the io_backend of the current platform.
+	io_backend_ptr make_io_backend();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#ifndef _WIN32
+#include <mutex>
+#include "io_backend.h"
+
+namespace file_copy {
+	// POSIX backend: raw descriptors with pread / pwrite, no stdio buffering in between.
+	class posix_io_backend : public io_backend {
+	public:
+		virtual ~posix_io_backend() {
+			close(false);
+		}
+
+		virtual errno_t open_read(const std::wstring& path) override;
+
+		virtual errno_t open_read_uncached(const std::wstring& path) override;
+
+		virtual errno_t open_write(const std::wstring& path) override;
+
+		virtual errno_t open_write_preallocate(const std::wstring& path, const uint64_t& size) override;
+
+		virtual errno_t open_write_sparse(const std::wstring& path, const uint64_t& size) override;
+
+		virtual bool is_open() const override {
+			return m_fd != -1;
+		}
+
+		virtual bool is_eof() const override {
+			return m_eof;
+		}
+
+		virtual uint64_t device() const override {
+			return m_device;
+		}
+
+		virtual errno_t next_data(const uint64_t& offset, uint64_t& begin, uint64_t& end) override;
+
+		virtual errno_t read(void* buffer, size_t& count) override;
+
+		virtual errno_t read_at(void* buffer, size_t& count, const uint64_t& offset) override;
+
+		virtual errno_t write(const void* buffer, size_t& count) override;
+
+		virtual errno_t write_at(const void* buffer, size_t& count, const uint64_t& offset) override;
+
+		virtual errno_t copy_from(const std::wstring& source) override;
+
+		virtual errno_t close(const bool& commit) override;
+
+		virtual DWORD commit_file_basic_info(const std::wstring& path, const WIN32_FILE_ATTRIBUTE_DATA& attributes, const bool& is_directory) override;
+
+	protected:
+		// Reads the size of the open file and resets the position for reading
+		errno_t init_read();
+
+		// Opens path with flags, adding O_DIRECT when unbuffered (dropped if the file system refuses it)
+		// Returns int: the descriptor, -1 on failure (errno is set)
+		int open_fd(const std::string& path, int flags, const mode_t& mode = 0);
+
+		// Writes a range O_DIRECT can't take (the partial last block of a file) through the cache, and drops it from the cache
+		errno_t write_tail(const void* buffer, size_t& count, const uint64_t& offset);
+
+		// Cached reads: keeps the readahead window ahead of m_offset and drops what is behind it (see io_backend::streaming)
+		void read_hints();
+
+		// Thread safe
+		// Cached writes: every window written, starts writing it back, then waits for the previous window and drops it
+		// Parameters:
+		//    const uint64_t& end: [in] end of the range just written
+		void write_hints(const uint64_t& end);
+
+		int m_fd{ -1 };
+		uint64_t m_offset{ 0U };
+		uint64_t m_size{ 0U }; // size when opened for reading, used to flag eof without an extra read
+		uint64_t m_device{ 0U }; // st_dev when opened for reading
+		bool m_eof{ false };
+		bool m_direct{ false }; // opened with O_DIRECT: reads must stop at the file size (offsets stay aligned)
+		std::string m_path; // kept to open m_fd_tail
+		int m_fd_tail{ -1 }; // cached descriptor for the unaligned writes of an O_DIRECT file
+		std::mutex m_mutex_tail;
+		bool m_writing{ false }; // opened for writing
+		uint64_t m_readahead_end{ 0U }; // readahead requested up to here
+		uint64_t m_dropped{ 0U }; // the cache is dropped up to here
+		uint64_t m_flushed{ 0U }; // the write back is started up to here
+		uint64_t m_written_end{ 0U }; // highest end written
+		std::mutex m_mutex_drop;
+	};
+}
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#ifdef _WIN32
+#include <stdio.h>
+#include <io.h>
+#include <fcntl.h>
+#include <mutex>
+#include "io_backend.h"
+
+namespace file_copy {
+	// Win32 backend: stdio FILE* on top of CreateFileW handles.
+	class win32_io_backend : public io_backend {
+	public:
+		virtual ~win32_io_backend() {
+			close(false);
+		}
+
+		virtual errno_t open_read(const std::wstring& path) override;
+
+		virtual errno_t open_read_uncached(const std::wstring& path) override;
+
+		virtual errno_t open_write(const std::wstring& path) override;
+
+		virtual errno_t open_write_preallocate(const std::wstring& path, const uint64_t& size) override;
+
+		virtual bool is_open() const override {
+			return m_FILE ? true : false;
+		}
+
+		virtual bool is_eof() const override {
+			return m_FILE && feof(m_FILE) ? true : false;
+		}
+
+		virtual errno_t read(void* buffer, size_t& count) override;
+
+		virtual errno_t read_at(void* buffer, size_t& count, const uint64_t& offset) override;
+
+		virtual errno_t write(const void* buffer, size_t& count) override;
+
+		virtual errno_t write_at(const void* buffer, size_t& count, const uint64_t& offset) override;
+
+		virtual errno_t copy_from(const std::wstring& source) override {
+			return ENOTSUP; // TODO: FSCTL_DUPLICATE_EXTENTS_TO_FILE (ReFS block cloning)
+		}
+
+		virtual errno_t close(const bool& commit) override;
+
+		virtual DWORD commit_file_basic_info(const std::wstring& path, const WIN32_FILE_ATTRIBUTE_DATA& attributes, const bool& is_directory) override;
+
+	protected:
+		// Creates the file with its final size
+		// Returns: HANDLE: INVALID_HANDLE_VALUE in case of failure
+		HANDLE preallocate(const std::wstring& path, const uint64_t& size);
+
+		FILE* m_FILE{ nullptr };
+		std::mutex m_mutex_write_at; // the FILE* position is shared by write_at callers
+	};
+}
+#endif
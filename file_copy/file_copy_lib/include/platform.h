@@ -0,0 +1,66 @@
+#pragma once
+
+// On Windows this just pulls the SDK headers.
+// Elsewhere it defines the handful of Win32 types and constants used by the library, so the
+// engine can be built with a POSIX toolchain without touching every call site.
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <WinBase.h>
+#include <fileapi.h>
+#include <tchar.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <wchar.h>
+
+#ifndef _T
+#define _T(x) L ## x
+#endif
+
+typedef uint32_t DWORD;
+typedef int errno_t;
+
+#define INVALID_FILE_ATTRIBUTES ((DWORD)-1)
+#define FILE_ATTRIBUTE_READONLY 0x00000001
+#define FILE_ATTRIBUTE_HIDDEN 0x00000002
+#define FILE_ATTRIBUTE_DIRECTORY 0x00000010
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define FILE_ATTRIBUTE_SPARSE_FILE 0x00000200
+
+#ifndef _UI64_MAX
+#define _UI64_MAX UINT64_MAX
+#endif
+
+#ifndef MAXINT32
+#define MAXINT32 INT32_MAX
+#endif
+
+// 100-nanosecond intervals since January 1, 1601 (UTC)
+typedef struct _FILETIME {
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME;
+
+// Same members as the Win32 structure, plus the POSIX mode bits so they can be restored on the destination
+typedef struct _WIN32_FILE_ATTRIBUTE_DATA {
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime;
+	FILETIME ftLastAccessTime;
+	FILETIME ftLastWriteTime;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+	DWORD dwUnixMode;
+} WIN32_FILE_ATTRIBUTE_DATA;
+
+inline errno_t memcpy_s(void* dest, size_t dest_size, const void* src, size_t count) {
+	if (!count)
+		return 0;
+	if (!dest || !src || dest_size < count)
+		return EINVAL;
+	memcpy(dest, src, count);
+	return 0;
+}
+#endif
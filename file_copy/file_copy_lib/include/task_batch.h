@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include "task.h"
+
+namespace file_copy {
+	// Runs a list of tasks in order, as a single task of the queue (eg. a batch of small files sharing one buffer,
+	// and the folders holding them).
+	class task_batch : public task {
+	public:
+		// Runs every task, even after a failure
+		// Returns bool: true = every task succeeded
+		virtual bool operator()() override {
+			bool ret = true;
+			for (auto& t : m_tasks)
+				ret = (*t)() && ret;
+			m_tasks.clear(); // releases the buffers right away
+			return ret;
+		}
+
+		// Appends a task to the batch
+		// Parameters:
+		//    const task_ptr& t: [in] task, run after the ones added before it
+		inline void add(const task_ptr& t) {
+			m_tasks.push_back(t);
+		}
+
+		// Returns the number of tasks in the batch
+		inline size_t size() const {
+			return m_tasks.size();
+		}
+
+	protected:
+		std::vector<task_ptr> m_tasks;
+	};
+
+	using task_batch_ptr = std::shared_ptr<task_batch>;
+}
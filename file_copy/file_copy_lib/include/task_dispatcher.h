@@ -0,0 +1,114 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include "task_sink.h"
+
+namespace file_copy {
+	// Writers of the destination devices: one task_sink (its own queue and worker pool) per device id, shared by every
+	// copy writing to that device at the same time (see copy_scheduler). The pool is sized to the device class (see
+	// copy_settings::sink_workers): a spinning disk gets few writers, an NVMe drive many, and the writes of one device
+	// never wait behind another's. A copy joins the device it writes to (join_ts) and leaves it once its tasks are
+	// done; the writers of a device stop when its last copy leaves.
+	class task_dispatcher {
+	public:
+		class job;
+		using job_ptr = std::shared_ptr<job>;
+
+		// Returns the number of writers of a device
+		using pool_size_fn = std::function<unsigned int(const uint64_t& device)>;
+
+		// Constructor
+		// Parameters:
+		//    const unsigned int& queue_size: [in] tasks waiting per device at most
+		//    const pool_size_fn& pool_size: [in] number of writers of a device
+		task_dispatcher(const unsigned int& queue_size, const pool_size_fn& pool_size) :
+			m_queue_size{ queue_size }, m_pool_size{ pool_size } {}
+
+		// Thread safe: Joins a copy to the writers of device (creating its queue and writers for the first copy)
+		// Parameters:
+		//    const uint64_t& device: [in] device id (st_dev) the copy writes to, 0 = unknown
+		// Returns: job_ptr: the copy's handle on the device, call job::finish once every task is queued
+		job_ptr join_ts(const uint64_t& device);
+
+		// Thread safe: Returns the tasks waiting, all devices together
+		size_t size_ts();
+
+	private:
+		struct device_sink {
+			task_queue_ptr queue;
+			task_sink_ptr sink;
+			unsigned int jobs{ 0 }; // copies joined
+			bool running{ false }; // writers started (an async copy joined)
+		};
+
+		// Starts the writers of device (they stay up until its last copy leaves)
+		void run_ts(const uint64_t& device);
+
+		// A copy is done with device: the last one stops its writers
+		void leave_ts(const uint64_t& device);
+
+		unsigned int m_queue_size;
+		pool_size_fn m_pool_size;
+		std::map<uint64_t, device_sink> m_sinks; // devices with a copy joined
+		std::mutex m_mutex;
+	};
+
+	// One copy writing to one device of a task_dispatcher. It counts the tasks it queued, so the copy can wait for
+	// its own writes while other copies keep the same writers busy.
+	class task_dispatcher::job : public std::enable_shared_from_this<job> {
+		friend class task_dispatcher;
+	public:
+		job(task_dispatcher& owner, const uint64_t& device, const task_queue_ptr& queue, const task_sink_ptr& sink) :
+			m_owner{ owner }, m_device{ device }, m_queue{ queue }, m_sink{ sink } {}
+
+		// Queues a task for the writers of the device (blocks while its queue is full)
+		void push(const task_ptr& task);
+
+		// Returns true if the queue of the device can't take another task
+		inline bool full() const {
+			return m_queue->size() == m_queue->max_size();
+		}
+
+		// Starts the writers of the device (async mode)
+		inline void run() {
+			m_owner.run_ts(m_device);
+		}
+
+		// Processes the tasks queued for the device in the calling thread until the queue is empty (sync mode)
+		inline void commit() {
+			m_sink->commit();
+		}
+
+		// Waits until every task of this copy is done, and leaves the device
+		void finish();
+
+	private:
+		// Runs a task of the job and counts it as done
+		class counted_task : public task {
+		public:
+			counted_task(const task_ptr& t, const job_ptr& owner) : m_task{ t }, m_owner{ owner } {}
+
+			virtual bool operator()() override;
+
+		private:
+			task_ptr m_task;
+			job_ptr m_owner;
+		};
+
+		void task_done();
+
+		task_dispatcher& m_owner;
+		uint64_t m_device;
+		task_queue_ptr m_queue;
+		task_sink_ptr m_sink;
+		uint64_t m_pending{ 0U }; // tasks queued and not done yet
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		bool m_finished{ false };
+	};
+
+	using task_dispatcher_ptr = std::shared_ptr<task_dispatcher>;
+}
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <condition_variable>
 #include <atomic>
+#include <vector>
 #include "concurrent_queue.h"
 #include "thread_tools.h"
 #include "tools.h"
@@ -13,21 +14,57 @@ namespace file_copy {
 	using task_queue = thread_tools::concurrent_queue<task_ptr>;
 	using task_queue_ptr = std::shared_ptr<task_queue>;
 
-	class task_sink : public thread_tools::thread_wrapper {
+	// Pool of writer threads sharing one task queue.
+	// The chunks of a file are written by offset, so they can be processed by any worker in any order.
+	// The file is committed by whichever worker completes its last pending chunk, and a folder_task
+	// waits until every file / subfolder queued inside the folder is done.
+	class task_sink {
 	public:
-		task_sink(task_queue_ptr cq) :
-			m_cq(cq) {
+		// Constructor
+		// Parameters:
+		//    task_queue_ptr cq: [in] queue shared with the producer
+		//    const unsigned int& workers: [in] number of writing threads
+		task_sink(task_queue_ptr cq, const unsigned int& workers = 1);
+
+		~task_sink() {
+			die();
 		}
 
+		// Starts the worker threads
+		void run();
+
+		// Processes the queued tasks in the calling thread until the queue is empty (sync mode)
 		void commit();
 
-		virtual void operator ()();
+		// Processes the remaining tasks and stops the worker threads
+		void die();
+
+		// Is any worker thread running?
+		bool is_running() const {
+			return m_running;
+		}
 
 	private:
+		class worker : public thread_tools::thread_wrapper {
+		public:
+			worker(task_sink& owner) :
+				m_owner(owner) {
+			}
+
+			virtual void operator ()();
+
+		private:
+			task_sink& m_owner;
+		};
+
+		bool processNext();
+
 		task_queue_ptr m_cq;
+		std::vector<std::shared_ptr<worker>> m_workers;
+		bool m_running{ false };
+
 		std::atomic<unsigned int> m_read_count{ 0 };
 		std::atomic<unsigned int> m_write_count{ 0 };
-		bool processNext();
 	};
 
 	using task_sink_ptr = std::shared_ptr<task_sink>;
@@ -1,32 +1,49 @@
 #pragma once
 
-#include <Windows.h>
-#include <WinBase.h>
-
-#include <stdio.h>
+#include "platform.h"
 
+#ifdef _WIN32
 // added in order to use CW2A
 
 #include <atlbase.h>
 #include <atlconv.h>
 
 // /added in order to use CW2A
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#endif
+#include <stdio.h>
 #include <string>
 #include <algorithm>
 #include <cassert>
 #include <memory>
-#include <fileapi.h>
 #include <vector>
 #include "trace.h"
-#include <tchar.h>
 //#include <winioctl.h>
 
 namespace file_copy {
 	//const int READ_SIZE = 65536;
 	//constexpr int READ_SIZE = 65536;
 	using win32_attributes_ptr = std::shared_ptr<WIN32_FILE_ATTRIBUTE_DATA>;
+#ifdef _WIN32
 	using file_basic_info_ptr = std::shared_ptr<FILE_BASIC_INFO>;
 
+	constexpr wchar_t PATH_SEPARATOR = _T('\\');
+#else
+	constexpr wchar_t PATH_SEPARATOR = _T('/');
+#endif
+
 	// converts a std::string into a std::wstring
 	// Parameters:
 	//    const std::string& s: [in] string to be converted
@@ -36,6 +53,7 @@ namespace file_copy {
 	//std::copy(s.begin(), s.end(), ws.begin());
 	return ws;
 	}*/
+#ifdef _WIN32
 	inline std::string wstring_to_string(const std::wstring& ws) {
 		return std::string(ATL::CW2A(ws.c_str(), CP_UTF8));
 	}
@@ -43,19 +61,166 @@ namespace file_copy {
 	inline std::wstring string_to_wstring(const std::string& s) { // TODO: NEEDS TO BE CHANGED AS THE ONE ABOVE
 		return std::wstring(ATL::CA2W(s.c_str(), CP_UTF8));
 	}
+#else
+	// wchar_t is UTF-32 here, file names on disk are UTF-8
+	inline std::string wstring_to_string(const std::wstring& ws) {
+		std::string s;
+		s.reserve(ws.size());
+		for (wchar_t wc : ws) {
+			uint32_t c = static_cast<uint32_t>(wc);
+			if (c < 0x80) {
+				s += static_cast<char>(c);
+			} else if (c < 0x800) {
+				s += static_cast<char>(0xC0 | (c >> 6));
+				s += static_cast<char>(0x80 | (c & 0x3F));
+			} else if (c < 0x10000) {
+				s += static_cast<char>(0xE0 | (c >> 12));
+				s += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+				s += static_cast<char>(0x80 | (c & 0x3F));
+			} else {
+				s += static_cast<char>(0xF0 | (c >> 18));
+				s += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+				s += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+				s += static_cast<char>(0x80 | (c & 0x3F));
+			}
+		}
+		return s;
+	}
+
+	inline std::wstring string_to_wstring(const std::string& s) {
+		std::wstring ws;
+		ws.reserve(s.size());
+		for (size_t i = 0; i < s.size();) {
+			uint8_t c = static_cast<uint8_t>(s[i]);
+			size_t extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+			uint32_t wc = extra == 3 ? c & 0x07 : extra == 2 ? c & 0x0F : extra == 1 ? c & 0x1F : c;
+			++i;
+			for (; extra && i < s.size(); --extra, ++i)
+				wc = (wc << 6) | (static_cast<uint8_t>(s[i]) & 0x3F);
+			ws += static_cast<wchar_t>(wc);
+		}
+		return ws;
+	}
+
+	// converts a timespec into a FILETIME (100ns intervals since 1601-01-01)
+	inline FILETIME timespec_to_filetime(const struct timespec& ts) {
+		uint64_t v = (static_cast<uint64_t>(ts.tv_sec) + 11644473600ULL) * 10000000ULL + ts.tv_nsec / 100;
+		FILETIME ft;
+		ft.dwLowDateTime = static_cast<DWORD>(v);
+		ft.dwHighDateTime = static_cast<DWORD>(v >> 32);
+		return ft;
+	}
+
+	// converts a FILETIME (100ns intervals since 1601-01-01) into a timespec
+	inline struct timespec filetime_to_timespec(const FILETIME& ft) {
+		uint64_t v = static_cast<uint64_t>(ft.dwHighDateTime) << 32 | ft.dwLowDateTime;
+		struct timespec ts;
+		ts.tv_sec = static_cast<time_t>(v / 10000000ULL) - 11644473600LL;
+		ts.tv_nsec = static_cast<long>(v % 10000000ULL) * 100;
+		return ts;
+	}
+
+	// fills a WIN32_FILE_ATTRIBUTE_DATA from the result of stat()
+	inline void stat_to_attributes(const struct stat& st, WIN32_FILE_ATTRIBUTE_DATA& attributes) {
+		attributes.dwFileAttributes = S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+		if (!(st.st_mode & S_IWUSR))
+			attributes.dwFileAttributes |= FILE_ATTRIBUTE_READONLY;
+		attributes.ftCreationTime = timespec_to_filetime(st.st_mtim); // no birth time in struct stat
+		attributes.ftLastAccessTime = timespec_to_filetime(st.st_atim);
+		attributes.ftLastWriteTime = timespec_to_filetime(st.st_mtim);
+		uint64_t size = S_ISDIR(st.st_mode) ? 0U : static_cast<uint64_t>(st.st_size);
+		if (S_ISREG(st.st_mode) && static_cast<uint64_t>(st.st_blocks) * 512U < size)
+			attributes.dwFileAttributes |= FILE_ATTRIBUTE_SPARSE_FILE; // fewer blocks than bytes: holes (or compressed), see io_backend::next_data
+		attributes.nFileSizeHigh = static_cast<DWORD>(size >> 32);
+		attributes.nFileSizeLow = static_cast<DWORD>(size);
+		attributes.dwUnixMode = static_cast<DWORD>(st.st_mode);
+	}
+#endif
+
+	// Reads the attributes of a file or directory
+	// Parameters:
+	//    const std::wstring& path: [in] full path
+	//    WIN32_FILE_ATTRIBUTE_DATA& attributes: [out] attributes read
+	// Returns: DWORD: success = 0, otherwise the system error code
+	inline DWORD get_file_attributes_ex(const std::wstring& path, WIN32_FILE_ATTRIBUTE_DATA& attributes) {
+#ifdef _WIN32
+		if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes))
+			return GetLastError();
+#else
+		struct stat st;
+		if (stat(wstring_to_string(path).c_str(), &st))
+			return errno;
+		stat_to_attributes(st, attributes);
+#endif
+		return 0;
+	}
+
+	// Returns true if a destination file is up to date with its source: both are files, same size and same last
+	// write time (the copy gives the destination the time of the source)
+	// Parameters:
+	//    const WIN32_FILE_ATTRIBUTE_DATA& source: [in] attributes of the source
+	//    const WIN32_FILE_ATTRIBUTE_DATA& dest: [in] attributes of the destination
+	inline bool same_size_and_time(const WIN32_FILE_ATTRIBUTE_DATA& source, const WIN32_FILE_ATTRIBUTE_DATA& dest) {
+		return !(source.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(dest.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			&& source.nFileSizeHigh == dest.nFileSizeHigh && source.nFileSizeLow == dest.nFileSizeLow
+			&& source.ftLastWriteTime.dwHighDateTime == dest.ftLastWriteTime.dwHighDateTime
+			&& source.ftLastWriteTime.dwLowDateTime == dest.ftLastWriteTime.dwLowDateTime;
+	}
+
+	// Reads the basic attributes of a file or directory
+	// Returns: DWORD: the attributes, INVALID_FILE_ATTRIBUTES if it doesn't exist
+	inline DWORD get_file_attributes(const std::wstring& path) {
+#ifdef _WIN32
+		return GetFileAttributesW(path.c_str());
+#else
+		WIN32_FILE_ATTRIBUTE_DATA attributes{};
+		return get_file_attributes_ex(path, attributes) ? INVALID_FILE_ATTRIBUTES : attributes.dwFileAttributes;
+#endif
+	}
+
+#ifdef _WIN32
+	// Builds the FILE_BASIC_INFO used by SetFileInformationByHandle from the file attributes
+	inline file_basic_info_ptr make_file_basic_info(const WIN32_FILE_ATTRIBUTE_DATA& attributes) {
+		file_basic_info_ptr basic_info(new FILE_BASIC_INFO);
+
+		basic_info->CreationTime.HighPart = attributes.ftCreationTime.dwHighDateTime;
+		basic_info->CreationTime.LowPart = attributes.ftCreationTime.dwLowDateTime;
+		basic_info->ChangeTime.HighPart = attributes.ftLastWriteTime.dwHighDateTime;
+		basic_info->ChangeTime.LowPart = attributes.ftLastWriteTime.dwLowDateTime;
+		basic_info->LastAccessTime.HighPart = attributes.ftLastAccessTime.dwHighDateTime;
+		basic_info->LastAccessTime.LowPart = attributes.ftLastAccessTime.dwLowDateTime;
+		basic_info->LastWriteTime.HighPart = attributes.ftLastWriteTime.dwHighDateTime;
+		basic_info->LastWriteTime.LowPart = attributes.ftLastWriteTime.dwLowDateTime;
+		basic_info->FileAttributes = attributes.dwFileAttributes;
+
+		return basic_info;
+	}
+#endif
 
 	// creates a dirtectory, regardless if it's recursive or not
 	inline bool create_dir(const std::wstring& dir) {
 		if (!dir.size())
 			return false;
+#ifdef _WIN32
 		if (!CreateDirectory(dir.c_str(), nullptr)) {
 			auto err = GetLastError();
 			if (err != ERROR_ALREADY_EXISTS) {
-				std::size_t pos = dir.find_last_of(_T('\\'));
+#else
+		if (mkdir(wstring_to_string(dir).c_str(), 0777)) {
+			auto err = errno;
+			if (err != EEXIST) {
+#endif
+				std::size_t pos = dir.find_last_of(PATH_SEPARATOR);
+				if (pos == std::string::npos)
+					return false;
 
 				std::wstring upper_dir = dir.substr(0, pos);
 				bool res = create_dir(upper_dir);
-				return res && CreateDirectory(dir.c_str(), nullptr);
+#ifdef _WIN32
+				return res && (CreateDirectory(dir.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS); // another thread may have created it
+#else
+				return res && (!mkdir(wstring_to_string(dir).c_str(), 0777) || errno == EEXIST); // another thread may have created it
+#endif
 			} else {
 				return true;
 			}
@@ -64,7 +229,72 @@ namespace file_copy {
 		}
 	}
 
+	// Lists the entries of a directory ("." and ".." excluded)
+	// Parameters:
+	//    const std::wstring& dir: [in] full path of the directory
+	//    F on_entry: [in] called as on_entry(const std::wstring& name, const win32_attributes_ptr& attributes) for each entry
+	// Returns: bool: true = the directory could be listed, false = access denied / not found
+	template<typename F>
+	inline bool list_directory(const std::wstring& dir, F on_entry) {
+#ifdef _WIN32
+		WIN32_FIND_DATA find_file_data;
+		HANDLE h_find;
+		// root doesn't have a file name
+		h_find = FindFirstFileW((dir + _T("\\*")).c_str(), &find_file_data);
+		if (h_find == INVALID_HANDLE_VALUE)
+			return false;
 
+		while (h_find != INVALID_HANDLE_VALUE) {
+			if (!(find_file_data.cFileName[0] == _T('.') && find_file_data.cFileName[1] == _T('\0'))
+				&& !(find_file_data.cFileName[0] == _T('.') && find_file_data.cFileName[1] == _T('.') && find_file_data.cFileName[2] == _T('\0'))) {
+				///*&& /*AVOID SYSTEM FOLDERS*/!((find_file_data.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM) && (find_file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))) /*!(f->is_root() && (wcscmp(find_file_data.cFileName, _T("$RECYCLE.BIN"))==0))) /*(wcscmp(find_file_data.cFileName, _T(".")) != 0) && (wcscmp(find_file_data.cFileName, _T("..")) != 0)*/ {
+				win32_attributes_ptr attributes{ new WIN32_FILE_ATTRIBUTE_DATA };
+				attributes->dwFileAttributes = find_file_data.dwFileAttributes;
+				attributes->ftCreationTime = find_file_data.ftCreationTime;
+				attributes->ftLastAccessTime = find_file_data.ftLastAccessTime;
+				attributes->ftLastWriteTime = find_file_data.ftLastWriteTime;
+				attributes->nFileSizeHigh = find_file_data.nFileSizeHigh;
+				attributes->nFileSizeLow = find_file_data.nFileSizeLow;
+
+				on_entry(std::wstring{ find_file_data.cFileName }, attributes);
+			}
+
+			if (!FindNextFileW(h_find, &find_file_data)) {
+				FindClose(h_find);
+				h_find = INVALID_HANDLE_VALUE;
+			}
+		}
+#else
+		DIR* d = opendir(wstring_to_string(dir).c_str());
+		if (!d)
+			return false;
+
+		while (struct dirent* entry = readdir(d)) {
+			if ((entry->d_name[0] == '.' && entry->d_name[1] == '\0')
+				|| (entry->d_name[0] == '.' && entry->d_name[1] == '.' && entry->d_name[2] == '\0'))
+				continue;
+
+			struct stat st;
+			if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+
+			// symbolic links, devices, fifos and sockets are not copied
+			if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+				TRACE("Skipping special file: %s\n", entry->d_name);
+				continue;
+			}
+
+			win32_attributes_ptr attributes{ new WIN32_FILE_ATTRIBUTE_DATA };
+			stat_to_attributes(st, *attributes);
+
+			on_entry(string_to_wstring(entry->d_name), attributes);
+		}
+		closedir(d);
+#endif
+		return true;
+	}
+
+#ifdef _WIN32
 	//using volume_disk_extents_ptr = std::shared_ptr<VOLUME_DISK_EXTENTS>;
 	// Get the Disk Extents (used for physical disk id)
 	// Parameters:
@@ -117,6 +347,101 @@ namespace file_copy {
 		return ret;
 	}
 
+	// Get the position of a file on its volume, to read the files in their disk order
+	// Parameters:
+	//    const std::wstring& path: [in] existing file
+	//    uint64_t& position: [out] first cluster (LCN) of the file, or its file index (see physical)
+	//    bool& physical: [out] true = position is a cluster, false = the file has none (resident in the MFT, empty)
+	//       or the file system doesn't tell: position is the file index, created files come roughly in disk order
+	// Returns: DWORD: success = 0, otherwise the value of GetLastError
+	inline DWORD get_physical_position(const std::wstring& path, uint64_t& position, bool& physical) {
+		HANDLE h_file = ::CreateFileW(path.c_str(), FILE_READ_ATTRIBUTES,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			NULL,
+			OPEN_EXISTING,
+			0,
+			NULL);
+		if (h_file == INVALID_HANDLE_VALUE)
+			return ::GetLastError();
+
+		DWORD ret = 0;
+		STARTING_VCN_INPUT_BUFFER start;
+		start.StartingVcn.QuadPart = 0;
+		RETRIEVAL_POINTERS_BUFFER extents; // room for the first extent only (ERROR_MORE_DATA otherwise)
+		DWORD dwSize;
+		physical = (::DeviceIoControl(h_file, FSCTL_GET_RETRIEVAL_POINTERS, &start, static_cast<DWORD>(sizeof(start)),
+			&extents, static_cast<DWORD>(sizeof(extents)), &dwSize, NULL) || ::GetLastError() == ERROR_MORE_DATA)
+			&& extents.ExtentCount && extents.Extents[0].Lcn.QuadPart != -1; // -1: compressed / sparse run
+		if (physical) {
+			position = static_cast<uint64_t>(extents.Extents[0].Lcn.QuadPart);
+		} else {
+			BY_HANDLE_FILE_INFORMATION info;
+			if (::GetFileInformationByHandle(h_file, &info))
+				position = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+			else
+				ret = ::GetLastError();
+		}
+		::CloseHandle(h_file);
+		return ret;
+	}
+
+#else
+	// Get the device id of the file system holding the path (walking up to the first existing parent)
+	// Parameters:
+	//    const std::wstring& path: [in] file or folder, doesn't need to exist yet
+	//    uint64_t& device: [out] st_dev of the file system
+	// Returns: DWORD: success = 0, otherwise the value of errno
+	inline DWORD get_device_id(const std::wstring& path, uint64_t& device) {
+		std::wstring aux = path;
+		struct stat st;
+		while (stat(wstring_to_string(aux.size() ? aux : std::wstring{ PATH_SEPARATOR }).c_str(), &st)) {
+			if (errno != ENOENT || !aux.size())
+				return errno;
+			std::size_t pos = aux.find_last_of(PATH_SEPARATOR);
+			aux = pos == std::string::npos ? std::wstring{} : aux.substr(0, pos);
+		}
+		device = static_cast<uint64_t>(st.st_dev);
+		return 0;
+	}
+
+	// Get the position of a file on its disk, to read the files in their disk order
+	// Parameters:
+	//    const std::wstring& path: [in] existing file
+	//    uint64_t& position: [out] byte offset of the first extent of the file (FIEMAP), or its inode (see physical)
+	//    bool& physical: [out] true = position is a disk offset, false = the file has no extent (empty, inline)
+	//       or the file system doesn't tell (tmpfs, nfs...): position is the inode, allocated roughly in disk order
+	// Returns: DWORD: success = 0, otherwise the value of errno
+	inline DWORD get_physical_position(const std::wstring& path, uint64_t& position, bool& physical) {
+		int fd = open(wstring_to_string(path).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return errno;
+		physical = false;
+#ifdef FS_IOC_FIEMAP
+		alignas(struct fiemap) char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+		memset(buffer, 0, sizeof(buffer));
+		struct fiemap* map = reinterpret_cast<struct fiemap*>(buffer);
+		map->fm_start = 0;
+		map->fm_length = FIEMAP_MAX_OFFSET;
+		map->fm_extent_count = 1; // the first one
+		if (!ioctl(fd, FS_IOC_FIEMAP, map) && map->fm_mapped_extents
+			&& !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+			position = map->fm_extents[0].fe_physical;
+			physical = true;
+		}
+#endif
+		DWORD ret = 0;
+		struct stat st;
+		if (!physical) {
+			if (!fstat(fd, &st))
+				position = static_cast<uint64_t>(st.st_ino);
+			else
+				ret = errno;
+		}
+		close(fd);
+		return ret;
+	}
+#endif
+
 	// Get the Disk Extents (used for physical disk id)
 	// Parameters:
 	//    const std::wstring& root: [in] root. (eg _T("E:\"))
@@ -125,6 +450,7 @@ namespace file_copy {
 	inline DWORD get_disk_free_space(const std::wstring& root, uint64_t& space) {
 
 		DWORD ret = 0;
+#ifdef _WIN32
 		ULARGE_INTEGER free_bytes_to_caller;
 
 		if (!GetDiskFreeSpaceExW(root.c_str(), &free_bytes_to_caller, NULL, NULL)) {
@@ -132,6 +458,15 @@ namespace file_copy {
 		} else {
 			space = free_bytes_to_caller.QuadPart;
 		}
+#else
+		struct statvfs vfs;
+
+		if (statvfs(wstring_to_string(root).c_str(), &vfs)) {
+			ret = errno;
+		} else {
+			space = static_cast<uint64_t>(vfs.f_bavail) * vfs.f_frsize;
+		}
+#endif
 
 		return ret;
 	}
@@ -148,9 +483,9 @@ namespace file_copy {
 	}*/
 
 
+	// Buffer of the readers working with a single buffer (verify, kernel copy fallback). The copy itself reads in
+	// chunks sized per file (copy_settings::min_chunk_size .. max_chunk_size, see block_sizer).
 	constexpr int READ_SIZE = 32768;
-	//constexpr int READ_SIZE = 131072;
-	//constexpr int READ_SIZE = 16384;
 	inline std::wstring get_errno_desc(const errno_t& error) {
 
 		switch (error) {
@@ -232,8 +567,10 @@ namespace file_copy {
 			return _T("Directory not empty");
 		case EILSEQ:
 			return _T("Directory not empty");
+#ifdef STRUNCATE
 		case STRUNCATE:
 			return _T("String was truncated");
+#endif
 		default:
 			assert(0);
 			return _T("Unknown");
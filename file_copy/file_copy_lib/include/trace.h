@@ -1,14 +1,18 @@
 #pragma once
-// TRACE macro for win32
+// TRACE macro for win32 (and stderr on other platforms)
+#ifdef _WIN32
 #include <crtdbg.h>
+#endif
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <wchar.h>
 
 #ifdef _DEBUG
 #ifndef TRACE
 #define TRACEMAXSTRING	1024
 
+#ifdef _WIN32
 inline void TRACE(const char* format, ...)
 {
 	char szBuffer[TRACEMAXSTRING];
@@ -44,11 +48,46 @@ inline void TRACE(const wchar_t* format, ...)
 				&strrchr(__FILE__,'\\')[1],__LINE__); \
 				_RPT0(_CRT_WARN,szBuffer); \
 				TRACE
+#else
+inline void TRACE(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+inline void TRACE(const wchar_t* format, ...)
+{
+	// MSVC's wide printf takes "%s" as a wide string, glibc wants "%ls"
+	wchar_t szFormat[TRACEMAXSTRING];
+	size_t j = 0;
+	for (const wchar_t* p = format; *p && j < TRACEMAXSTRING - 2; ++p) {
+		szFormat[j++] = *p;
+		if (*p == L'%') {
+			while (p[1] && wcschr(L"-+ #0123456789.", p[1]) && j < TRACEMAXSTRING - 2)
+				szFormat[j++] = *++p;
+			if (p[1] == L's')
+				szFormat[j++] = L'l';
+		}
+	}
+	szFormat[j] = L'\0';
+
+	wchar_t szBuffer[TRACEMAXSTRING];
+	va_list args;
+	va_start(args, format);
+	vswprintf(szBuffer, TRACEMAXSTRING, szFormat, args);
+	va_end(args);
+
+	fprintf(stderr, "%ls", szBuffer);
+}
+#define TRACEF TRACE
+#endif
 #endif // #ifndef TRACE
 #else
 // Remove for release mode
 #ifndef TRACE
-#define TRACE 
+#define TRACE
 #define TRACEF
 #endif
-#endif // #ifdef _DEBUG
\ No newline at end of file
+#endif // #ifdef _DEBUG
@@ -0,0 +1,180 @@
+#pragma once
+
+#ifdef __linux__
+#include <functional>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include "tools.h"
+#include "file.h"
+#include "buffer_pool.h"
+#include "block_sizer.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace file_copy {
+	// Reads the source files through a Linux io_uring: the chunks of a file (and of the next files) are submitted
+	// ahead, up to a queue depth per device, into the pool buffers registered with the kernel (fixed buffers).
+	// Only the thread calling read_file / drain touches the ring; the completions are handed to a callback
+	// (on that thread) in completion order, which feeds them to the writers and the crc32 stage.
+	class uring_reader {
+	public:
+		// Called with every chunk read (in any order)
+		// Parameters:
+		//    const file_ptr& source, const file_ptr& dest: [in] file being copied
+		//    const io_buffer_ptr& buff: [in] data read
+		//    const size_t& count: [in] number of bytes in buff
+		//    const uint64_t& offset: [in] position of the chunk in the file
+		//    const bool& last: [in] last chunk of the file
+		//    const bool& success: [in] false = the read failed (count is 0)
+		using chunk_fn = std::function<void(const file_ptr& source, const file_ptr& dest, const io_buffer_ptr& buff, const size_t& count, const uint64_t& offset, const bool& last, const bool& success)>;
+
+		// Called when the pool has no free buffer and no read is in flight (eg. the writers must run, sync mode)
+		using starved_fn = std::function<void()>;
+
+		// Returns the reads in flight of a device (st_dev)
+		using depth_fn = std::function<unsigned int(const uint64_t& device)>;
+
+		// Constructor: creates the ring and registers the pool buffers (check is_valid())
+		// Parameters:
+		//    const buffer_pool_ptr& pool: [in] buffers to read into (all of them are allocated and registered)
+		//    const unsigned int& max_queue_depth: [in] reads in flight per device at most (sizes the ring)
+		//    const depth_fn& device_queue_depth: [in] reads in flight of each device (up to max_queue_depth)
+		//    const block_sizer_ptr& sizer: [in] chunk size of each file, fed with the throughput of the devices (nullptr = pool buffer_size)
+		//    const chunk_fn& on_chunk: [in] completion callback
+		//    const starved_fn& on_starved: [in] called before blocking on the pool
+		uring_reader(const buffer_pool_ptr& pool, const unsigned int& max_queue_depth, const depth_fn& device_queue_depth, const block_sizer_ptr& sizer, const chunk_fn& on_chunk, const starved_fn& on_starved);
+
+		~uring_reader();
+
+		uring_reader(const uring_reader&) = delete;
+		uring_reader& operator=(const uring_reader&) = delete;
+
+		// Is the ring usable? (false: io_uring not available, the caller reads with io_backend)
+		inline bool is_valid() const {
+			return m_fd != -1;
+		}
+
+		// Are the reads going into registered (fixed) buffers? (only when the pool has a single buffer size)
+		inline bool fixed_buffers() const {
+			return m_fixed;
+		}
+
+		// Opens source and submits all of its chunks, waiting for completions only when the device queue is full.
+		// The chunks are accounted in dest (file::chunk_queued_ts) when submitted, so they may complete in any order:
+		// the completions handed to the writers while later chunks are submitted can't close dest before the last one.
+		// Parameters:
+		//    const file_ptr& source: [in] file to be read
+		//    const file_ptr& dest: [in] file being written
+		void read_file(const file_ptr& source, const file_ptr& dest);
+
+		// Runs fn once every read submitted so far has been handed to the callback (right away if none is in flight).
+		// Used to queue a folder after the chunks of its files.
+		// Parameters:
+		//    const std::function<void()>& fn: [in] called on the reading thread
+		void after_reads(const std::function<void()>& fn);
+
+		// Waits for every read in flight (and hands them to the callback)
+		void drain();
+
+	private:
+		// One source file with reads in flight
+		struct open_file {
+			file_ptr source;
+			file_ptr dest;
+			int fd{ -1 };
+			uint64_t device{ 0U };
+			unsigned int pending{ 0U }; // reads in flight
+			bool submitted{ false }; // every chunk submitted
+			bool failed{ false };
+			bool direct{ false }; // opened with O_DIRECT (file::unbuffered)
+			uint64_t drop_window{ 0U }; // file::drop_behind: the cache behind the reads is dropped every drop_window bytes (0 = never)
+			uint64_t dropped{ 0U }; // the cache is dropped up to here
+			uint64_t in_flight_span{ 0U }; // bytes the reads in flight may span, kept cached below the completions
+		};
+
+		// One read in flight
+		struct request {
+			open_file* f{ nullptr };
+			io_buffer_ptr buff;
+			uint64_t offset{ 0U };
+			size_t count{ 0 };
+			bool last{ false };
+			uint64_t seq{ 0U }; // submission order
+		};
+
+		// Returns the queue depth of device
+		unsigned int queue_depth(const uint64_t& device) const;
+
+		// Gets a free pool buffer, handling completions (or calling on_starved) while there's none
+		// Parameters:
+		//    const size_t& size: [in] bytes needed
+		io_buffer_ptr acquire_buffer(const size_t& size);
+
+		// Queues the read of a request in the submission ring (submitted by the next enter())
+		void queue_read(const size_t& slot);
+
+		// Submits the queued entries; waits for min_complete completions
+		void enter(const unsigned int& min_complete);
+
+		// Hands the available completions to the callback
+		// Returns unsigned int: number of completions handled
+		unsigned int reap();
+
+		// Waits for (at least) one completion and handles it
+		void wait_one();
+
+		// Completes a request: callback, buffer and file bookkeeping
+		void complete(const size_t& slot, int res);
+
+		// Closes f once all of its reads are done
+		void release(open_file* f);
+
+		// Runs the after_reads callbacks whose reads are all done
+		void run_barriers();
+
+		buffer_pool_ptr m_pool;
+		unsigned int m_queue_depth; // at most, per device
+		depth_fn m_device_queue_depth;
+		std::map<uint64_t, unsigned int> m_in_flight; // device -> reads in flight
+		block_sizer_ptr m_sizer;
+		std::map<uint64_t, std::chrono::steady_clock::time_point> m_device_mark; // device -> last completion, or when it got busy
+		chunk_fn m_on_chunk;
+		starved_fn m_on_starved;
+
+		int m_fd{ -1 };
+		bool m_fixed{ false };
+		unsigned int m_entries{ 0U };
+		unsigned int m_to_submit{ 0U };
+		unsigned int m_pending{ 0U }; // reads in flight (all devices)
+
+		// mapped rings
+		void* m_sq_ring{ nullptr };
+		size_t m_sq_ring_size{ 0 };
+		void* m_cq_ring{ nullptr };
+		size_t m_cq_ring_size{ 0 };
+		io_uring_sqe* m_sqes{ nullptr };
+		size_t m_sqes_size{ 0 };
+		unsigned* m_sq_head{ nullptr };
+		unsigned* m_sq_tail{ nullptr };
+		unsigned* m_sq_mask{ nullptr };
+		unsigned* m_sq_array{ nullptr };
+		unsigned* m_cq_head{ nullptr };
+		unsigned* m_cq_tail{ nullptr };
+		unsigned* m_cq_mask{ nullptr };
+		io_uring_cqe* m_cqes{ nullptr };
+
+		std::vector<request> m_requests; // indexed by the user_data of the entries
+		std::vector<size_t> m_free_requests;
+
+		uint64_t m_next_seq{ 0U };
+		std::set<uint64_t> m_outstanding; // seq of the reads in flight
+		std::deque<std::pair<uint64_t, std::function<void()>>> m_barriers; // (first seq not waited for, callback)
+	};
+
+	using uring_reader_ptr = std::shared_ptr<uring_reader>;
+}
+#endif
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <thread>
+#include <cassert>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include "concurrent_queue.h"
+#include "thread_tools.h"
+#include "tools.h"
+#include "file.h"
+
+namespace file_copy {
+	// One copied file to be read back
+	struct verify_job {
+		file_ptr source;
+		file_ptr dest;
+	};
+
+	using verify_job_queue = thread_tools::concurrent_queue<verify_job>;
+	using verify_job_queue_ptr = std::shared_ptr<verify_job_queue>;
+
+	// Optional stage reading back every finished destination file, bypassing the operating system cache,
+	// and comparing its CRC with the one calculated while reading the source.
+	// It runs while the copy goes on: files are queued as soon as their last chunk is written.
+	// The destination status becomes file_status::verified or file_status::verify_failed.
+	class verify_sink {
+	public:
+		// Constructor
+		// Parameters:
+		//    const unsigned int& workers: [in] number of threads reading the destination files
+		//    const unsigned int& queue_size: [in] maximum number of files waiting to be verified
+		verify_sink(const unsigned int& workers, const unsigned int& queue_size);
+
+		~verify_sink() {
+			die();
+		}
+
+		// Starts the worker threads
+		void run();
+
+		// Queues a file to be verified (blocks if the queue is full)
+		// Parameters:
+		//    const file_ptr& source: [in] file copied, holding the expected CRC
+		//    const file_ptr& dest: [in] file written, committed and closed
+		void push(const file_ptr& source, const file_ptr& dest);
+
+		// Waits until every file pushed so far has been verified
+		void commit();
+
+		// Waits for the pending files and stops the worker threads
+		void die();
+
+		// Thread safe: number of files found not matching their source
+		inline uint64_t mismatches_ts() const {
+			return m_mismatches.load();
+		}
+
+	private:
+		class worker : public thread_tools::thread_wrapper {
+		public:
+			worker(verify_sink& owner);
+
+			~worker();
+
+			virtual void operator ()();
+
+		private:
+			verify_sink& m_owner;
+			char* m_buffer; // aligned for uncached reads
+		};
+
+		bool processNext(char* buffer);
+
+		// Reads the destination back and compares the CRCs
+		void process(const verify_job& job, char* buffer);
+
+		verify_job_queue_ptr m_cq;
+		std::vector<std::shared_ptr<worker>> m_workers;
+		bool m_running{ false };
+
+		std::atomic<uint64_t> m_mismatches{ 0U };
+		std::atomic<uint64_t> m_pending{ 0U };
+		std::mutex m_mutex_pending;
+		std::condition_variable m_cv_pending;
+	};
+
+	using verify_sink_ptr = std::shared_ptr<verify_sink>;
+}
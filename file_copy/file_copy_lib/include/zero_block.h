@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace file_copy {
+	// //////////////////////////////////////////////////////////
+	// All-zero scan of the chunks about to be written (zero_block.cpp), see copy_settings::skip_zero_blocks.
+	// The kernels stop at the first block holding a non zero byte, and check the start of the data first:
+	// a chunk of real data costs a few loads, a zero chunk one pass at memory speed.
+	// Only call them directly when the CPU supports them: is_zero_block picks the right one.
+
+	// Returns true if the length bytes at data are all zero, 64 bits words at a time (any CPU)
+	bool is_zero_block_words(const void* data, size_t length);
+
+	// Same as is_zero_block_words with SSE2, 128 bytes at a time (x86 only)
+	bool is_zero_block_sse2(const void* data, size_t length);
+
+	// Same as is_zero_block_words with AVX2, 128 bytes at a time (x86 only)
+	bool is_zero_block_avx2(const void* data, size_t length);
+
+	// Returns the name of the kernel is_zero_block uses on this CPU (detected once, on first use)
+	const char* zero_block_kernel_name();
+
+	// Returns true if the length bytes at data are all zero, using the widest vectors supported by the CPU
+	bool is_zero_block(const void* data, size_t length);
+}
@@ -0,0 +1,486 @@
+#include "stdafx.h"
+
+#ifndef _WIN32
+#include "io_backend_posix.h"
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+namespace file_copy {
+	io_backend_ptr make_io_backend() {
+		return io_backend_ptr{ new posix_io_backend };
+	}
+
+	// Finds the data range of fd at or after offset (see io_backend::next_data): SEEK_DATA / SEEK_HOLE, FIEMAP on
+	// the systems without them. Everything is data when neither works. offset is a copy: the callers pass the end found before.
+	static void find_data(const int& fd, const uint64_t offset, const uint64_t& size, uint64_t& begin, uint64_t& end) {
+		begin = offset;
+		end = size;
+		if (offset >= size)
+			return;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		off_t data = lseek(fd, static_cast<off_t>(offset), SEEK_DATA);
+		if (data != -1) {
+			off_t hole = lseek(fd, data, SEEK_HOLE);
+			begin = std::min(static_cast<uint64_t>(data), size);
+			if (hole != -1)
+				end = std::min(static_cast<uint64_t>(hole), size);
+			return;
+		}
+		if (errno == ENXIO) { // no data after offset
+			begin = size;
+			return;
+		}
+#endif
+#ifdef FS_IOC_FIEMAP
+		// the mapped extents from offset on, merged while they're contiguous (the holes are the gaps between them)
+		const unsigned int max_extents = 32;
+		alignas(struct fiemap) char buffer[sizeof(struct fiemap) + max_extents * sizeof(struct fiemap_extent)];
+		struct fiemap* map = reinterpret_cast<struct fiemap*>(buffer);
+		bool found = false;
+		uint64_t from = offset;
+		for (;;) {
+			memset(buffer, 0, sizeof(buffer));
+			map->fm_start = from;
+			map->fm_length = size - from;
+			map->fm_flags = FIEMAP_FLAG_SYNC; // the pages not written back yet have no extent
+			map->fm_extent_count = max_extents;
+			if (ioctl(fd, FS_IOC_FIEMAP, map)) {
+				if (!found) { // no extent information: all data
+					begin = offset;
+					end = size;
+				}
+				return;
+			}
+			for (unsigned int i = 0; i < map->fm_mapped_extents; ++i) {
+				const struct fiemap_extent& e = map->fm_extents[i];
+				uint64_t e_end = e.fe_logical + e.fe_length;
+				if (e_end <= offset)
+					continue;
+				if (!found) {
+					found = true;
+					begin = std::max(static_cast<uint64_t>(e.fe_logical), offset);
+				} else if (e.fe_logical > end) {
+					end = std::min(end, size);
+					return; // a hole follows
+				}
+				end = e_end;
+				if (e.fe_flags & FIEMAP_EXTENT_LAST) {
+					end = std::min(end, size);
+					return;
+				}
+			}
+			if (map->fm_mapped_extents < max_extents || end >= size)
+				break;
+			from = end;
+		}
+		if (!found)
+			begin = size; // no data after offset
+		end = std::min(std::max(end, begin), size);
+#endif
+	}
+
+	int posix_io_backend::open_fd(const std::string& path, int flags, const mode_t& mode) {
+		m_direct = false;
+#ifdef O_DIRECT
+		if (m_unbuffered) {
+			int fd = ::open(path.c_str(), flags | O_DIRECT, mode);
+			if (fd != -1) {
+				m_direct = true;
+				return fd;
+			}
+			if (errno != EINVAL) // EINVAL: the file system doesn't support O_DIRECT, cached then
+				return -1;
+		}
+#endif
+		int fd = ::open(path.c_str(), flags, mode);
+#ifdef POSIX_FADV_NOREUSE
+		if (fd != -1 && m_unbuffered)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+#endif
+		return fd;
+	}
+
+	errno_t posix_io_backend::open_read(const std::wstring& path) {
+		m_fd = open_fd(wstring_to_string(path), O_RDONLY | O_CLOEXEC);
+		if (m_fd == -1)
+			return errno;
+		m_writing = false;
+		errno_t res = init_read();
+#ifdef POSIX_FADV_SEQUENTIAL
+		if (!res && !m_direct && m_stream_window && m_size > m_stream_window) // a smaller file is read in a call or two, no hints
+			posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL); // larger readahead, pages dropped sooner once read
+#endif
+		return res;
+	}
+
+	errno_t posix_io_backend::open_read_uncached(const std::wstring& path) {
+		std::string _path = wstring_to_string(path);
+#ifdef O_DIRECT
+		m_fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT); // the kernel writes back the dirty pages first
+		if (m_fd != -1) {
+			m_direct = true;
+			return init_read();
+		}
+		if (errno != EINVAL) // EINVAL: the file system doesn't support O_DIRECT (eg. tmpfs)
+			return errno;
+#endif
+		m_fd = ::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (m_fd == -1)
+			return errno;
+		m_direct = false;
+
+		// write back and drop the cached pages, so the reads below come from the device
+		fdatasync(m_fd);
+#ifdef F_NOCACHE
+		fcntl(m_fd, F_NOCACHE, 1);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+		posix_fadvise(m_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+		return init_read();
+	}
+
+	errno_t posix_io_backend::init_read() {
+		struct stat st;
+		if (fstat(m_fd, &st)) {
+			errno_t res = errno;
+			close(false);
+			return res;
+		}
+		m_offset = 0U;
+		m_size = static_cast<uint64_t>(st.st_size);
+		m_device = static_cast<uint64_t>(st.st_dev);
+		m_eof = !m_size;
+		m_readahead_end = 0U;
+		m_dropped = 0U;
+		return 0;
+	}
+
+	errno_t posix_io_backend::open_write(const std::wstring& path) {
+		m_path = wstring_to_string(path);
+		m_fd = open_fd(m_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (m_fd == -1)
+			return errno;
+		m_writing = true;
+		m_offset = 0U;
+		m_eof = false;
+		m_dropped = m_flushed = m_written_end = 0U;
+		return 0;
+	}
+
+	errno_t posix_io_backend::open_write_preallocate(const std::wstring& path, const uint64_t& size) {
+		errno_t res = open_write(path);
+		if (res || !size)
+			return res;
+
+		// reserve the blocks when the file system supports it, otherwise just set the size
+#ifdef __linux__
+		if (fallocate(m_fd, 0, 0, static_cast<off_t>(size)) == 0)
+			return 0;
+#endif
+		if (ftruncate(m_fd, static_cast<off_t>(size))) {
+			res = errno;
+			close(false);
+		}
+		return res;
+	}
+
+	errno_t posix_io_backend::open_write_sparse(const std::wstring& path, const uint64_t& size) {
+		errno_t res = open_write(path);
+		if (res || !size)
+			return res;
+
+		if (ftruncate(m_fd, static_cast<off_t>(size))) { // one hole, the data is written into it
+			res = errno;
+			close(false);
+		}
+		return res;
+	}
+
+	errno_t posix_io_backend::next_data(const uint64_t& offset, uint64_t& begin, uint64_t& end) {
+		assert(m_fd != -1);
+		find_data(m_fd, offset, m_size, begin, end);
+		return 0;
+	}
+
+	errno_t posix_io_backend::read(void* buffer, size_t& count) {
+		assert(m_fd != -1);
+
+		read_hints();
+		size_t num_read = 0;
+		while (num_read < count) {
+			if (m_direct && m_offset >= m_size) {
+				m_eof = true;
+				break;
+			}
+			ssize_t n = pread(m_fd, static_cast<char*>(buffer) + num_read, count - num_read, static_cast<off_t>(m_offset));
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				count = num_read;
+				return errno;
+			}
+			if (!n) {
+				m_eof = true;
+				break;
+			}
+			num_read += n;
+			m_offset += n;
+		}
+		if (m_offset >= m_size)
+			m_eof = true;
+		count = num_read;
+		return 0;
+	}
+
+	errno_t posix_io_backend::read_at(void* buffer, size_t& count, const uint64_t& offset) {
+		assert(m_fd != -1);
+
+		size_t num_read = 0;
+		while (num_read < count && !(m_direct && offset + num_read >= m_size)) {
+			ssize_t n = pread(m_fd, static_cast<char*>(buffer) + num_read, count - num_read, static_cast<off_t>(offset + num_read));
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				count = num_read;
+				return errno;
+			}
+			if (!n)
+				break;
+			num_read += n;
+		}
+		count = num_read;
+#ifdef POSIX_FADV_DONTNEED
+		if (!m_direct && m_drop_behind && m_stream_window && count) // the readers aren't sequential, only the drop behind applies
+			posix_fadvise(m_fd, static_cast<off_t>(offset), static_cast<off_t>(count), POSIX_FADV_DONTNEED);
+#endif
+		return 0;
+	}
+
+	errno_t posix_io_backend::write(const void* buffer, size_t& count) {
+		errno_t res = write_at(buffer, count, m_offset);
+		m_offset += count;
+		return res;
+	}
+
+	errno_t posix_io_backend::write_at(const void* buffer, size_t& count, const uint64_t& offset) {
+		assert(m_fd != -1);
+		size_t direct = count;
+		if (m_direct) {
+			if ((offset | reinterpret_cast<uintptr_t>(buffer)) & (UNBUFFERED_ALIGNMENT - 1))
+				return write_tail(buffer, count, offset);
+			direct &= ~(UNBUFFERED_ALIGNMENT - 1); // the whole blocks, only the partial last one goes through the cache
+		}
+
+		size_t num_written = 0;
+		while (num_written < direct) {
+			ssize_t n = pwrite(m_fd, static_cast<const char*>(buffer) + num_written, direct - num_written, static_cast<off_t>(offset + num_written));
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				count = num_written;
+				return errno;
+			}
+			num_written += n;
+		}
+		if (num_written < count) {
+			size_t tail = count - num_written;
+			errno_t res = write_tail(static_cast<const char*>(buffer) + num_written, tail, offset + num_written);
+			count = num_written + tail;
+			return res;
+		}
+		count = num_written;
+		write_hints(offset + count);
+		return 0;
+	}
+
+	errno_t posix_io_backend::copy_from(const std::wstring& source) {
+#ifdef __linux__
+		assert(m_fd != -1);
+
+		int fd_in = ::open(wstring_to_string(source).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd_in == -1)
+			return errno;
+
+		errno_t res = ENOTSUP;
+#ifdef FICLONE
+		if (!ioctl(m_fd, FICLONE, fd_in)) // btrfs, XFS, ...: the blocks are shared until one side is modified
+			res = 0;
+#endif
+		if (res && !m_unbuffered) { // copy_file_range may go through the page cache
+			// a sparse source: only its data ranges are copied, the holes are left in the destination
+			struct stat st;
+			bool sparse = !fstat(fd_in, &st) && static_cast<uint64_t>(st.st_blocks) * 512U < static_cast<uint64_t>(st.st_size);
+			uint64_t size = sparse ? static_cast<uint64_t>(st.st_size) : 0U;
+			uint64_t begin = 0U;
+			uint64_t end = _UI64_MAX;
+			if (sparse)
+				find_data(fd_in, 0U, size, begin, end);
+			loff_t copied = 0;
+			loff_t offset = static_cast<loff_t>(begin);
+			res = 0;
+			for (;;) {
+				if (static_cast<uint64_t>(offset) >= end) { // sparse: next data range
+					if (end >= size)
+						break;
+					find_data(fd_in, end, size, begin, end);
+					if (begin >= size)
+						break;
+					offset = static_cast<loff_t>(begin);
+				}
+				loff_t offset_out = offset;
+				ssize_t n = copy_file_range(fd_in, &offset, m_fd, &offset_out, static_cast<size_t>(std::min<uint64_t>(end - offset, 1 << 30)), 0);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					res = errno;
+					break;
+				}
+				if (!n)
+					break; // end of the source
+				copied += n;
+			}
+			if (!res && sparse && ftruncate(m_fd, static_cast<off_t>(size))) // the hole at the end, if any
+				res = errno;
+			// not supported between these files / by this kernel: let the caller copy it
+			if (res && !copied && (res == EXDEV || res == ENOSYS || res == EOPNOTSUPP || res == EINVAL))
+				res = ENOTSUP;
+		}
+		::close(fd_in);
+		return res;
+#else
+		return ENOTSUP;
+#endif
+	}
+
+	errno_t posix_io_backend::write_tail(const void* buffer, size_t& count, const uint64_t& offset) {
+		std::lock_guard<std::mutex> l(m_mutex_tail);
+		if (m_fd_tail == -1) {
+			m_fd_tail = ::open(m_path.c_str(), O_WRONLY | O_CLOEXEC);
+			if (m_fd_tail == -1) {
+				count = 0;
+				return errno;
+			}
+		}
+
+		size_t num_written = 0;
+		while (num_written < count) {
+			ssize_t n = pwrite(m_fd_tail, static_cast<const char*>(buffer) + num_written, count - num_written, static_cast<off_t>(offset + num_written));
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				count = num_written;
+				return errno;
+			}
+			num_written += n;
+		}
+		count = num_written;
+
+		// the pages must be clean before they can be dropped
+#ifdef __linux__
+		sync_file_range(m_fd_tail, static_cast<off_t>(offset), static_cast<off_t>(count), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+		fdatasync(m_fd_tail);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+		posix_fadvise(m_fd_tail, static_cast<off_t>(offset), static_cast<off_t>(count), POSIX_FADV_DONTNEED);
+#endif
+		return 0;
+	}
+
+	void posix_io_backend::read_hints() {
+		if (m_direct || !m_stream_window || m_size <= m_stream_window)
+			return;
+#ifdef __linux__
+		if (m_offset + m_stream_window / 2 >= m_readahead_end && m_readahead_end < m_size) { // half of the window left: ask for the next one
+			uint64_t from = std::max(m_readahead_end, m_offset);
+			readahead(m_fd, static_cast<off64_t>(from), static_cast<size_t>(m_stream_window));
+			m_readahead_end = from + m_stream_window;
+		}
+#endif
+#ifdef POSIX_FADV_DONTNEED
+		if (m_drop_behind && m_offset - m_dropped >= m_stream_window) { // the data is in the caller's buffers already
+			posix_fadvise(m_fd, static_cast<off_t>(m_dropped), static_cast<off_t>(m_offset - m_dropped), POSIX_FADV_DONTNEED);
+			m_dropped = m_offset;
+		}
+#endif
+	}
+
+	void posix_io_backend::write_hints(const uint64_t& end) {
+		if (m_direct || !m_drop_behind || !m_stream_window)
+			return;
+#ifdef __linux__
+		uint64_t flush_from, flush_to, drop_from, drop_to;
+		{
+			std::lock_guard<std::mutex> l(m_mutex_drop);
+			if (end > m_written_end)
+				m_written_end = end;
+			if (m_written_end - m_flushed < m_stream_window)
+				return;
+			drop_from = m_dropped;
+			drop_to = flush_from = m_flushed;
+			flush_to = m_written_end;
+			m_dropped = m_flushed;
+			m_flushed = m_written_end;
+		}
+		// the writers go on while the window is written back; the previous one should be (almost) done by now
+		sync_file_range(m_fd, static_cast<off64_t>(flush_from), static_cast<off64_t>(flush_to - flush_from), SYNC_FILE_RANGE_WRITE);
+		if (drop_to > drop_from) {
+			sync_file_range(m_fd, static_cast<off64_t>(drop_from), static_cast<off64_t>(drop_to - drop_from), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(m_fd, static_cast<off_t>(drop_from), static_cast<off_t>(drop_to - drop_from), POSIX_FADV_DONTNEED);
+		}
+#endif
+	}
+
+	errno_t posix_io_backend::close(const bool& commit) {
+		errno_t res = 0;
+		if (m_fd_tail != -1) {
+			if (commit && fdatasync(m_fd_tail))
+				res = errno;
+			::close(m_fd_tail);
+			m_fd_tail = -1;
+		}
+		if (m_fd != -1) {
+			if (commit && fdatasync(m_fd))
+				res = errno;
+#ifdef __linux__
+			if (!m_direct && m_drop_behind && m_stream_window) {
+				// the rest of the file: a file read or written in less than a window stays cached (no syscalls for it)
+				if (m_writing && m_flushed && !commit)
+					sync_file_range(m_fd, static_cast<off64_t>(m_dropped), 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+				if ((!m_writing && m_size > m_stream_window) || m_flushed || commit)
+					posix_fadvise(m_fd, static_cast<off_t>(m_dropped), 0, POSIX_FADV_DONTNEED);
+			}
+#endif
+			if (::close(m_fd) && !res)
+				res = errno;
+			m_fd = -1;
+		}
+		return res;
+	}
+
+	DWORD posix_io_backend::commit_file_basic_info(const std::wstring& path, const WIN32_FILE_ATTRIBUTE_DATA& attributes, const bool& /*is_directory*/) {
+		struct timespec times[2];
+		times[0] = filetime_to_timespec(attributes.ftLastAccessTime);
+		times[1] = filetime_to_timespec(attributes.ftLastWriteTime);
+		mode_t mode = static_cast<mode_t>(attributes.dwUnixMode & 07777);
+
+		if (m_fd != -1) { // use the descriptor in case it exists.
+			if (futimens(m_fd, times))
+				return errno;
+			if (mode && fchmod(m_fd, mode))
+				return errno;
+		} else {
+			std::string _path = wstring_to_string(path);
+			if (utimensat(AT_FDCWD, _path.c_str(), times, 0))
+				return errno;
+			if (mode && chmod(_path.c_str(), mode))
+				return errno;
+		}
+		return 0;
+	}
+}
+#endif
@@ -0,0 +1,192 @@
+#include "stdafx.h"
+
+#ifdef _WIN32
+#include "io_backend_win32.h"
+
+namespace file_copy {
+	io_backend_ptr make_io_backend() {
+		return io_backend_ptr{ new win32_io_backend };
+	}
+
+	errno_t win32_io_backend::open_read(const std::wstring& path) {
+		if (m_unbuffered)
+			return open_read_uncached(path); // TODO: the writes are still cached (FILE_FLAG_NO_BUFFERING needs aligned tails)
+		const wchar_t* fopen_flags = m_stream_window ? _T("rbS") : _T("rb"); // S: FILE_FLAG_SEQUENTIAL_SCAN, the only hint of the cache manager
+		// TODO: no drop behind (m_drop_behind) on Windows yet
+		errno_t res = _wfopen_s(&m_FILE, path.c_str(), fopen_flags);
+		if (res)
+			m_FILE = nullptr;
+		return res;
+	}
+
+	errno_t win32_io_backend::open_read_uncached(const std::wstring& path) {
+		HANDLE h_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (h_file == INVALID_HANDLE_VALUE)
+			return EACCES;
+
+		errno_t res = 0;
+		int fd = _open_osfhandle((intptr_t)h_file, _O_RDONLY);
+		m_FILE = fd == -1 ? nullptr : _fdopen(fd, "rb");
+		if (!m_FILE) {
+			int _errno;
+			_get_errno(&_errno);
+			res = _errno ? _errno : EACCES;
+			if (fd == -1)
+				CloseHandle(h_file);
+			else
+				_close(fd);
+		} else {
+			setvbuf(m_FILE, nullptr, _IONBF, 0); // fread goes straight to ReadFile with the caller's (aligned) buffer
+		}
+		return res;
+	}
+
+	errno_t win32_io_backend::open_write(const std::wstring& path) {
+		const wchar_t fopen_flags[] = _T("wb");
+		errno_t res = _wfopen_s(&m_FILE, path.c_str(), fopen_flags);
+		if (res)
+			m_FILE = nullptr;
+		return res;
+	}
+
+	errno_t win32_io_backend::open_write_preallocate(const std::wstring& path, const uint64_t& size) {
+		errno_t res = 0;
+
+		HANDLE h_file = preallocate(path, size);
+
+		if (h_file == INVALID_HANDLE_VALUE) {
+			res = EACCES;
+		} else {
+			int fd = _open_osfhandle((intptr_t)h_file, _O_RDWR);
+			m_FILE = _fdopen(fd, "rb+");
+			if (!m_FILE) {
+				int _errno;
+				res = _get_errno(&_errno);
+				if (!res)
+					res = _errno ? _errno : EACCES;
+			} else {
+				fseek(m_FILE, 0, SEEK_SET);
+			}
+		}
+		return res;
+	}
+
+	errno_t win32_io_backend::read(void* buffer, size_t& count) {
+		assert(m_FILE);
+
+		errno_t res = 0;
+		size_t num_read = fread_s(buffer, count, sizeof(char), count, m_FILE);
+		if (num_read != count && !feof(m_FILE)) {
+			int _errno;
+			_get_errno(&_errno);
+			res = _errno ? _errno : EIO;
+		}
+		count = num_read;
+		return res;
+	}
+
+	errno_t win32_io_backend::read_at(void* buffer, size_t& count, const uint64_t& offset) {
+		assert(m_FILE);
+
+		// positioned ReadFile on the handle, the FILE* buffer isn't used (TODO: overlapped handle, the reads of a synchronous one are serialized)
+		HANDLE h_file = (HANDLE)_get_osfhandle(_fileno(m_FILE));
+		size_t num_read = 0;
+		while (num_read < count) {
+			OVERLAPPED ov{};
+			uint64_t pos = offset + num_read;
+			ov.Offset = static_cast<DWORD>(pos);
+			ov.OffsetHigh = static_cast<DWORD>(pos >> 32);
+			DWORD to_read = static_cast<DWORD>(std::min<size_t>(count - num_read, 1UL << 30));
+			DWORD n = 0;
+			if (!ReadFile(h_file, static_cast<char*>(buffer) + num_read, to_read, &n, &ov)) {
+				if (GetLastError() == ERROR_HANDLE_EOF)
+					break;
+				count = num_read;
+				return EIO;
+			}
+			if (!n)
+				break;
+			num_read += n;
+		}
+		count = num_read;
+		return 0;
+	}
+
+	errno_t win32_io_backend::write(const void* buffer, size_t& count) {
+		assert(m_FILE);
+
+		errno_t res = 0;
+		size_t num_written = fwrite(buffer, sizeof(char), count, m_FILE);
+		if (num_written != count) {
+			int _errno;
+			_get_errno(&_errno);
+			res = _errno ? _errno : EIO;
+		}
+		count = num_written;
+		return res;
+	}
+
+	errno_t win32_io_backend::write_at(const void* buffer, size_t& count, const uint64_t& offset) {
+		std::lock_guard<std::mutex> l(m_mutex_write_at);
+		if (_fseeki64(m_FILE, static_cast<__int64>(offset), SEEK_SET)) {
+			count = 0;
+			return EIO;
+		}
+		return write(buffer, count);
+	}
+
+	errno_t win32_io_backend::close(const bool& commit) {
+		errno_t res = 0;
+		if (m_FILE) {
+			if (commit) {
+				fflush(m_FILE);
+				if (_commit(_fileno(m_FILE))) {
+					int _errno;
+					_get_errno(&_errno);
+					res = _errno ? _errno : EIO;
+				}
+			}
+			fclose(m_FILE);
+			m_FILE = nullptr;
+		}
+		return res;
+	}
+
+	DWORD win32_io_backend::commit_file_basic_info(const std::wstring& path, const WIN32_FILE_ATTRIBUTE_DATA& attributes, const bool& is_directory) {
+		DWORD ret = 0;
+		HANDLE h_file = INVALID_HANDLE_VALUE;
+		if (m_FILE) { // use the FILE* in case it exists.
+			fflush(m_FILE);
+			h_file = (HANDLE)_get_osfhandle(_fileno(m_FILE));
+		} else {
+			h_file = CreateFileW(path.c_str(), GENERIC_WRITE,//GENERIC_READ | GENERIC_WRITE | DELETE,
+				FILE_SHARE_WRITE | FILE_SHARE_READ,
+				NULL,
+				OPEN_EXISTING,
+				is_directory ? FILE_FLAG_BACKUP_SEMANTICS : NULL,
+				NULL);
+		}
+
+		if (h_file != INVALID_HANDLE_VALUE) {
+			if (!SetFileInformationByHandle(h_file, FileBasicInfo, make_file_basic_info(attributes).get(), sizeof(FILE_BASIC_INFO)))
+				ret = GetLastError();
+			if (!m_FILE)
+				CloseHandle(h_file);
+		} else {
+			ret = GetLastError();
+		}
+		return ret;
+	}
+
+	HANDLE win32_io_backend::preallocate(const std::wstring& path, const uint64_t& size) {
+		HANDLE h_file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (h_file != INVALID_HANDLE_VALUE) {
+			LARGE_INTEGER _size;
+			_size.QuadPart = size;
+			::SetFilePointerEx(h_file, _size, 0, FILE_BEGIN);
+			::SetEndOfFile(h_file);
+		}
+		return h_file;
+	}
+}
+#endif
@@ -0,0 +1,382 @@
+#include "stdafx.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <cstring>
+#include <thread>
+#include "uring_reader.h"
+
+namespace file_copy {
+	using namespace std;
+
+	// the kernel refuses to register more buffers than this
+	const size_t URING_MAX_FIXED_BUFFERS = 1U << 14;
+	const unsigned int URING_MAX_ENTRIES = 4096U;
+
+	uring_reader::uring_reader(const buffer_pool_ptr& pool, const unsigned int& max_queue_depth, const depth_fn& device_queue_depth, const block_sizer_ptr& sizer, const chunk_fn& on_chunk, const starved_fn& on_starved) :
+		m_pool{ pool }, m_queue_depth{ max_queue_depth ? max_queue_depth : 1U }, m_device_queue_depth{ device_queue_depth }, m_sizer{ sizer }, m_on_chunk{ on_chunk }, m_on_starved{ on_starved } {
+		unsigned int entries = 1U;
+		while (entries < m_queue_depth && entries < URING_MAX_ENTRIES)
+			entries <<= 1;
+
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+		if (fd < 0) {
+			TRACE(_T("io_uring not available : error %d\n"), errno);
+			return;
+		}
+		if (!(p.features & IORING_FEAT_FAST_POLL)) { // older than 5.7: IORING_OP_READ may be missing
+			TRACE(_T("io_uring too old : features %x\n"), p.features);
+			::close(fd);
+			return;
+		}
+
+		m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap)
+			m_sq_ring_size = m_cq_ring_size = max(m_sq_ring_size, m_cq_ring_size);
+
+		m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (m_sq_ring == MAP_FAILED) {
+			m_sq_ring = nullptr;
+			::close(fd);
+			return;
+		}
+		if (single_mmap) {
+			m_cq_ring = m_sq_ring;
+		} else {
+			m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (m_cq_ring == MAP_FAILED) {
+				m_cq_ring = nullptr;
+				munmap(m_sq_ring, m_sq_ring_size);
+				m_sq_ring = nullptr;
+				::close(fd);
+				return;
+			}
+		}
+		m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+		void* sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) {
+			if (m_cq_ring != m_sq_ring)
+				munmap(m_cq_ring, m_cq_ring_size);
+			munmap(m_sq_ring, m_sq_ring_size);
+			m_sq_ring = m_cq_ring = nullptr;
+			::close(fd);
+			return;
+		}
+		m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+		char* sq = static_cast<char*>(m_sq_ring);
+		m_sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+		m_sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+		m_sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+		m_sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+		char* cq = static_cast<char*>(m_cq_ring);
+		m_cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+		m_cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+		m_cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+		m_fd = fd;
+		m_entries = p.sq_entries;
+		m_requests.resize(m_entries);
+		for (size_t i = m_entries; i > 0; --i)
+			m_free_requests.push_back(i - 1);
+
+		// fixed buffers: the kernel maps the pool once instead of on every read (the buffers of a pool with size classes come and go)
+		if (m_pool->capacity() <= URING_MAX_FIXED_BUFFERS && m_pool->max_buffer_size() == m_pool->buffer_size()) {
+			try {
+				m_pool->preallocate();
+				vector<iovec> iov(m_pool->capacity());
+				for (size_t i = 0; i < iov.size(); ++i) {
+					iov[i].iov_base = m_pool->buffer_data(i);
+					iov[i].iov_len = m_pool->buffer_size();
+				}
+				m_fixed = !syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, iov.data(), static_cast<unsigned int>(iov.size()));
+				if (!m_fixed)
+					TRACE(_T("io_uring buffers not registered : error %d\n"), errno); // eg. RLIMIT_MEMLOCK, plain reads then
+			} catch (const std::bad_alloc&) {
+				m_fixed = false;
+			}
+		}
+	}
+
+	uring_reader::~uring_reader() {
+		if (m_fd == -1)
+			return;
+		try {
+			drain();
+		} catch (std::exception& e) {
+			TRACE("exception when draining io_uring! %s\n", e.what());
+		}
+		munmap(m_sqes, m_sqes_size);
+		if (m_cq_ring != m_sq_ring)
+			munmap(m_cq_ring, m_cq_ring_size);
+		munmap(m_sq_ring, m_sq_ring_size);
+		::close(m_fd); // unregisters the buffers
+	}
+
+	unsigned int uring_reader::queue_depth(const uint64_t& device) const {
+		unsigned int depth = m_device_queue_depth ? m_device_queue_depth(device) : m_queue_depth;
+		return depth < 1U ? 1U : depth > m_queue_depth ? m_queue_depth : depth;
+	}
+
+	void uring_reader::read_file(const file_ptr& source, const file_ptr& dest) {
+		assert(is_valid());
+		open_file* f = new open_file;
+		f->source = source;
+		f->dest = dest;
+
+		struct stat st;
+		const std::string path = wstring_to_string(source->path_full());
+		if (source->unbuffered() && m_pool->alignment() % UNBUFFERED_ALIGNMENT == 0) {
+			f->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+			f->direct = f->fd != -1;
+			if (f->fd == -1 && errno == EINVAL) // the file system doesn't support O_DIRECT
+				f->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		} else {
+			f->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		}
+		if (f->fd == -1 || fstat(f->fd, &st)) {
+			TRACE(_T("Opening file: %s failed : error %d\n"), source->path_full().c_str(), errno);
+			if (f->fd != -1)
+				::close(f->fd);
+			delete f;
+			// a single empty chunk, so the destination is still accounted and finished (failed, it isn't created)
+			source->status_ts(file::file_status::failed_open);
+			dest->fail_write_ts();
+			io_buffer_ptr buff = acquire_buffer(0);
+			dest->chunk_queued_ts(true);
+			m_on_chunk(source, dest, buff, 0U, 0U, true, false);
+			return;
+		}
+		source->status_ts(file::file_status::open_read);
+		f->device = static_cast<uint64_t>(st.st_dev);
+
+		const uint64_t size = static_cast<uint64_t>(st.st_size);
+		const uint64_t block = m_sizer ? m_sizer->chunk_size_ts(size, f->device) : m_pool->buffer_size();
+		const uint64_t chunks = size ? (size + block - 1) / block : 1U;
+		const unsigned int depth = queue_depth(f->device);
+		unsigned int& in_flight = m_in_flight[f->device];
+		if (!f->direct && source->stream_window() && size > source->stream_window()) {
+			posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL); // the reads in flight are the readahead, this widens the kernel's
+			if (source->drop_behind()) {
+				f->drop_window = source->stream_window();
+				f->in_flight_span = depth * block;
+			}
+		}
+
+		for (uint64_t i = 0; i < chunks; ++i) {
+			uint64_t offset = i * block;
+			bool last = i == chunks - 1;
+			while (in_flight >= depth || m_pending >= m_entries)
+				wait_one();
+
+			io_buffer_ptr buff = acquire_buffer(static_cast<size_t>(block));
+			if (f->failed || !size) { // nothing (more) to read: close the file with an empty chunk
+				dest->chunk_queued_ts(true);
+				m_on_chunk(source, dest, buff, 0U, offset, true, !f->failed);
+				break;
+			}
+
+			size_t slot = m_free_requests.back();
+			m_free_requests.pop_back();
+			request& r = m_requests[slot];
+			r.f = f;
+			r.buff = std::move(buff);
+			r.offset = offset;
+			r.count = static_cast<size_t>(min(block, size - offset));
+			r.last = last;
+			r.seq = m_next_seq++;
+			m_outstanding.insert(r.seq);
+
+			dest->chunk_queued_ts(last); // before it can complete; dest stays open until the last one is submitted and done
+			++f->pending;
+			if (!in_flight && m_sizer)
+				m_device_mark[f->device] = chrono::steady_clock::now(); // the device gets busy
+			++in_flight;
+			++m_pending;
+			queue_read(slot);
+		}
+		f->submitted = true;
+		release(f); // f may be gone from here on
+		enter(0); // the reads go on while the caller moves to the next file
+		reap();
+	}
+
+	void uring_reader::after_reads(const function<void()>& fn) {
+		if (m_outstanding.empty()) {
+			fn();
+			return;
+		}
+		m_barriers.push_back(make_pair(m_next_seq, fn));
+	}
+
+	void uring_reader::drain() {
+		if (m_to_submit)
+			enter(0);
+		while (m_pending)
+			wait_one();
+		run_barriers();
+	}
+
+	void uring_reader::run_barriers() {
+		while (!m_barriers.empty() && (m_outstanding.empty() || *m_outstanding.begin() >= m_barriers.front().first)) {
+			auto fn = std::move(m_barriers.front().second);
+			m_barriers.pop_front();
+			fn();
+		}
+	}
+
+	io_buffer_ptr uring_reader::acquire_buffer(const size_t& size) {
+		for (;;) {
+			io_buffer_ptr buff = m_pool->try_acquire(size);
+			if (buff)
+				return buff;
+			if (!m_pending)
+				break;
+			wait_one(); // the completed chunks may hold the buffers until the writers run
+		}
+		if (m_on_starved)
+			m_on_starved();
+		return m_pool->acquire(size);
+	}
+
+	void uring_reader::queue_read(const size_t& slot) {
+		unsigned int tail = *m_sq_tail;
+		if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_entries) {
+			enter(0); // hand the queued entries to the kernel to make room
+			tail = *m_sq_tail;
+		}
+
+		const request& r = m_requests[slot];
+		unsigned int index = tail & *m_sq_mask;
+		io_uring_sqe* sqe = &m_sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = r.f->fd;
+		sqe->addr = reinterpret_cast<uint64_t>(r.buff->data());
+		sqe->len = static_cast<uint32_t>(r.f->direct ? (r.count + UNBUFFERED_ALIGNMENT - 1) & ~(UNBUFFERED_ALIGNMENT - 1) : r.count); // O_DIRECT: whole blocks, the tail comes back short
+		sqe->off = r.offset;
+		if (m_fixed)
+			sqe->buf_index = static_cast<uint16_t>(r.buff->index());
+		sqe->user_data = slot;
+		m_sq_array[index] = index;
+		__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++m_to_submit;
+	}
+
+	void uring_reader::enter(const unsigned int& min_complete) {
+		for (;;) {
+			int ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, m_to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0U, nullptr, 0));
+			if (ret >= 0) {
+				m_to_submit -= min(static_cast<unsigned int>(ret), m_to_submit);
+				return;
+			}
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY) { // no room for the completions yet
+				if (!reap())
+					this_thread::yield();
+				if (!min_complete)
+					return;
+				continue;
+			}
+			std::wostringstream os;
+			os << "io_uring_enter failed : error " << errno;
+			TRACE(_T("%s\n"), os.str().c_str());
+			throw std::runtime_error(wstring_to_string(os.str()));
+		}
+	}
+
+	unsigned int uring_reader::reap() {
+		unsigned int n = 0;
+		unsigned int head = *m_cq_head;
+		while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+			const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+			size_t slot = static_cast<size_t>(cqe.user_data);
+			int res = cqe.res;
+			__atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+			complete(slot, res);
+			++n;
+		}
+		return n;
+	}
+
+	void uring_reader::wait_one() {
+		if (!reap()) {
+			enter(1);
+			reap();
+		}
+	}
+
+	void uring_reader::complete(const size_t& slot, int res) {
+		request r = std::move(m_requests[slot]);
+		m_requests[slot] = request{};
+		m_free_requests.push_back(slot);
+		open_file* f = r.f;
+		--f->pending;
+		--m_in_flight[f->device];
+		--m_pending;
+		m_outstanding.erase(r.seq);
+
+		bool success = res >= 0;
+		size_t count = success ? min(static_cast<size_t>(res), r.count) : 0U;
+		if (m_sizer) { // the device was busy since its previous completion (or since it got busy)
+			auto now = chrono::steady_clock::now();
+			chrono::steady_clock::time_point& mark = m_device_mark[f->device];
+			if (r.offset) // else the access time of the file too
+				m_sizer->record_ts(f->device, count, chrono::duration<double>(now - mark).count());
+			else
+				m_sizer->record_access_ts(f->device, count, chrono::duration<double>(now - mark).count());
+			mark = now;
+		}
+		if (success && count < r.count && f->direct) { // the rest is read through the cache (unaligned)
+			fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+			f->direct = false;
+		}
+		while (success && count < r.count) { // short read, finish the chunk here
+			ssize_t n = pread(f->fd, r.buff->data() + count, r.count - count, static_cast<off_t>(r.offset + count));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) { // error, or the file got shorter while being copied
+				success = false;
+				res = n ? -errno : -EIO;
+				break;
+			}
+			count += n;
+		}
+		if (!success) {
+			TRACE(_T("Reading failed : file path : %s : offset %llu : error %d\n"), f->source->path_full().c_str(), static_cast<unsigned long long>(r.offset), -res);
+			f->failed = true;
+			f->dest->fail_write_ts(); // the chunks not written yet are dropped, the last one closes it as failed
+			count = 0U;
+		} else if (f->drop_window && r.offset >= f->dropped + f->drop_window + f->in_flight_span) {
+			// the data is in the pool buffer: drop the pages behind, short of the reads that may still be in flight
+			uint64_t to = r.offset - f->in_flight_span;
+			posix_fadvise(f->fd, static_cast<off_t>(f->dropped), static_cast<off_t>(to - f->dropped), POSIX_FADV_DONTNEED);
+			f->dropped = to;
+		}
+
+		m_on_chunk(f->source, f->dest, r.buff, count, r.offset, r.last, success);
+		r.buff.reset();
+		release(f);
+		run_barriers();
+	}
+
+	void uring_reader::release(open_file* f) {
+		if (!f->submitted || f->pending)
+			return;
+		if (f->drop_window)
+			posix_fadvise(f->fd, static_cast<off_t>(f->dropped), 0, POSIX_FADV_DONTNEED);
+		::close(f->fd);
+		f->source->status_ts(f->failed ? file::file_status::failed_open : file::file_status::closed_read);
+		delete f;
+	}
+}
+#endif
@@ -0,0 +1,165 @@
+// //////////////////////////////////////////////////////////
+// All-zero scan kernels and the runtime dispatch between them
+
+#include "stdafx.h"
+#include <algorithm>
+#include "zero_block.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ZERO_BLOCK_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// gcc / clang only emit the instructions in functions flagged for them, Visual Studio always does
+#if defined(__GNUC__) || defined(__clang__)
+#define ZERO_BLOCK_TARGET(x) __attribute__((target(x)))
+#else
+#define ZERO_BLOCK_TARGET(x)
+#endif
+
+namespace file_copy {
+	namespace {
+		struct zero_block_kernel {
+			const char* name;
+			bool(*scan)(const void*, size_t);
+		};
+
+#ifdef ZERO_BLOCK_X86
+		// cpuid leaf / subleaf into regs (eax, ebx, ecx, edx)
+		inline void cpuid(const int& leaf, const int& subleaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+			__cpuidex(reinterpret_cast<int*>(regs), leaf, subleaf);
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		// Returns the register state enabled by the operating system (XCR0)
+		inline uint64_t xgetbv0() {
+#if defined(_MSC_VER)
+			return _xgetbv(0);
+#else
+			unsigned int eax, edx;
+			__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+		}
+
+		zero_block_kernel detect_kernel() {
+			unsigned int regs[4];
+			cpuid(0, 0, regs);
+			unsigned int max_leaf = regs[0];
+			if (max_leaf < 1)
+				return zero_block_kernel{ "words", is_zero_block_words };
+
+			cpuid(1, 0, regs);
+			bool sse2 = (regs[3] & (1U << 26)) != 0;
+			bool osxsave = (regs[2] & (1U << 27)) != 0;
+			bool avx = (regs[2] & (1U << 28)) != 0;
+			if (!sse2)
+				return zero_block_kernel{ "words", is_zero_block_words };
+
+			if (osxsave && avx && max_leaf >= 7) {
+				// the OS must save the xmm and ymm state
+				const uint64_t ymm_state = (1U << 1) | (1U << 2);
+				cpuid(7, 0, regs);
+				bool avx2 = (regs[1] & (1U << 5)) != 0;
+				if (avx2 && (xgetbv0() & ymm_state) == ymm_state)
+					return zero_block_kernel{ "avx2", is_zero_block_avx2 };
+			}
+			return zero_block_kernel{ "sse2", is_zero_block_sse2 };
+		}
+#else
+		zero_block_kernel detect_kernel() {
+			return zero_block_kernel{ "words", is_zero_block_words };
+		}
+#endif
+
+		const zero_block_kernel& kernel() {
+			static const zero_block_kernel k = detect_kernel();
+			return k;
+		}
+	}
+
+	bool is_zero_block_words(const void* data, size_t length) {
+		const uint8_t* buf = static_cast<const uint8_t*>(data);
+		for (; length && (reinterpret_cast<uintptr_t>(buf) & 7); --length)
+			if (*buf++)
+				return false;
+
+		const uint64_t* words = reinterpret_cast<const uint64_t*>(buf);
+		for (; length >= 32; words += 4, length -= 32)
+			if (words[0] | words[1] | words[2] | words[3])
+				return false;
+
+		buf = reinterpret_cast<const uint8_t*>(words);
+		for (; length; --length)
+			if (*buf++)
+				return false;
+		return true;
+	}
+
+#ifdef ZERO_BLOCK_X86
+	ZERO_BLOCK_TARGET("sse2")
+	bool is_zero_block_sse2(const void* data, size_t length) {
+		if (length < 128)
+			return is_zero_block_words(data, length);
+
+		const uint8_t* buf = static_cast<const uint8_t*>(data);
+		const uint8_t* last = buf + length - 128; // the tail is checked as the last 128 bytes, overlapping the previous block
+		const __m128i zero = _mm_setzero_si128();
+		for (;;) {
+			__m128i x = _mm_or_si128(
+				_mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)(buf + 0x00)), _mm_loadu_si128((const __m128i*)(buf + 0x10))),
+					_mm_or_si128(_mm_loadu_si128((const __m128i*)(buf + 0x20)), _mm_loadu_si128((const __m128i*)(buf + 0x30)))),
+				_mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)(buf + 0x40)), _mm_loadu_si128((const __m128i*)(buf + 0x50))),
+					_mm_or_si128(_mm_loadu_si128((const __m128i*)(buf + 0x60)), _mm_loadu_si128((const __m128i*)(buf + 0x70)))));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xFFFF)
+				return false;
+			if (buf == last)
+				return true;
+			buf = std::min(buf + 128, last);
+		}
+	}
+
+	ZERO_BLOCK_TARGET("avx2")
+	bool is_zero_block_avx2(const void* data, size_t length) {
+		if (length < 128)
+			return is_zero_block_sse2(data, length);
+
+		const uint8_t* buf = static_cast<const uint8_t*>(data);
+		const uint8_t* last = buf + length - 128; // the tail is checked as the last 128 bytes, overlapping the previous block
+		for (;;) {
+			__m256i x = _mm256_or_si256(
+				_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(buf + 0x00)), _mm256_loadu_si256((const __m256i*)(buf + 0x20))),
+				_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(buf + 0x40)), _mm256_loadu_si256((const __m256i*)(buf + 0x60))));
+			if (!_mm256_testz_si256(x, x))
+				return false;
+			if (buf == last)
+				return true;
+			buf = std::min(buf + 128, last);
+		}
+	}
+#else // not x86
+	bool is_zero_block_sse2(const void* data, size_t length) {
+		return is_zero_block_words(data, length);
+	}
+
+	bool is_zero_block_avx2(const void* data, size_t length) {
+		return is_zero_block_words(data, length);
+	}
+#endif
+
+	const char* zero_block_kernel_name() {
+		return kernel().name;
+	}
+
+	bool is_zero_block(const void* data, size_t length) {
+		return kernel().scan(data, length);
+	}
+}
@@ -6,35 +6,56 @@
 #include <vector>
 #include <iostream>
 #include <memory>
+#include <chrono>
+#include <clocale>
+#include <queue>
+#include <thread>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 #include "copy_engine.h"
+#include "copy_scheduler.h"
+#include "crc32.h"
+#include "zero_block.h"
 
 using namespace std;
 using namespace file_copy;
 
 class scoped_stdout_mode {
 public:
+#ifdef _WIN32
 	scoped_stdout_mode(const int& mode) {
 		wcout.flush();
-		m_prev_mode = _setmode(_fileno(stdout), _O_U8TEXT);
+		m_prev_mode = _setmode(_fileno(stdout), mode);
 	}
 
 	~scoped_stdout_mode() {
 		wcout.flush();
 		_setmode(_fileno(stdout), m_prev_mode);
 	}
+#else
+	scoped_stdout_mode(const int& /*mode*/) {
+		setlocale(LC_ALL, "");
+	}
+
+	~scoped_stdout_mode() {
+		wcout.flush();
+	}
+#endif
 
 protected:
-	int m_prev_mode;
+	int m_prev_mode{ 0 };
 };
 
 
 void dump_files_to_process(const copy_engine& _copy) {
 	//auto prev_mode = _setmode(_fileno(stdout), _O_U8TEXT);
 	wcout << _T("\n\n### Dumping files to process STARTED ###\n\n");
-	const file_to_process_vector& v = _copy.get_files_to_process();
-	wcout << _T("count\tsource()->root()\tsource()->file_name()\tsource()->is_directory()\tsource()->size_ts()\tsource()->path()\tdest()->path()\tget_status_ts()\n");
-	uint64_t count = 0ui64;
+	const file_to_process_vector v = _copy.get_files_to_process_ts();
+	wcout << _T("count\tsource()->root()\tsource()->file_name()\tsource()->is_directory()\tsource()->size_ts()\tsource()->path()\tdest()->path()\tsource()->crc32_ts()\tget_status_ts()\n");
+	uint64_t count = 0U;
 	for (auto x : v) {
 		++count;
 		wcout
@@ -45,6 +66,10 @@ void dump_files_to_process(const copy_engine& _copy) {
 			<< x.source()->size_ts() << _T("\t")
 			<< x.source()->path() << _T("\t")
 			<< x.dest()->path() << _T("\t");
+		if (!x.source()->is_directory() && !x.source()->crc32_ready_ts())
+			wcout << _T("--------\t"); // copied inside the kernel, not hashed
+		else
+			wcout << std::hex << std::setw(8) << std::setfill(_T('0')) << x.source()->crc32_ts() << std::dec << std::setfill(_T(' ')) << _T("\t");
 
 		/*idle,
 		source_access_denied,
@@ -76,6 +101,9 @@ void dump_files_to_process(const copy_engine& _copy) {
 		case files_to_process::files_to_process_status::dest_file_error:
 			wcout << _T("files_to_process::files_to_process_status::dest_file_error");
 			break;
+		case files_to_process::files_to_process_status::verify_failed:
+			wcout << _T("files_to_process::files_to_process_status::verify_failed");
+			break;
 		default:
 			wcout << _T("unknown");
 			break;
@@ -91,9 +119,9 @@ void dump_files_to_process(const copy_engine& _copy) {
 void dump_files_to_process_folders_only(const copy_engine& _copy) {
 	//auto prev_mode = _setmode(_fileno(stdout), _O_U8TEXT);
 	wcout << _T("\n\n### Dumping folders to process STARTED ###\n\n");
-	const file_to_process_vector& v = _copy.get_files_to_process();
+	const file_to_process_vector v = _copy.get_files_to_process_ts();
 	wcout << _T("count\tsource()->root()\tsource()->file_name()\tsource()->is_directory()\tsource()->size_ts()\tsource()->path()\tdest()->path()\tget_status_ts()\n");
-	uint64_t count = 0ui64;
+	uint64_t count = 0U;
 	for (auto x : v) {
 		if (!x.source()->is_directory())
 			continue;
@@ -137,6 +165,9 @@ void dump_files_to_process_folders_only(const copy_engine& _copy) {
 		case files_to_process::files_to_process_status::dest_file_error:
 			wcout << _T("files_to_process::files_to_process_status::dest_file_error");
 			break;
+		case files_to_process::files_to_process_status::verify_failed:
+			wcout << _T("files_to_process::files_to_process_status::verify_failed");
+			break;
 		default:
 			wcout << _T("unknown");
 			break;
@@ -149,12 +180,12 @@ void dump_files_to_process_folders_only(const copy_engine& _copy) {
 	wcout << _T("\n\n### Dumping folders to process FINISHED ###\n\n");
 }
 
-void tester(const wstring& s, const wstring& d, bool just_prepare = false, bool dump_prepare = false, copy_engine::async_mode mode = copy_engine::async_mode::automatic) {
+void tester(const wstring& s, const wstring& d, bool just_prepare = false, bool dump_prepare = false, copy_engine::async_mode mode = copy_engine::async_mode::automatic, bool dump_copy = false, const copy_settings& settings = copy_settings{}) {
 	wcout << _T("\n\n### Copying files STARTED ###\n\n");
 	wcout << _T("source: ") << s << endl << _T("dest: ") << d << endl;
 	auto start = std::chrono::steady_clock::now();
 	copy_engine& _copy = copy_engine::get_instance();
-	_copy.init();
+	_copy.init(settings);
 	auto start_prepare = std::chrono::steady_clock::now();
 
 	_copy.copy_prepare(s, d);
@@ -165,6 +196,8 @@ void tester(const wstring& s, const wstring& d, bool just_prepare = false, bool
 	wcout << _T("files: ") << _copy.num_files_to_process_ts() << endl;
 	wcout << _T("folders: ") << _copy.num_folders_to_process_ts() << endl;
 	wcout << _T("size: ") << _copy.files_to_process_total_size_bytes_ts() << endl;
+	if (settings.incremental)
+		wcout << _T("skipped (unchanged): ") << _copy.num_files_skipped_ts() << _T(" files, ") << _copy.files_skipped_size_bytes_ts() << _T(" bytes") << endl;
 	wcout << _T("async decision: ") << (_copy.async() ? _T("asynchronous") : _T("synchronous")) << endl;
 	if (mode != copy_engine::async_mode::automatic)
 		wcout << _T("overwriting decision with async_mode")
@@ -183,6 +216,13 @@ void tester(const wstring& s, const wstring& d, bool just_prepare = false, bool
 		auto end_copy = std::chrono::steady_clock::now();;
 		auto duration_copy(std::chrono::duration_cast<std::chrono::milliseconds>(end_copy - start_copy));
 		wcout << _T("copying files took: ") << duration_copy.count() << _T(" milliseconds.\n");
+		copy_stats stats = _copy.stats_ts();
+		wcout << _T("peak memory in flight: ") << stats.peak_in_flight_bytes << _T(" of ") << stats.memory_budget << _T(" bytes\n");
+		if (!_copy.async())
+			wcout << _T("read / write phases: ") << stats.sync_phases << _T(" of ") << stats.phase_size << _T(" bytes\n");
+
+		if (dump_copy)
+			dump_files_to_process(_copy);
 	} else {
 		wcout << _T("skipping copy step!") << endl;
 	}
@@ -192,17 +232,359 @@ void tester(const wstring& s, const wstring& d, bool just_prepare = false, bool
 	wcout << _T("\n\n### Copying files ENDED ###\n\n");
 }
 
+// Same as tester, but listing and copying at the same time (copy_engine::copy_stream)
+void stream_tester(const wstring& s, const wstring& d, copy_engine::async_mode mode = copy_engine::async_mode::automatic, bool dump_copy = false, const copy_settings& settings = copy_settings{}) {
+	wcout << _T("\n\n### Streaming files STARTED ###\n\n");
+	wcout << _T("source: ") << s << endl << _T("dest: ") << d << endl;
+	auto start = std::chrono::steady_clock::now();
+	copy_engine& _copy = copy_engine::get_instance();
+	_copy.init(settings);
+
+	_copy.copy_stream(s, d, mode);
+
+	auto end = std::chrono::steady_clock::now();
+	auto duration(std::chrono::duration_cast<std::chrono::milliseconds>(end - start));
+	wcout << _T("files: ") << _copy.num_files_to_process_ts() << endl;
+	wcout << _T("folders: ") << _copy.num_folders_to_process_ts() << endl;
+	wcout << _T("size: ") << _copy.files_to_process_total_size_bytes_ts() << endl;
+	if (settings.incremental)
+		wcout << _T("skipped (unchanged): ") << _copy.num_files_skipped_ts() << _T(" files, ") << _copy.files_skipped_size_bytes_ts() << _T(" bytes") << endl;
+	wcout << _T("async decision: ") << (_copy.async() ? _T("asynchronous") : _T("synchronous")) << endl;
+	copy_stats stats = _copy.stats_ts();
+	wcout << _T("peak memory in flight: ") << stats.peak_in_flight_bytes << _T(" of ") << stats.memory_budget << _T(" bytes\n");
+	if (!_copy.async())
+		wcout << _T("read / write phases: ") << stats.sync_phases << _T(" of ") << stats.phase_size << _T(" bytes\n");
+
+	if (dump_copy)
+		dump_files_to_process(_copy);
+
+	wcout << _T("listing and copying took: ") << duration.count() << _T(" milliseconds.\n");
+	wcout << _T("\n\n### Streaming files ENDED ###\n\n");
+}
+
+// Copies several sources into d at once through a copy_scheduler (one engine per source, the ones on distinct
+// devices at the same time, writers shared per destination device)
+void jobs_tester(const vector<wstring>& sources, const wstring& d, copy_engine::async_mode mode = copy_engine::async_mode::automatic, bool dump_copy = false, const copy_settings& settings = copy_settings{}) {
+	wcout << _T("\n\n### Scheduling copies STARTED ###\n\n");
+	copy_scheduler copies{ settings, mode };
+	for (auto& s : sources) {
+		wcout << _T("source: ") << s << endl;
+		copies.add_ts(s, d);
+	}
+	wcout << _T("dest: ") << d << endl;
+	auto start = std::chrono::steady_clock::now();
 
+	bool ok = copies.run();
 
-int main()
+	auto end = std::chrono::steady_clock::now();
+	auto duration(std::chrono::duration_cast<std::chrono::milliseconds>(end - start));
+	wcout << _T("copies: ") << sources.size() << (ok ? _T("") : _T(", some failed")) << _T(", at once: ") << copies.max_running_ts() << endl;
+	wcout << _T("files and folders: ") << copies.num_to_process_ts() << endl;
+	copies.for_each_finished([&](const wstring& s, const wstring&, copy_engine& _copy) {
+		wcout << s << _T(": ") << (_copy.async() ? _T("asynchronous") : _T("synchronous")) << _T(", ") << _copy.num_files_to_process_ts() << _T(" files") << endl;
+		if (dump_copy)
+			dump_files_to_process(_copy);
+	});
+
+	wcout << _T("copying took: ") << duration.count() << _T(" milliseconds.\n");
+	wcout << _T("\n\n### Scheduling copies ENDED ###\n\n");
+}
+
+// The queue before the lock free ring: std::queue, one mutex, notify_all on every push and pop.
+// Only kept here as the baseline of queue_bench.
+template<typename DATA>
+class locked_queue {
+public:
+	locked_queue(unsigned int max) : m_max(max) {}
+
+	void push(DATA const& data) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv_push.wait(lock, [this] { return m_queue.size() < m_max; });
+			m_queue.push(data);
+		}
+		m_cv_pop.notify_all();
+	}
+
+	bool timed_wait_and_pop(DATA& popped_value, int wait_time) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (!m_cv_pop.wait_for(lock, std::chrono::milliseconds(wait_time), [this] { return !m_queue.empty(); }))
+				return false;
+			popped_value = m_queue.front();
+			m_queue.pop();
+		}
+		m_cv_push.notify_all();
+		return true;
+	}
+
+private:
+	std::queue<DATA> m_queue;
+	std::mutex m_mutex;
+	std::condition_variable m_cv_pop;
+	std::condition_variable m_cv_push;
+	size_t m_max;
+};
+
+// Moves items through the queue with producers and consumers threads each, returns the elapsed time in milliseconds.
+template<typename QUEUE>
+long long queue_bench_run(const unsigned int& threads, const unsigned int& items) {
+	QUEUE q{ 3000 };
+	std::atomic<unsigned int> popped{ 0U };
+	std::vector<std::thread> workers;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int t = 0; t < threads; ++t) {
+		workers.emplace_back([&] {
+			for (unsigned int i = 0; i < items / threads; ++i)
+				q.push(task_ptr{});
+		});
+		workers.emplace_back([&] {
+			task_ptr task;
+			while (popped.load() < (items / threads) * threads) {
+				if (q.timed_wait_and_pop(task, 10))
+					++popped;
+			}
+		});
+	}
+	for (auto& w : workers)
+		w.join();
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Compares the task queue against the locked baseline for an increasing number of producers / consumers
+void queue_bench() {
+	const unsigned int items = 2000000;
+	wcout << _T("\n\n### Queue benchmark STARTED ###\n\n");
+	wcout << _T("items: ") << items << _T(" (shared_ptr), queue size: 3000") << endl;
+	for (unsigned int threads = 1; threads <= 8; threads *= 2) {
+		long long locked = queue_bench_run<locked_queue<task_ptr>>(threads, items);
+		long long ring = queue_bench_run<task_queue>(threads, items);
+		wcout << threads << _T(" producer(s) / ") << threads << _T(" consumer(s): locked_queue: ") << locked
+			<< _T(" ms, concurrent_queue: ") << ring << _T(" ms") << endl;
+	}
+	wcout << _T("\n\n### Queue benchmark ENDED ###\n\n");
+}
+
+// Checks every crc32 kernel against crc32_bitwise and measures its throughput on a READ_SIZE buffer
+void crc32_bench() {
+	const size_t passes = 20000;
+	std::vector<unsigned char> buff(READ_SIZE);
+	uint32_t seed = 1;
+	for (auto& c : buff) {
+		seed = seed * 1103515245 + 12345;
+		c = static_cast<unsigned char>(seed >> 16);
+	}
+
+	using crc32_func = uint32_t(*)(const void*, size_t, uint32_t);
+	struct kernel {
+		const wchar_t* name;
+		crc32_func f;
+	} kernels[] = {
+		{ _T("crc32_16bytes_prefetch"), [](const void* d, size_t l, uint32_t c) { return crc32::crc32_16bytes_prefetch(d, l, c); } },
+		{ _T("crc32_pclmul"), crc32::crc32_pclmul },
+		{ _T("crc32_vpclmul"), crc32::crc32_vpclmul },
+		{ _T("crc32_hw"), crc32::crc32_hw },
+	};
+
+	wcout << _T("\n\n### CRC32 benchmark STARTED ###\n\n");
+	wcout << _T("crc32_hw kernel: ") << crc32::crc32_kernel_name(crc32::crc32_hw_kernel()) << endl;
+	crc32::crc32_kernel hw = crc32::crc32_hw_kernel();
+	for (auto& k : kernels) {
+		if ((k.f == crc32::crc32_pclmul && hw == crc32::crc32_kernel::slicing_by_16)
+			|| (k.f == crc32::crc32_vpclmul && hw != crc32::crc32_kernel::vpclmul)) {
+			wcout << k.name << _T(": not supported by this CPU") << endl;
+			continue;
+		}
+		bool identical = true;
+		for (size_t length = 0; length <= 1024 && identical; ++length) // every tail / block combination
+			identical = k.f(buff.data() + 1, length, 0x12345678) == crc32::crc32_bitwise(buff.data() + 1, length, 0x12345678);
+
+		auto start = std::chrono::steady_clock::now();
+		uint32_t crc = 0;
+		for (size_t i = 0; i < passes; ++i)
+			crc = k.f(buff.data(), buff.size(), crc);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		wcout << k.name << _T(": ") << (identical ? _T("identical") : _T("MISMATCH")) << _T(", ")
+			<< static_cast<double>(passes * buff.size()) / seconds / 1e9 << _T(" GB/s (crc ") << std::hex << crc << std::dec << _T(")") << endl;
+	}
+	wcout << _T("\n\n### CRC32 benchmark ENDED ###\n\n");
+}
+
+// Checks every all-zero scan kernel with a single non zero byte at every position, and measures its throughput on a
+// READ_SIZE buffer of zeros and its cost on one of data (where it stops right away)
+void zero_bench() {
+	const size_t passes = 20000;
+	std::vector<unsigned char> buff(READ_SIZE);
+
+	using zero_func = bool(*)(const void*, size_t);
+	struct kernel {
+		const wchar_t* name;
+		zero_func f;
+	} kernels[] = {
+		{ _T("is_zero_block_words"), file_copy::is_zero_block_words },
+		{ _T("is_zero_block_sse2"), file_copy::is_zero_block_sse2 },
+		{ _T("is_zero_block_avx2"), file_copy::is_zero_block_avx2 },
+		{ _T("is_zero_block"), file_copy::is_zero_block },
+	};
+
+	wcout << _T("\n\n### Zero scan benchmark STARTED ###\n\n");
+	wcout << _T("is_zero_block kernel: ") << file_copy::zero_block_kernel_name() << endl;
+	const string hw = file_copy::zero_block_kernel_name();
+	for (auto& k : kernels) {
+		if ((k.f == file_copy::is_zero_block_sse2 && hw == "words")
+			|| (k.f == file_copy::is_zero_block_avx2 && hw != "avx2")) {
+			wcout << k.name << _T(": not supported by this CPU") << endl;
+			continue;
+		}
+		bool identical = true;
+		for (size_t length = 0; length <= 300 && identical; ++length) { // every misalignment / tail, a single non zero byte anywhere
+			for (size_t i = 0; i <= length && identical; ++i) {
+				if (i < length)
+					buff[1 + i] = 1;
+				identical = k.f(buff.data() + 1, length) == (i == length);
+				if (i < length)
+					buff[1 + i] = 0;
+			}
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		size_t zeros = 0;
+		for (size_t i = 0; i < passes; ++i)
+			zeros += k.f(buff.data(), buff.size());
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		buff[0] = 1; // data: only the first block is checked
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < passes; ++i)
+			zeros += k.f(buff.data(), buff.size());
+		double data_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		buff[0] = 0;
+		wcout << k.name << _T(": ") << (identical && zeros == passes ? _T("identical") : _T("MISMATCH")) << _T(", zeros ")
+			<< static_cast<double>(passes * buff.size()) / seconds / 1e9 << _T(" GB/s, data ")
+			<< data_seconds * 1e9 / passes << _T(" ns per buffer") << endl;
+	}
+	wcout << _T("\n\n### Zero scan benchmark ENDED ###\n\n");
+}
+
+// Writes, unbuffered, a file whose last chunk is several blocks and a partial one (the whole blocks go around
+// the cache, the partial one through it), the chunks in reverse order like distinct writers, and reads it back
+void unbuffered_tail_test(const wstring& folder) {
+	const size_t first = 16 * UNBUFFERED_ALIGNMENT;
+	const size_t last = 3 * UNBUFFERED_ALIGNMENT + 1234;
+	const wstring path = folder + _T("/unbuffered_tail_test.bin");
+
+	wcout << _T("\n\n### Unbuffered tail test STARTED ###\n\n");
+	char* buff = aligned_alloc_buffer(first + last, UNBUFFERED_ALIGNMENT);
+	for (size_t i = 0; i < first + last; ++i)
+		buff[i] = static_cast<char>(i * 7 + i / 4096);
+
+	bool ok = true;
+	io_backend_ptr io = make_io_backend();
+	io->unbuffered(true);
+	if (io->open_write_preallocate(path, first + last)) {
+		ok = false;
+	} else {
+		size_t count = last;
+		ok = !io->write_at(buff + first, count, first) && count == last;
+		count = first;
+		ok = !io->write_at(buff, count, 0U) && count == first && ok;
+		ok = !io->close(true) && ok;
+	}
+
+	std::vector<char> back(first + last + 1);
+	size_t count = back.size();
+	io = make_io_backend();
+	if (ok)
+		ok = !io->open_read(path) && !io->read(back.data(), count) && count == first + last && !memcmp(back.data(), buff, count);
+	io->close(false);
+	remove(wstring_to_string(path).c_str());
+	aligned_free_buffer(buff);
+	wcout << path << _T(": ") << (ok ? _T("identical") : _T("MISMATCH")) << endl;
+	wcout << _T("\n\n### Unbuffered tail test ENDED ###\n\n");
+}
+
+// usage: file_copy_lib_test [source dest [sync|async|auto [dump] [verify] [stream] [unbuffered] [ranges] [zeros] [layout] [incremental] [jobs]]]
+//           jobs: source is a comma separated list, copied at once (see copy_scheduler)
+//        file_copy_lib_test queue_bench
+//        file_copy_lib_test crc32_bench
+//        file_copy_lib_test zero_bench
+//        file_copy_lib_test unbuffered_tail_test [folder]
+int main(int argc, char* argv[])
 {
+#ifdef _WIN32
 	scoped_stdout_mode stdout_mode{ _O_U8TEXT };
+	wstring source{ _T("c:\\a") };
+	wstring dest{ _T("c:\\b") };
+#else
+	scoped_stdout_mode stdout_mode{ 0 };
+	wstring source{ _T("/dev/shm/a") };
+	wstring dest{ _T("/dev/shm/b") };
+#endif
+	copy_engine::async_mode mode = copy_engine::async_mode::automatic;
+	if (argc == 2 && string(argv[1]) == "queue_bench") {
+		queue_bench();
+		return 0;
+	}
+	if (argc == 2 && string(argv[1]) == "crc32_bench") {
+		crc32_bench();
+		return 0;
+	}
+	if (argc == 2 && string(argv[1]) == "zero_bench") {
+		zero_bench();
+		return 0;
+	}
+	if (argc >= 2 && string(argv[1]) == "unbuffered_tail_test") {
+		unbuffered_tail_test(argc >= 3 ? string_to_wstring(argv[2]) : dest);
+		return 0;
+	}
+	if (argc >= 3) {
+		source = string_to_wstring(argv[1]);
+		dest = string_to_wstring(argv[2]);
+	}
+	if (argc >= 4 && string(argv[3]) != "auto")
+		mode = string(argv[3]) == "async" ? copy_engine::async_mode::async : copy_engine::async_mode::sync;
+	bool dump = false;
+	bool stream = false;
+	bool jobs = false;
+	copy_settings settings;
+	for (int i = 4; i < argc; ++i) {
+		if (string(argv[i]) == "dump")
+			dump = true;
+		else if (string(argv[i]) == "verify")
+			settings.verify = true;
+		else if (string(argv[i]) == "stream")
+			stream = true;
+		else if (string(argv[i]) == "unbuffered")
+			settings.unbuffered = true;
+		else if (string(argv[i]) == "ranges") { // splits files from 4 MB into 1 MB ranges
+			settings.parallel_file_size = 4 * 1024 * 1024;
+			settings.parallel_range_size = 1024 * 1024;
+		}
+		else if (string(argv[i]) == "zeros")
+			settings.skip_zero_blocks = true;
+		else if (string(argv[i]) == "layout")
+			settings.layout_order = true;
+		else if (string(argv[i]) == "incremental")
+			settings.incremental = true;
+		else if (string(argv[i]) == "jobs")
+			jobs = true;
+	}
 	try {
 		/*wcout << _T("testing assynchronous\n");
 		tester(_T("f:\\t1\\filecopy"), _T("f:\\t1"), false, false, copy_engine::async_mode::async);*/
 
-		wcout << _T("testing auto async\n");
-		tester(_T("c:\\a"), _T("c:\\b"), false, false);
+		if (jobs) {
+			vector<wstring> sources;
+			wistringstream list{ source };
+			for (wstring s; getline(list, s, _T(','));)
+				sources.push_back(s);
+			jobs_tester(sources, dest, mode, dump, settings);
+		} else if (stream) {
+			wcout << _T("testing streaming\n");
+			stream_tester(source, dest, mode, dump, settings);
+		} else {
+			wcout << _T("testing auto async\n");
+			tester(source, dest, false, false, mode, dump, settings);
+		}
 
 		/*wcout << _T("testing synchronous\n");
 		tester(_T("e:\\t1\\filecopy"), _T("e:\\t1"), false, false, copy_engine::async_mode::sync);*/